@@ -0,0 +1,26 @@
+# Writes the revision of the tree in benchRevision.h, run on every build
+# of mage_bench. The header is only touched when the revision changed.
+#
+#   cmake -DSOURCE_DIR=<tree> -DOUTPUT=<header> -P benchRevision.cmake
+
+execute_process(
+  COMMAND git describe --always --dirty
+  WORKING_DIRECTORY ${SOURCE_DIR}
+  OUTPUT_VARIABLE MAGE_REVISION
+  OUTPUT_STRIP_TRAILING_WHITESPACE
+  ERROR_QUIET
+)
+
+if (NOT MAGE_REVISION)
+  set(MAGE_REVISION "unknown")
+endif()
+
+set(CONTENT "#define MAGE_REVISION \"${MAGE_REVISION}\"\n")
+
+if (EXISTS ${OUTPUT})
+  file(READ ${OUTPUT} PREVIOUS)
+endif()
+
+if (NOT "${PREVIOUS}" STREQUAL "${CONTENT}")
+  file(WRITE ${OUTPUT} "${CONTENT}")
+endif()
@@ -0,0 +1,571 @@
+#include <getopt.h>
+#include <unistd.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <chrono>
+#include <ctime>
+
+#include <mage.h>
+#include <mockServer.h>
+#include <networkEmulator.h>
+
+#include "benchRevision.h"
+
+#ifndef MAGE_REVISION
+	#define MAGE_REVISION "unknown"
+#endif
+
+using namespace std;
+
+namespace mage {
+
+	//
+	// Gives access to the private steps of the event pipeline
+	//
+	class RPCBenchmark {
+		public:
+			explicit RPCBenchmark(RPC *rpc) : m_pRPC(rpc) {}
+
+			void ExtractEventsFromCommandResponse(const Json::Value& myEvents) {
+				m_pRPC->ExtractEventsFromCommandResponse(myEvents);
+			}
+
+			// Same steps as RPC::ReadCommandResponse and RPC::CompleteCall, once the body is received
+			void ParseCommandResponse(const std::string& body) {
+				Json::Value message;
+				if (!m_oReader.parse(body, message, false) || !message.isObject()) {
+					return;
+				}
+
+				const Json::Value& result = message["result"];
+				if (result.isObject() && result["myEvents"].isArray()) {
+					m_pRPC->ExtractEventsFromCommandResponse(result["myEvents"]);
+				}
+			}
+
+			// Same steps as RPC::PullEvents, once the body is received
+			uint64_t ExtractEventsFromMsgStreamResponse(const std::string& body, size_t chunkSize) {
+				uint64_t eventCount = 0;
+
+				MsgStreamParser parser([&](const std::string& msgId, const Json::Value& events) {
+					m_pRPC->ExtractEventsFromMsgStreamMessage(events, parser.GetChunkTime());
+					eventCount += events.size();
+				}, &m_sBuffer);
+
+				for (size_t offset = 0; offset < body.size(); offset += chunkSize) {
+					parser.Feed(body.data() + offset, std::min(chunkSize, body.size() - offset));
+				}
+				parser.Finish();
+
+				return eventCount;
+			}
+
+			void SetMessagesToConfirm(size_t count) {
+				std::lock_guard<std::recursive_mutex> lock(m_pRPC->msgStreamUrl_mutex);
+
+				m_pRPC->m_oMsgToConfirm.clear();
+				for (size_t i = 1; i <= count; ++i) {
+					m_pRPC->m_oMsgToConfirm.push_back(std::to_string(i));
+				}
+			}
+
+			std::string GetConfirmIds() const {
+				return m_pRPC->GetConfirmIds();
+			}
+
+		private:
+			RPC *m_pRPC;
+			std::string m_sBuffer;
+			Json::Reader m_oReader;
+	};
+
+}  // namespace mage
+
+class NoopObserver : public mage::EventObserver {
+	public:
+		void ReceiveEvent(const std::string& name, const Json::Value& data) const {}
+};
+
+//
+// Runs each benchmark in batches lasting at least the minimum time,
+// and keeps the time per operation of each repetition
+//
+class BenchmarkRunner {
+	public:
+		BenchmarkRunner(const std::string& filter, int minTimeMs, int repetitions)
+		: m_sFilter(filter)
+		, m_oMinTime(std::chrono::milliseconds(minTimeMs))
+		, m_iRepetitions(repetitions)
+		, m_oResults(Json::arrayValue) {}
+
+		// itemsPerOp is the number of events, messages, etc. handled by each operation
+		void Run(const std::string& name, uint64_t itemsPerOp, const std::function<void()>& operation) {
+			if (!m_sFilter.empty() && name.find(m_sFilter) == std::string::npos) {
+				return;
+			}
+
+			cerr << name << "..." << endl;
+
+			// Warm up, and find a batch size lasting long enough
+			uint64_t batch = 1;
+			while (true) {
+				std::chrono::nanoseconds elapsed = RunBatch(batch, operation);
+				if (elapsed >= m_oMinTime) {
+					break;
+				}
+
+				batch = (elapsed * 10 < m_oMinTime) ? batch * 10 : batch * 2;
+			}
+
+			std::vector<double> nsPerOp;
+			for (int i = 0; i < m_iRepetitions; ++i) {
+				nsPerOp.push_back(static_cast<double>(RunBatch(batch, operation).count()) / batch);
+			}
+			std::sort(nsPerOp.begin(), nsPerOp.end());
+
+			double median = nsPerOp[nsPerOp.size() / 2];
+
+			Json::Value result;
+			result["name"]              = name;
+			result["iterations"]        = static_cast<Json::UInt>(batch);
+			result["repetitions"]       = m_iRepetitions;
+			result["nsPerOp"]["median"] = median;
+			result["nsPerOp"]["min"]    = nsPerOp.front();
+			result["nsPerOp"]["max"]    = nsPerOp.back();
+			result["opsPerSecond"]      = 1e9 / median;
+			if (itemsPerOp > 0) {
+				result["itemsPerOp"]     = static_cast<Json::UInt>(itemsPerOp);
+				result["itemsPerSecond"] = 1e9 * itemsPerOp / median;
+			}
+
+			m_oResults.append(result);
+		}
+
+		const Json::Value& GetResults() const {
+			return m_oResults;
+		}
+
+	private:
+		std::chrono::nanoseconds RunBatch(uint64_t batch, const std::function<void()>& operation) {
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			for (uint64_t i = 0; i < batch; ++i) {
+				operation();
+			}
+			return std::chrono::steady_clock::now() - start;
+		}
+
+		std::string m_sFilter;
+		std::chrono::nanoseconds m_oMinTime;
+		int m_iRepetitions;
+		Json::Value m_oResults;
+};
+
+static Json::Value MakeEvent(size_t payloadSize) {
+	Json::Value event(Json::arrayValue);
+	event.append("bench.event");
+	event.append(Json::Value(Json::objectValue));
+	event[1u]["payload"] = std::string(payloadSize, 'x');
+	return event;
+}
+
+static Json::Value MakeMyEvents(size_t count, size_t payloadSize) {
+	Json::FastWriter writer;
+	Json::Value myEvents(Json::arrayValue);
+
+	std::string serializedEvent = writer.write(MakeEvent(payloadSize));
+	for (size_t i = 0; i < count; ++i) {
+		myEvents.append(serializedEvent);
+	}
+
+	return myEvents;
+}
+
+static std::string MakeMsgStreamResponse(size_t messageCount, size_t eventsPerMessage, size_t payloadSize) {
+	Json::FastWriter writer;
+	Json::Value events(Json::arrayValue);
+	for (size_t i = 0; i < eventsPerMessage; ++i) {
+		events.append(MakeEvent(payloadSize));
+	}
+
+	std::string serializedEvents = writer.write(events);
+	serializedEvents.resize(serializedEvents.size() - 1);
+
+	std::ostringstream body;
+	body << "{";
+	for (size_t i = 1; i <= messageCount; ++i) {
+		body << (i > 1 ? "," : "") << "\"" << i << "\":" << serializedEvents;
+	}
+	body << "}";
+
+	return body.str();
+}
+
+static void BenchEventPipeline(BenchmarkRunner *runner) {
+	mage::RPC client("bench");
+	mage::RPCBenchmark bench(&client);
+
+	NoopObserver observer;
+	client.AddObserver(&observer);
+
+	size_t counts[] = {1, 10, 100};
+	for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i) {
+		Json::Value myEvents = MakeMyEvents(counts[i], 64);
+		runner->Run("command_response/events:" + std::to_string(counts[i]), counts[i], [&]() {
+			bench.ExtractEventsFromCommandResponse(myEvents);
+		});
+	}
+
+	size_t messageCounts[] = {1, 10, 100};
+	for (size_t i = 0; i < sizeof(messageCounts) / sizeof(messageCounts[0]); ++i) {
+		std::string body = MakeMsgStreamResponse(messageCounts[i], 5, 64);
+		runner->Run("msgstream_response/messages:" + std::to_string(messageCounts[i]) + "/events:5",
+		            messageCounts[i] * 5, [&]() {
+			bench.ExtractEventsFromMsgStreamResponse(body, 16384);
+		});
+	}
+}
+
+// Responses from a capture written by RPC::SetTrafficRecorder
+static void BenchCapture(BenchmarkRunner *runner, const std::string& path) {
+	mage::TrafficReader reader;
+	if (!reader.Open(path)) {
+		cerr << "Unable to read the capture " << path << endl;
+		return;
+	}
+
+	std::vector<std::string> commandResponses;
+	std::vector<std::string> msgStreamResponses;
+
+	try {
+		mage::TrafficRecord record;
+		while (reader.Next(&record)) {
+			if (!record.error.empty() || record.response.empty()) {
+				continue;
+			}
+
+			if (record.kind == mage::COMMAND_REQUEST) {
+				commandResponses.push_back(record.response);
+			} else if (record.response != "HB") {
+				msgStreamResponses.push_back(record.response);
+			}
+		}
+	} catch (const mage::MageError& e) {
+		cerr << e.what() << endl;
+	}
+
+	mage::RPC client("bench");
+	mage::RPCBenchmark bench(&client);
+
+	NoopObserver observer;
+	client.AddObserver(&observer);
+
+	if (!commandResponses.empty()) {
+		runner->Run("capture/command_responses", commandResponses.size(), [&]() {
+			for (size_t i = 0; i < commandResponses.size(); ++i) {
+				bench.ParseCommandResponse(commandResponses[i]);
+			}
+		});
+	}
+
+	if (!msgStreamResponses.empty()) {
+		runner->Run("capture/msgstream_responses", msgStreamResponses.size(), [&]() {
+			for (size_t i = 0; i < msgStreamResponses.size(); ++i) {
+				try {
+					bench.ExtractEventsFromMsgStreamResponse(msgStreamResponses[i], 16384);
+				} catch (const mage::MageError& e) {
+				}
+			}
+		});
+	}
+}
+
+static void BenchMsgStreamUrl(BenchmarkRunner *runner) {
+	mage::RPC client("bench");
+	mage::RPCBenchmark bench(&client);
+	client.SetSession("0123456789abcdef0123456789abcdef");
+
+	size_t counts[] = {0, 10, 100};
+	for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i) {
+		bench.SetMessagesToConfirm(counts[i]);
+
+		runner->Run("msgstream_url/confirm:" + std::to_string(counts[i]), 0, [&]() {
+			client.GetMsgStreamUrl(mage::LONGPOLLING);
+		});
+
+		runner->Run("confirm_ids/confirm:" + std::to_string(counts[i]), counts[i], [&]() {
+			bench.GetConfirmIds();
+		});
+	}
+}
+
+static void BenchObserverDispatch(BenchmarkRunner *runner) {
+	Json::Value data = MakeEvent(64)[1u];
+
+	size_t counts[] = {1, 10, 100};
+	for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i) {
+		mage::RPC client("bench");
+		std::vector<NoopObserver> observers(counts[i]);
+		for (size_t j = 0; j < observers.size(); ++j) {
+			client.AddObserver(&observers[j]);
+		}
+
+		runner->Run("dispatch/observers:" + std::to_string(counts[i]), counts[i], [&]() {
+			client.ReceiveEvent("bench.event", data);
+		});
+	}
+}
+
+static void BenchCalls(BenchmarkRunner *runner, const std::string& prefix, mage::RPC *client) {
+	Json::Value params;
+	params["value"] = 1;
+
+	std::function<void(mage::MageError, Json::Value)> callback = [](mage::MageError error, Json::Value res) {};
+
+	runner->Run(prefix + "/sync", 0, [&]() {
+		client->Call("bench.echo", params);
+	});
+
+	runner->Run(prefix + "/sync_move", 0, [&]() {
+		client->Call("bench.echo", Json::Value(params));
+	});
+
+	runner->Run(prefix + "/future_async", 0, [&]() {
+		client->Call("bench.echo", params, true).get();
+	});
+
+	runner->Run(prefix + "/future_deferred", 0, [&]() {
+		client->Call("bench.echo", params, false).get();
+	});
+
+	runner->Run(prefix + "/callback_async", 0, [&]() {
+		client->Call("bench.echo", params, callback, true).get();
+	});
+
+	runner->Run(prefix + "/callback_deferred", 0, [&]() {
+		client->Call("bench.echo", params, callback, false).get();
+	});
+
+	runner->Run(prefix + "/thread", 0, [&]() {
+		client->Join(client->Call("bench.echo", params, callback));
+	});
+}
+
+// Sessions of a context, each with a call in flight at the same time
+static void BenchConcurrentCalls(BenchmarkRunner *runner, const std::string& name, const std::string& domain,
+                                 mage::HttpVersion version) {
+	static const size_t SESSION_COUNT = 32;
+
+	Json::Value params;
+	params["value"] = 1;
+
+	mage::ClientContext context;
+	std::vector<mage::RPC*> clients;
+	for (size_t i = 0; i < SESSION_COUNT; ++i) {
+		clients.push_back(new mage::RPC(&context, "bench", domain));
+		clients.back()->SetHttpVersion(version);
+	}
+
+	std::vector<std::future<Json::Value> > results(SESSION_COUNT);
+	runner->Run(name, SESSION_COUNT, [&]() {
+		for (size_t i = 0; i < SESSION_COUNT; ++i) {
+			results[i] = clients[i]->Call("bench.echo", params, true);
+		}
+		for (size_t i = 0; i < SESSION_COUNT; ++i) {
+			results[i].get();
+		}
+	});
+
+	for (size_t i = 0; i < SESSION_COUNT; ++i) {
+		delete clients[i];
+	}
+}
+
+// Commands with a large body, sent as is or gzipped
+static void BenchLargeCalls(BenchmarkRunner *runner, const std::string& name, const std::string& domain,
+                            size_t compressionThreshold) {
+	Json::Value params;
+	for (unsigned int i = 0; i < 1024; ++i) {
+		params["items"][i]["id"]    = i;
+		params["items"][i]["label"] = "item";
+		params["items"][i]["count"] = i % 16;
+	}
+
+	mage::RPC client("bench", domain);
+	client.SetRequestCompression(compressionThreshold);
+	// Learns from a first response whether the server accepts gzip
+	client.Call("bench.echo", Json::Value());
+
+	runner->Run(name, 0, [&]() {
+		client.Call("bench.echo", params);
+	});
+}
+
+static void BenchCallOverhead(BenchmarkRunner *runner, const mage::NetworkConditions *conditions) {
+	// In process, over the loopback interface
+	mage::MockServer server("bench");
+	server.Start();
+
+	// Or through an emulated network
+	mage::NetworkEmulator emulator(server.GetDomain());
+	if (conditions != nullptr) {
+		emulator.SetConditions(*conditions);
+		emulator.Start();
+	}
+
+	std::string domain = (conditions != nullptr) ? emulator.GetDomain() : server.GetDomain();
+
+	mage::RPC client("bench", domain);
+	BenchCalls(runner, "call", &client);
+
+	// Over a Unix domain socket, without the TCP loopback
+	if (conditions == nullptr) {
+		mage::MockServer unixServer("bench", 0, "/tmp/mage_bench_" + std::to_string(getpid()) + ".sock");
+		unixServer.Start();
+
+		mage::RPC unixClient("bench", unixServer.GetDomain(), unixServer.GetProtocol());
+		BenchCalls(runner, "call_unix", &unixClient);
+
+		unixServer.Stop();
+	}
+
+	// Without any socket or HTTP: the cost of the SDK alone
+	using namespace std::placeholders;
+	mage::LoopbackTransport transport(std::bind(&mage::MockServer::Handle, &server, _1, _2));
+	client.SetTransport(&transport);
+	BenchCalls(runner, "call_loopback", &client);
+	client.SetTransport(nullptr);
+
+	// On the I/O loop and the workers of a shared context
+	{
+		mage::ClientContext context;
+		mage::RPC contextClient(&context, "bench", domain);
+		BenchCalls(runner, "call_context", &contextClient);
+	}
+
+	// Over HTTP/2 with prior knowledge (h2c): the calls of all the
+	// sessions share one connection
+	{
+		mage::ClientContext context;
+		mage::RPC contextClient(&context, "bench", domain);
+		contextClient.SetHttpVersion(mage::HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+		BenchCalls(runner, "call_context_h2c", &contextClient);
+	}
+
+	BenchConcurrentCalls(runner, "call_concurrent/http1.1", domain, mage::HTTP_VERSION_1_1);
+	BenchConcurrentCalls(runner, "call_concurrent/h2c", domain, mage::HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+
+	BenchLargeCalls(runner, "call_large/plain", domain, 0);
+	BenchLargeCalls(runner, "call_large/gzip", domain, 1024);
+
+	emulator.Stop();
+	server.Stop();
+}
+
+void showHelp() {
+	cout << "  Usage: mage_bench [-f [filter]] [-t [time]] [-r [repetitions]] [-c [capture]] [-n [conditions]] "
+	        "[-o [file]] [-h]" << endl;
+	cout << endl;
+	cout << "    -f\tOnly run the benchmarks whose name contains this string" << endl;
+	cout << "    -t\tMinimum duration of each repetition, in milliseconds (default: 200)" << endl;
+	cout << "    -r\tNumber of repetitions of each benchmark (default: 5)" << endl;
+	cout << "    -c\tAlso measure the parsing of the responses of this capture" << endl;
+	cout << "    -n\tRun the call benchmarks through an emulated network (3g, latency=10ms,jitter=2ms...)" << endl;
+	cout << "      \t(the calls must succeed: failure and reset are not allowed)" << endl;
+	cout << "    -o\tWrite the JSON results in this file (default: standard output)" << endl;
+	cout << "    -h\tShow this help screen" << endl;
+	cout << endl;
+}
+
+int main(int argc, char *argv[]) {
+	std::string filter = "";
+	std::string output = "";
+	std::string capture = "";
+	std::string networkConditions = "";
+	int minTimeMs = 200;
+	int repetitions = 5;
+
+	int c;
+
+	while((c = getopt(argc, argv, "f:t:r:c:n:o:h")) != -1) {
+		switch (c) {
+			case 'f':
+				filter = std::string(optarg);
+				break;
+			case 't':
+				minTimeMs = atoi(optarg);
+				break;
+			case 'r':
+				repetitions = atoi(optarg);
+				break;
+			case 'c':
+				capture = std::string(optarg);
+				break;
+			case 'n':
+				networkConditions = std::string(optarg);
+				break;
+			case 'o':
+				output = std::string(optarg);
+				break;
+			case 'h':
+				showHelp();
+				return 0;
+			default:
+				showHelp();
+				return 1;
+		}
+	}
+
+	if (minTimeMs <= 0 || repetitions <= 0) {
+		cerr << "  Invalid parameters" << endl;
+		showHelp();
+		return 1;
+	}
+
+	mage::NetworkConditions conditions;
+	if (!mage::NetworkConditions::Parse(networkConditions, &conditions) ||
+	    conditions.failureRate > 0 || conditions.resetRate > 0) {
+		cerr << "  Invalid network conditions: " << networkConditions << endl;
+		showHelp();
+		return 1;
+	}
+
+	BenchmarkRunner runner(filter, minTimeMs, repetitions);
+
+	BenchEventPipeline(&runner);
+	BenchMsgStreamUrl(&runner);
+	BenchObserverDispatch(&runner);
+	BenchCallOverhead(&runner, networkConditions.empty() ? nullptr : &conditions);
+	if (!capture.empty()) {
+		BenchCapture(&runner, capture);
+	}
+
+	char date[32];
+	time_t now = time(nullptr);
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+	Json::Value results;
+	results["context"]["revision"]    = MAGE_REVISION;
+	results["context"]["date"]        = date;
+	results["context"]["minTimeMs"]   = minTimeMs;
+	results["context"]["repetitions"] = repetitions;
+	results["context"]["capture"]     = capture;
+	results["context"]["network"]     = networkConditions;
+#if defined(__VERSION__)
+	results["context"]["compiler"]    = __VERSION__;
+#endif
+	results["benchmarks"] = runner.GetResults();
+
+	Json::StyledWriter writer;
+	if (output.empty()) {
+		cout << writer.write(results);
+		return 0;
+	}
+
+	std::ofstream file(output.c_str());
+	file << writer.write(results);
+	return file.good() ? 0 : 1;
+}
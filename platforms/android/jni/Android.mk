@@ -9,7 +9,19 @@ MAGE_SRC_DIR := $(LOCAL_PATH)/../../../src
 LIBJSONRPC_SRC_DIR := $(LOCAL_PATH)/../../../vendor/libjson-rpc-cpp/src
 
 LOCAL_SRC_FILES := $(MAGE_SRC_DIR)/exceptions.cpp \
+				   $(MAGE_SRC_DIR)/bufferPool.cpp \
+				   $(MAGE_SRC_DIR)/circuitBreaker.cpp \
+				   $(MAGE_SRC_DIR)/clientContext.cpp \
+				   $(MAGE_SRC_DIR)/curlTransport.cpp \
+				   $(MAGE_SRC_DIR)/endpointSelector.cpp \
+				   $(MAGE_SRC_DIR)/httpTransport.cpp \
+				   $(MAGE_SRC_DIR)/loopbackTransport.cpp \
+				   $(MAGE_SRC_DIR)/metrics.cpp \
+				   $(MAGE_SRC_DIR)/msgStreamParser.cpp \
+				   $(MAGE_SRC_DIR)/requestTiming.cpp \
 				   $(MAGE_SRC_DIR)/rpc.cpp \
+				   $(MAGE_SRC_DIR)/traceRecorder.cpp \
+				   $(MAGE_SRC_DIR)/trafficCapture.cpp \
 				   $(LIBJSONRPC_SRC_DIR)/jsonrpc/client.cpp \
 				   $(LIBJSONRPC_SRC_DIR)/jsonrpc/clientconnector.cpp \
 				   $(LIBJSONRPC_SRC_DIR)/jsonrpc/connectors/mongoose.c \
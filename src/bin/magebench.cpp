@@ -0,0 +1,650 @@
+#include <getopt.h>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <queue>
+#include <memory>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+#include <mage.h>
+#include <networkEmulator.h>
+
+using namespace mage;
+using namespace std;
+
+struct BenchCommand {
+	std::string name;
+	Json::Value params;
+	double weight;
+};
+
+//
+// What each client does: log in once (optional), then send commands
+// picked at random according to their weight, waiting for a think time
+// between two commands
+//
+struct Scenario {
+	bool hasLogin;
+	BenchCommand login;
+	std::vector<BenchCommand> commands;
+	double totalWeight;
+};
+
+static std::atomic<uint64_t> s_iEventsReceived(0);
+
+class BenchClient : public mage::EventObserver {
+	public:
+		BenchClient(mage::ClientContext *context, const std::string& application, const std::string& domain,
+		            const std::string& protocol)
+		: m_oClient(context, application, domain, protocol)
+		, m_bIsLoggedIn(false)
+		, m_bIsPolling(false) {
+			m_oClient.AddObserver(this);
+		}
+
+		virtual void ReceiveEvent(const std::string& name, const Json::Value& data = Json::Value::null) const {
+			s_iEventsReceived.fetch_add(1, std::memory_order_relaxed);
+
+			if (name == "session.set") {
+				m_oClient.SetSession(data["key"].asString());
+			}
+		}
+
+		mutable mage::RPC m_oClient;
+		// Only used by the worker running the client
+		bool m_bIsLoggedIn;
+		bool m_bIsPolling;
+		Json::Value m_oLoginParams;
+};
+
+struct ScheduledClient {
+	std::chrono::steady_clock::time_point time;
+	size_t index;
+
+	bool operator>(const ScheduledClient& other) const {
+		return time > other.time;
+	}
+};
+
+//
+// Runs the clients on a fixed pool of workers, so that thousands of
+// clients do not need thousands of threads (except for long polling,
+// where the SDK uses a thread per client unless they share a context)
+//
+class LoadGenerator {
+	public:
+		LoadGenerator(const Scenario& scenario, std::vector<std::unique_ptr<BenchClient> > *clients,
+		              std::chrono::milliseconds thinkTime, bool longPolling)
+		: m_oScenario(scenario)
+		, m_pClients(clients)
+		, m_oThinkTime(thinkTime)
+		, m_bLongPolling(longPolling)
+		, m_bIsRunning(false) {}
+
+		void Start(size_t workerCount, std::chrono::milliseconds rampUp) {
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+			// Spread the first command of each client over the ramp up
+			for (size_t i = 0; i < m_pClients->size(); ++i) {
+				ScheduledClient scheduled = {now + rampUp * i / m_pClients->size(), i};
+				m_oQueue.push(scheduled);
+			}
+
+			m_bIsRunning = true;
+			for (size_t i = 0; i < workerCount; ++i) {
+				m_oWorkers.push_back(std::thread(&LoadGenerator::Work, this));
+			}
+		}
+
+		void Stop() {
+			{
+				std::lock_guard<std::mutex> lock(m_oMutex);
+				m_bIsRunning = false;
+			}
+			m_oCondition.notify_all();
+
+			for (size_t i = 0; i < m_oWorkers.size(); ++i) {
+				m_oWorkers[i].join();
+			}
+			m_oWorkers.clear();
+		}
+
+		mage::MetricsTable& GetMetrics() {
+			return m_oMetrics;
+		}
+
+		// Time the commands waited for a free worker past their schedule
+		mage::RequestStats GetScheduleLag() const {
+			std::vector<mage::RequestStats> stats = m_oScheduleLag.GetStats();
+			if (!stats.empty()) {
+				return stats[0];
+			}
+
+			// Nothing was sent
+			mage::RequestStats none = mage::RequestStats();
+			none.name = "schedule lag";
+			return none;
+		}
+
+	private:
+		void Work() {
+			std::mt19937 engine(std::hash<std::thread::id>()(std::this_thread::get_id()));
+			std::unique_lock<std::mutex> lock(m_oMutex);
+
+			while (m_bIsRunning) {
+				if (m_oQueue.empty()) {
+					m_oCondition.wait(lock);
+					continue;
+				}
+
+				ScheduledClient scheduled = m_oQueue.top();
+				if (scheduled.time > std::chrono::steady_clock::now()) {
+					m_oCondition.wait_until(lock, scheduled.time);
+					continue;
+				}
+
+				m_oQueue.pop();
+				lock.unlock();
+
+				RunNextCommand(m_pClients->at(scheduled.index).get(), scheduled.time, &engine);
+
+				// Exponential think time, as independent users would do
+				std::exponential_distribution<double> thinkTime(1.0 / std::max<int64_t>(m_oThinkTime.count(), 1));
+				scheduled.time = std::chrono::steady_clock::now() +
+				                 std::chrono::microseconds(static_cast<int64_t>(thinkTime(engine) * 1000));
+
+				lock.lock();
+				m_oQueue.push(scheduled);
+				m_oCondition.notify_one();
+			}
+		}
+
+		// The latency counts from when the command was due, not from when a
+		// worker got to it: once the workers are all busy, the commands
+		// waiting for one are slowed down as much as those being sent
+		// (and not left out of the measures, as coordinated omission would).
+		void RunNextCommand(BenchClient *client, const std::chrono::steady_clock::time_point& scheduled,
+		                    std::mt19937 *engine) {
+			bool isLogin = m_oScenario.hasLogin && !client->m_bIsLoggedIn;
+			const BenchCommand *command = isLogin ? &m_oScenario.login : PickCommand(engine);
+			const Json::Value& params = isLogin ? client->m_oLoginParams : command->params;
+
+			mage_error_t result = MAGE_SUCCESS;
+			m_oScheduleLag.Get("schedule lag")->Record(mage::MicrosecondsSince(scheduled));
+
+			try {
+				client->m_oClient.Call(command->name, params);
+			} catch (const mage::MageError& e) {
+				result = static_cast<mage::mage_error_t>(e.type());
+			} catch (const std::exception& e) {
+				result = MAGE_ERROR;
+			}
+
+			m_oMetrics.Get(command->name)->Record(mage::MicrosecondsSince(scheduled), result);
+
+			if (isLogin && result == MAGE_SUCCESS) {
+				client->m_bIsLoggedIn = true;
+
+				if (m_bLongPolling && !client->m_bIsPolling) {
+					client->m_oClient.StartPolling(mage::LONGPOLLING);
+					client->m_bIsPolling = true;
+				}
+			}
+		}
+
+		const BenchCommand* PickCommand(std::mt19937 *engine) {
+			std::uniform_real_distribution<double> distribution(0, m_oScenario.totalWeight);
+			double pick = distribution(*engine);
+
+			for (size_t i = 0; i < m_oScenario.commands.size(); ++i) {
+				pick -= m_oScenario.commands[i].weight;
+				if (pick < 0) {
+					return &m_oScenario.commands[i];
+				}
+			}
+
+			return &m_oScenario.commands.back();
+		}
+
+		const Scenario& m_oScenario;
+		std::vector<std::unique_ptr<BenchClient> > *m_pClients;
+		std::chrono::milliseconds m_oThinkTime;
+		bool m_bLongPolling;
+
+		mage::MetricsTable m_oMetrics;
+		mage::MetricsTable m_oScheduleLag;
+
+		std::priority_queue<ScheduledClient, std::vector<ScheduledClient>,
+		                    std::greater<ScheduledClient> > m_oQueue;
+		std::vector<std::thread> m_oWorkers;
+		std::mutex m_oMutex;
+		std::condition_variable m_oCondition;
+		bool m_bIsRunning;
+};
+
+// Replaces "$client" in the strings of the parameters by the client number
+static Json::Value ReplaceClientNumber(const Json::Value& value, size_t number) {
+	if (value.isString()) {
+		std::string content = value.asString();
+		size_t position;
+		while ((position = content.find("$client")) != std::string::npos) {
+			content.replace(position, 7, std::to_string(number));
+		}
+		return content;
+	}
+
+	Json::Value res = value;
+	if (value.isArray()) {
+		for (unsigned int i = 0; i < value.size(); ++i) {
+			res[i] = ReplaceClientNumber(value[i], number);
+		}
+	} else if (value.isObject()) {
+		Json::Value::Members members = value.getMemberNames();
+		for (size_t i = 0; i < members.size(); ++i) {
+			res[members[i]] = ReplaceClientNumber(value[members[i]], number);
+		}
+	}
+
+	return res;
+}
+
+static bool ParseCommand(const Json::Value& value, BenchCommand *command) {
+	if (!value.isObject() || !value["name"].isString()) {
+		return false;
+	}
+
+	command->name   = value["name"].asString();
+	command->params = value.isMember("params") ? value["params"] : Json::Value(Json::objectValue);
+	command->weight = value.get("weight", 1.0).asDouble();
+	return command->weight > 0;
+}
+
+static bool LoadScenario(const std::string& path, Scenario *scenario) {
+	std::ifstream file(path.c_str());
+	Json::Reader reader;
+	Json::Value root;
+
+	if (!file || !reader.parse(file, root, false) || !root.isObject() || !root["commands"].isArray()) {
+		return false;
+	}
+
+	if (root.isMember("login")) {
+		if (!ParseCommand(root["login"], &scenario->login)) {
+			return false;
+		}
+		scenario->hasLogin = true;
+	}
+
+	scenario->commands.clear();
+	for (unsigned int i = 0; i < root["commands"].size(); ++i) {
+		BenchCommand command;
+		if (!ParseCommand(root["commands"][i], &command)) {
+			return false;
+		}
+		scenario->commands.push_back(command);
+	}
+
+	return !scenario->commands.empty();
+}
+
+// name[:weight],name[:weight],...
+static bool ParseCommandMix(const std::string& mix, Scenario *scenario) {
+	std::istringstream stream(mix);
+	std::string entry;
+
+	scenario->commands.clear();
+	while (std::getline(stream, entry, ',')) {
+		BenchCommand command;
+		size_t separator = entry.find(':');
+		command.name   = entry.substr(0, separator);
+		command.params = Json::Value(Json::objectValue);
+		command.weight = (separator == std::string::npos) ? 1.0 : atof(entry.c_str() + separator + 1);
+
+		if (command.name.empty() || command.weight <= 0) {
+			return false;
+		}
+		scenario->commands.push_back(command);
+	}
+
+	return !scenario->commands.empty();
+}
+
+static uint64_t GetErrorCount(const mage::RequestStats& stats) {
+	uint64_t errors = 0;
+	for (int i = 0; i < mage::MAGE_ERROR_TYPE_COUNT; ++i) {
+		errors += stats.errors[i];
+	}
+	return errors;
+}
+
+static uint64_t GetTotalCount(const std::vector<mage::RequestStats>& stats, uint64_t *errors) {
+	uint64_t count = 0;
+	*errors = 0;
+
+	for (size_t i = 0; i < stats.size(); ++i) {
+		count   += stats[i].count;
+		*errors += GetErrorCount(stats[i]);
+	}
+
+	return count;
+}
+
+static void AddTransportStats(mage::TransportStats *total, const mage::TransportStats& stats) {
+	total->requests        += stats.requests;
+	total->failures        += stats.failures;
+	total->newConnections  += stats.newConnections;
+	total->bytesUploaded   += stats.bytesUploaded;
+	total->bytesDownloaded += stats.bytesDownloaded;
+	total->bytesDecoded    += stats.bytesDecoded;
+	total->nameLookupTime  += stats.nameLookupTime;
+	total->connectTime     += stats.connectTime;
+	total->tlsTime         += stats.tlsTime;
+	total->waitTime        += stats.waitTime;
+	total->transferTime    += stats.transferTime;
+	total->totalTime       += stats.totalTime;
+}
+
+void showHelp() {
+	cout << "  Usage: magebench -a [application name] -d [domain] [-p [protocol]] [-c [clients]] "
+	        "[-w [workers]] [-m [mix] | -s [scenario]] [-T [think time]] [-r [ramp up]] [-t [duration]] "
+	        "[-L] [-x] [-2] [-N [conditions]] [-o [file]] [-h]" << endl;
+	cout << endl;
+	cout << "    -a\tThe name of the MAGE application" << endl;
+	cout << "    -d\tThe domain name or IP address where the MAGE instance is hosted" << endl;
+	cout << "    -p\tThe protocol through which you wish to communicate with MAGE (default: http)" << endl;
+	cout << "    -c\tNumber of clients (default: 100)" << endl;
+	cout << "    -w\tNumber of threads sending the commands (default: 64)" << endl;
+	cout << "    -m\tCommands to send, with their weight: name[:weight],... (default: bench.ping)" << endl;
+	cout << "    -s\tJSON scenario: {\"login\": {\"name\", \"params\"}, "
+	        "\"commands\": [{\"name\", \"params\", \"weight\"}]}" << endl;
+	cout << "    \t\"$client\" in the login parameters is replaced by the client number" << endl;
+	cout << "    -T\tMean think time between two commands of a client, in milliseconds (default: 1000)" << endl;
+	cout << "    -r\tTime for all the clients to start, in seconds (default: 10)" << endl;
+	cout << "    -t\tDuration of the test, in seconds (default: 60)" << endl;
+	cout << "    -L\tLong poll the message stream once logged in (one thread per client, unless -x)" << endl;
+	cout << "    -x\tRun all the clients on a shared client context: one I/O thread and its workers" << endl;
+	cout << "    -2\tSpeak HTTP/2 over cleartext (h2c) without upgrade, multiplexed with -x" << endl;
+	cout << "    -N\tSend the requests through an emulated network, such as 3g or latency=50ms,loss=1%" << endl;
+	cout << "    -o\tWrite the results as JSON in this file" << endl;
+	cout << "    -h\tShow this help screen" << endl;
+	cout << endl;
+}
+
+int main(int argc, char *argv[]) {
+	std::string application = "";
+	std::string domain = "";
+	std::string protocol = "http";
+	std::string output = "";
+	long clientCount = 100;
+	long workerCount = 64;
+	long thinkTimeMs = 1000;
+	long rampUpSecs = 10;
+	long durationSecs = 60;
+	bool longPolling = false;
+	bool sharedContext = false;
+	bool http2 = false;
+	std::string networkConditions = "";
+
+	Scenario scenario;
+	scenario.hasLogin = false;
+	ParseCommandMix("bench.ping", &scenario);
+
+	int c;
+
+	while((c = getopt(argc, argv, "a:d:p:c:w:m:s:T:r:t:Lx2N:o:h")) != -1) {
+		switch (c) {
+			case 'a':
+				application = std::string(optarg);
+				break;
+			case 'd':
+				domain = std::string(optarg);
+				break;
+			case 'p':
+				protocol = std::string(optarg);
+				break;
+			case 'c':
+				clientCount = atol(optarg);
+				break;
+			case 'w':
+				workerCount = atol(optarg);
+				break;
+			case 'm':
+				if (!ParseCommandMix(optarg, &scenario)) {
+					cerr << "  Invalid command mix: " << optarg << endl;
+					return 1;
+				}
+				break;
+			case 's':
+				if (!LoadScenario(optarg, &scenario)) {
+					cerr << "  Invalid scenario: " << optarg << endl;
+					return 1;
+				}
+				break;
+			case 'T':
+				thinkTimeMs = atol(optarg);
+				break;
+			case 'r':
+				rampUpSecs = atol(optarg);
+				break;
+			case 't':
+				durationSecs = atol(optarg);
+				break;
+			case 'L':
+				longPolling = true;
+				break;
+			case 'x':
+				sharedContext = true;
+				break;
+			case '2':
+				http2 = true;
+				break;
+			case 'N':
+				networkConditions = std::string(optarg);
+				break;
+			case 'o':
+				output = std::string(optarg);
+				break;
+			case 'h':
+				showHelp();
+				return 0;
+			default:
+				showHelp();
+				return 1;
+		}
+	}
+
+	if (application == "" || domain == "") {
+		cerr << "  You need to provide an application name and a domain" << endl;
+		showHelp();
+		return 1;
+	}
+
+	if (clientCount <= 0 || workerCount <= 0 || thinkTimeMs < 0 || rampUpSecs < 0 || durationSecs <= 0) {
+		cerr << "  Invalid parameters" << endl;
+		showHelp();
+		return 1;
+	}
+
+	if (longPolling && !scenario.hasLogin) {
+		cerr << "  Long polling requires a login command in the scenario (-s)" << endl;
+		return 1;
+	}
+
+	NetworkConditions conditions;
+	if (!NetworkConditions::Parse(networkConditions, &conditions)) {
+		cerr << "  Invalid network conditions: " << networkConditions << endl;
+		return 1;
+	}
+
+	// The clients go through the emulator, which forwards to the domain
+	std::unique_ptr<NetworkEmulator> emulator;
+	std::string clientDomain = domain;
+	if (!networkConditions.empty()) {
+		if (protocol != "http") {
+			cerr << "  Network conditions can only be emulated over http" << endl;
+			return 1;
+		}
+
+		try {
+			emulator.reset(new NetworkEmulator(domain.find(':') == std::string::npos ? domain + ":80" : domain));
+			emulator->SetConditions(conditions);
+			emulator->Start();
+		} catch (const std::exception& e) {
+			cerr << "  " << e.what() << endl;
+			return 1;
+		}
+
+		clientDomain = emulator->GetDomain();
+	}
+
+	scenario.totalWeight = 0;
+	for (size_t i = 0; i < scenario.commands.size(); ++i) {
+		scenario.totalWeight += scenario.commands[i].weight;
+	}
+
+	// Declared before the clients, which must be destroyed first
+	std::unique_ptr<mage::ClientContext> context;
+	if (sharedContext) {
+		context.reset(new mage::ClientContext());
+	}
+
+	std::vector<std::unique_ptr<BenchClient> > clients;
+	for (long i = 0; i < clientCount; ++i) {
+		clients.push_back(std::unique_ptr<BenchClient>(
+			new BenchClient(context.get(), application, clientDomain, protocol)));
+		if (http2) {
+			clients.back()->m_oClient.SetHttpVersion(mage::HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+		}
+		clients.back()->m_oLoginParams = ReplaceClientNumber(scenario.login.params, i);
+	}
+
+	cerr << "Starting " << clientCount << " clients on " << workerCount << " workers, against "
+	     << protocol << "://" << domain << "/" << application
+	     << (emulator ? " with " + networkConditions : "")
+	     << (context ? " on a shared client context" : "")
+	     << (http2 ? " over h2c" : "") << endl;
+
+	LoadGenerator generator(scenario, &clients, std::chrono::milliseconds(thinkTimeMs), longPolling);
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	generator.Start(workerCount, std::chrono::seconds(rampUpSecs));
+
+	// Progress, every 5 seconds
+	uint64_t lastCount = 0;
+	for (long elapsed = 5; elapsed <= durationSecs + 4; elapsed += 5) {
+		std::this_thread::sleep_until(start + std::chrono::seconds(std::min(elapsed, durationSecs)));
+
+		uint64_t errors;
+		uint64_t count = GetTotalCount(generator.GetMetrics().GetStats(), &errors);
+		long interval = std::min(elapsed, durationSecs) - (elapsed - 5);
+		cerr << "[" << std::min(elapsed, durationSecs) << "s] "
+		     << (count - lastCount) / std::max(interval, 1L) << " commands/s, "
+		     << count << " commands, " << errors << " errors, "
+		     << s_iEventsReceived.load() << " events" << endl;
+		lastCount = count;
+	}
+
+	generator.Stop();
+	uint64_t eventsReceived = s_iEventsReceived.load();
+	double duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	if (longPolling) {
+		cerr << "Waiting for the long polling requests to end" << endl;
+	}
+
+	// Totals of the HTTP requests, as seen by the SDK
+	mage::MetricsSnapshot results = mage::MetricsSnapshot();
+	results.commands = generator.GetMetrics().GetStats();
+	for (size_t i = 0; i < clients.size(); ++i) {
+		if (clients[i]->m_bIsPolling) {
+			clients[i]->m_oClient.StopPolling();
+		}
+
+		// The clients of a context share its metrics
+		if (context && i > 0) {
+			continue;
+		}
+
+		mage::MetricsSnapshot snapshot = clients[i]->m_oClient.GetMetrics();
+		for (int j = mage::COMMAND_REQUEST; j <= mage::MSGSTREAM_REQUEST; ++j) {
+			AddTransportStats(&results.transport[j], snapshot.transport[j]);
+		}
+	}
+
+	uint64_t errors;
+	uint64_t count = GetTotalCount(results.commands, &errors);
+
+	// Large when the workers can not keep up with the clients (-w)
+	mage::RequestStats scheduleLag = generator.GetScheduleLag();
+
+	Json::Value report;
+	report["clients"]           = static_cast<Json::UInt64>(clientCount);
+	report["workers"]           = static_cast<Json::UInt64>(workerCount);
+	report["sharedContext"]     = sharedContext;
+	report["http2"]             = http2;
+	report["durationSeconds"]   = duration;
+	report["commandsPerSecond"] = count / duration;
+	report["commands"]          = static_cast<Json::UInt64>(count);
+	report["errors"]            = static_cast<Json::UInt64>(errors);
+	report["errorRate"]         = count > 0 ? static_cast<double>(errors) / count : 0.0;
+	report["eventsReceived"]    = static_cast<Json::UInt64>(eventsReceived);
+
+	Json::Value metrics = results.ToJson();
+	report["latency"]   = metrics["commands"];
+	report["transport"] = metrics["transport"];
+
+	report["scheduleLag"]["p50"] = static_cast<Json::UInt64>(scheduleLag.p50);
+	report["scheduleLag"]["p99"] = static_cast<Json::UInt64>(scheduleLag.p99);
+	report["scheduleLag"]["max"] = static_cast<Json::UInt64>(scheduleLag.max);
+
+	if (emulator) {
+		emulator->Stop();
+
+		NetworkEmulatorStats networkStats = emulator->GetStats();
+		report["network"]["conditions"] = networkConditions;
+		report["network"]["failures"]   = static_cast<Json::UInt64>(networkStats.failures);
+		report["network"]["resets"]     = static_cast<Json::UInt64>(networkStats.resets);
+		report["network"]["losses"]     = static_cast<Json::UInt64>(networkStats.losses);
+	}
+
+	cout << endl << std::fixed << std::setprecision(1)
+	     << "Commands:   " << count << " (" << count / duration << "/s)" << endl
+	     << "Errors:     " << errors << " (" << (count > 0 ? 100.0 * errors / count : 0.0) << "%)" << endl
+	     << "Events:     " << eventsReceived << endl
+	     << "Late:       p50 " << scheduleLag.p50 / 1000.0 << " ms, p99 " << scheduleLag.p99 / 1000.0
+	     << " ms, max " << scheduleLag.max / 1000.0 << " ms behind schedule" << endl
+	     << endl
+	     << std::left << std::setw(32) << "Command" << std::right
+	     << std::setw(10) << "count" << std::setw(10) << "errors"
+	     << std::setw(10) << "p50 ms" << std::setw(10) << "p90 ms"
+	     << std::setw(10) << "p99 ms" << std::setw(10) << "p999 ms" << endl;
+
+	for (size_t i = 0; i < results.commands.size(); ++i) {
+		const mage::RequestStats& stats = results.commands[i];
+		uint64_t commandErrors = GetErrorCount(stats);
+
+		cout << std::left << std::setw(32) << stats.name << std::right
+		     << std::setw(10) << stats.count << std::setw(10) << commandErrors
+		     << std::setw(10) << stats.p50 / 1000.0 << std::setw(10) << stats.p90 / 1000.0
+		     << std::setw(10) << stats.p99 / 1000.0 << std::setw(10) << stats.p999 / 1000.0 << endl;
+	}
+
+	if (!output.empty()) {
+		Json::StyledWriter writer;
+		std::ofstream file(output.c_str());
+		file << writer.write(report);
+		if (!file.good()) {
+			cerr << "  Unable to write " << output << endl;
+			return 1;
+		}
+	}
+
+	return 0;
+}
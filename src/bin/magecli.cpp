@@ -1,5 +1,10 @@
 #include <getopt.h>
 #include <iostream>
+#include <fstream>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <chrono>
 #include <readline/readline.h>
 #include <readline/history.h>
 
@@ -94,7 +99,8 @@ std::string greyBold(const std::string& text) {
 }
 
 void showHelp() {
-	cout << magentaBold("  Usage: magecli -a [application name] -d [domain] [-p [protocol]] [-h]") << endl;
+	cout << magentaBold("  Usage: magecli -a [application name] -d [domain] [-p [protocol]] "
+	                    "[-f [file] [-c [concurrency]]] [-h]") << endl;
 	cout << endl;
 
 	cout << cyan("    -a\t");
@@ -109,6 +115,15 @@ void showHelp() {
 	cout << grey("The protocol through which you wish to communicate with MAGE (default: http)");
 	cout << endl;
 
+	cout << cyan("    -f\t");
+	cout << grey("Run the commands of this file (- for the standard input), one per line, "
+	             "and print the results as JSON lines");
+	cout << endl;
+
+	cout << cyan("    -c\t");
+	cout << grey("Number of commands of the file sent at the same time (default: 1)");
+	cout << endl;
+
 	cout << cyan("    -h\t");
 	cout << grey("Show this help screen");
 	cout << endl;
@@ -137,14 +152,184 @@ class CliEventObserver : public mage::EventObserver {
 		mage::RPC* m_pClient;
 };
 
+//
+// Non-interactive mode: one result (or event) per line, as JSON
+//
+static std::mutex s_oOutputMutex;
+
+static void writeJsonLine(const Json::Value& value) {
+	Json::FastWriter writer;
+	std::string line = writer.write(value);
+
+	std::lock_guard<std::mutex> lock(s_oOutputMutex);
+	cout << line << std::flush;
+}
+
+class ScriptEventObserver : public mage::EventObserver {
+	public:
+		explicit ScriptEventObserver(mage::RPC* client) : m_pClient(client) {}
+		virtual void ReceiveEvent(const std::string& name,
+								  const Json::Value& data = Json::Value::null) const {
+			Json::Value line;
+			line["event"] = name;
+			line["data"]  = data;
+			writeJsonLine(line);
+
+			if (name == "session.set") {
+				m_pClient->SetSession(data["key"].asString());
+			}
+		}
+
+	private:
+		mage::RPC* m_pClient;
+};
+
+static const char* const ERROR_TYPES[] = {"error", "success", "client", "rpc", "message"};
+
+// Returns false if the command failed
+static bool runScriptCommand(mage::RPC* client, unsigned int lineNumber,
+                             const std::string& userCommand, const Json::Value& params) {
+	Json::Value line;
+	line["line"]    = lineNumber;
+	line["command"] = userCommand;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	try {
+		line["result"] = client->Call(userCommand, params);
+		line["status"] = "ok";
+	} catch (const mage::MageError& e) {
+		line["status"]           = "error";
+		line["error"]["type"]    = ERROR_TYPES[e.type()];
+		line["error"]["code"]    = e.code();
+		line["error"]["message"] = e.what();
+	} catch (const std::exception& e) {
+		line["status"]           = "error";
+		line["error"]["type"]    = "error";
+		line["error"]["message"] = e.what();
+	}
+
+	line["latencyMs"] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	writeJsonLine(line);
+
+	return line["status"] == "ok";
+}
+
+//
+// Runs the commands of a script, up to concurrency of them at a time.
+// setSession, clearSession, pullEvents and wait are barriers: they wait
+// for the commands sent before them to be done.
+//
+int runScript(mage::RPC* client, std::istream& input, int concurrency) {
+	std::deque<std::future<bool> > pending;
+	std::string command;
+	unsigned int lineNumber = 0;
+	unsigned int commandCount = 0;
+	unsigned int errorCount = 0;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	auto waitOldest = [&]() {
+		if (!pending.front().get()) {
+			++errorCount;
+		}
+		pending.pop_front();
+	};
+
+	auto waitAll = [&]() {
+		while (!pending.empty()) {
+			waitOldest();
+		}
+	};
+
+	while (std::getline(input, command)) {
+		++lineNumber;
+
+		if (!command.empty() && command[command.size() - 1] == '\r') {
+			command.resize(command.size() - 1);
+		}
+
+		if (command.empty() || command[0] == '#') {
+			continue;
+		}
+
+		std::size_t pos = command.find(' ');
+		std::string userCommand = command.substr(0, pos);
+		std::string data = (pos == std::string::npos) ? "{}" : command.substr(pos + 1);
+
+		if (userCommand == "exit") {
+			break;
+		}
+
+		if (userCommand == "wait") {
+			waitAll();
+			continue;
+		}
+
+		if (userCommand == "setSession") {
+			if (pos == std::string::npos) {
+				cerr << "line " << lineNumber << ": setSession needs a session key" << endl;
+				++errorCount;
+				continue;
+			}
+
+			waitAll();
+			client->SetSession(data);
+			continue;
+		}
+
+		if (userCommand == "clearSession") {
+			waitAll();
+			client->ClearSession();
+			continue;
+		}
+
+		if (userCommand == "pullEvents") {
+			waitAll();
+			try {
+				client->PullEvents(data == "longpolling" ? LONGPOLLING : SHORTPOLLING);
+			} catch (const mage::MageError& e) {
+				cerr << "line " << lineNumber << ": " << e.what() << endl;
+				++errorCount;
+			}
+			continue;
+		}
+
+		Json::Reader reader;
+		Json::Value params;
+		if (!reader.parse(data, params)) {
+			cerr << "line " << lineNumber << ": invalid JSON data" << endl;
+			++errorCount;
+			continue;
+		}
+
+		if (static_cast<int>(pending.size()) >= concurrency) {
+			waitOldest();
+		}
+
+		++commandCount;
+		pending.push_back(std::async(std::launch::async, runScriptCommand,
+		                             client, lineNumber, userCommand, params));
+	}
+
+	waitAll();
+
+	cerr << commandCount << " commands, " << errorCount << " errors in "
+	     << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << "s" << endl;
+
+	return errorCount > 0 ? 2 : 0;
+}
+
 int main(int argc, char *argv[]) {
 	std::string application = "";
 	std::string domain = "";
 	std::string protocol = "http";
+	std::string scriptFile = "";
+	int concurrency = 1;
 
 	char c;
 
-	while((c = getopt(argc, argv, "a:d:p:h")) != -1) {
+	while((c = getopt(argc, argv, "a:d:p:f:c:h")) != -1) {
 		switch (c) {
 			case 'a':
 				application = std::string(optarg);
@@ -155,6 +340,12 @@ int main(int argc, char *argv[]) {
 			case 'p':
 				protocol = std::string(optarg);
 				break;
+			case 'f':
+				scriptFile = std::string(optarg);
+				break;
+			case 'c':
+				concurrency = atoi(optarg);
+				break;
 			case 'h':
 				showHelp();
 				return 0;
@@ -176,6 +367,33 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
+	if (concurrency < 1) {
+		cerr << endl;
+		cerr << redBold("  The concurrency must be at least 1") << endl;
+		cerr << endl;
+		showHelp();
+		return 1;
+	}
+
+	if (scriptFile != "") {
+		mage::RPC client(application, domain, protocol);
+
+		ScriptEventObserver eventObserver(&client);
+		client.AddObserver(&eventObserver);
+
+		if (scriptFile == "-") {
+			return runScript(&client, cin, concurrency);
+		}
+
+		std::ifstream file(scriptFile.c_str());
+		if (!file) {
+			cerr << redBold("  Unable to open ") << scriptFile << endl;
+			return 1;
+		}
+
+		return runScript(&client, file, concurrency);
+	}
+
 	cout << cyan("Connecting to application ");
 	cout << magentaBold(application);
 	cout << yellowBold("@");
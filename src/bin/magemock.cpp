@@ -0,0 +1,199 @@
+#include <getopt.h>
+#include <signal.h>
+#include <iostream>
+#include <cstdlib>
+#include <thread>
+#include <atomic>
+#include <memory>
+
+#include <mockServer.h>
+#include <networkEmulator.h>
+
+using namespace mage;
+using namespace std;
+
+static std::atomic<bool> s_bShouldStop(false);
+
+static void onSignal(int) {
+	s_bShouldStop = true;
+}
+
+void showHelp() {
+	cout << "  Usage: magemock [-a [application name]] [-p [port]] [-u [socket]] [-l [min,max]] "
+	        "[-e [interval]] [-n [events]] [-s [size]] [-S [command]] [-z [size]] [-N [conditions]] [-h]" << endl;
+	cout << endl;
+	cout << "    -a\tThe name of the application to serve (default: game)" << endl;
+	cout << "    -p\tThe port to listen on (default: 8080)" << endl;
+	cout << "    -u\tListen on this Unix domain socket instead, for the http+unix protocol" << endl;
+	cout << "    -l\tLatency of each response, in milliseconds (default: 0,0)" << endl;
+	cout << "    -e\tSend a message to every session each interval, in milliseconds (default: never)" << endl;
+	cout << "    -n\tNumber of events in each message (default: 1)" << endl;
+	cout << "    -s\tSize of the data of each event, in bytes (default: 64)" << endl;
+	cout << "    -S\tAnswer this command with a session.set event, with a new session key" << endl;
+	cout << "    -z\tGzip the responses of at least this size, in bytes, when accepted (default: never)" << endl;
+	cout << "    -N\tEmulate these network conditions on the port, such as 3g or latency=50ms,loss=1%" << endl;
+	cout << "      \tPresets: edge, 3g, 4g, wifi" << endl;
+	cout << "      \tSettings: latency, jitter, bandwidth, loss, retransmission, failure, reset" << endl;
+	cout << "    -h\tShow this help screen" << endl;
+	cout << endl;
+}
+
+int main(int argc, char *argv[]) {
+	std::string application = "game";
+	int port = 8080;
+	long minLatency = 0;
+	long maxLatency = 0;
+	long interval = 0;
+	long eventCount = 1;
+	long payloadSize = 64;
+	long compressionThreshold = 0;
+	std::string loginCommand = "";
+	std::string networkConditions = "";
+	std::string socketPath = "";
+
+	int c;
+
+	while((c = getopt(argc, argv, "a:p:u:l:e:n:s:S:z:N:h")) != -1) {
+		switch (c) {
+			case 'a':
+				application = std::string(optarg);
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'u':
+				socketPath = std::string(optarg);
+				break;
+			case 'l': {
+				char *end;
+				minLatency = strtol(optarg, &end, 10);
+				maxLatency = (*end == ',') ? strtol(end + 1, nullptr, 10) : minLatency;
+				break;
+			}
+			case 'e':
+				interval = atol(optarg);
+				break;
+			case 'n':
+				eventCount = atol(optarg);
+				break;
+			case 's':
+				payloadSize = atol(optarg);
+				break;
+			case 'S':
+				loginCommand = std::string(optarg);
+				break;
+			case 'z':
+				compressionThreshold = atol(optarg);
+				break;
+			case 'N':
+				networkConditions = std::string(optarg);
+				break;
+			case 'h':
+				showHelp();
+				return 0;
+			default:
+				cerr << endl;
+				showHelp();
+				return 1;
+		}
+	}
+
+	if (port <= 0 || port > 65535 || minLatency < 0 || maxLatency < minLatency ||
+	    eventCount < 0 || payloadSize < 0 || compressionThreshold < 0 ||
+	    (!socketPath.empty() && (socketPath[0] != '/' || !networkConditions.empty()))) {
+		cerr << "  Invalid parameters" << endl;
+		showHelp();
+		return 1;
+	}
+
+	NetworkConditions conditions;
+	if (!NetworkConditions::Parse(networkConditions, &conditions)) {
+		cerr << "  Invalid network conditions: " << networkConditions << endl;
+		showHelp();
+		return 1;
+	}
+
+	// With network conditions the emulator takes the port, in front of the server
+	MockServer server(application, networkConditions.empty() ? static_cast<unsigned short>(port) : 0,
+	                  socketPath.empty() ? "127.0.0.1" : socketPath);
+
+	server.SetCompressionThreshold(static_cast<size_t>(compressionThreshold));
+
+	if (maxLatency > 0) {
+		MockServer::LatencyGenerator latency = MockServer::UniformLatency(
+			std::chrono::milliseconds(minLatency), std::chrono::milliseconds(maxLatency));
+		server.SetCommandLatency(latency);
+		server.SetMsgStreamLatency(latency);
+	}
+
+	if (interval > 0) {
+		Json::Value events = MockServer::GenerateEvents("mock.event", eventCount, payloadSize);
+		server.SetMessageGenerator(std::chrono::milliseconds(interval), [events](const std::string&) {
+			return events;
+		});
+	}
+
+	if (!loginCommand.empty()) {
+		std::shared_ptr<std::atomic<uint64_t> > sessionCount = std::make_shared<std::atomic<uint64_t> >(0);
+		server.SetCommandHandler(loginCommand, [sessionCount](const MockCommand& command, MockReply *reply) {
+			Json::Value event(Json::arrayValue);
+			event.append("session.set");
+			event.append(Json::Value(Json::objectValue));
+			event[1u]["key"] = "mock-session-" + std::to_string(++(*sessionCount));
+
+			reply->result = Json::Value(Json::objectValue);
+			reply->myEvents.append(event);
+		});
+	}
+
+	std::unique_ptr<NetworkEmulator> emulator;
+
+	try {
+		server.Start();
+
+		if (!networkConditions.empty()) {
+			emulator.reset(new NetworkEmulator(server.GetDomain(), static_cast<unsigned short>(port)));
+			emulator->SetConditions(conditions);
+			emulator->Start();
+		}
+	} catch (const std::exception& e) {
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	cout << "Serving " << application << " on " << (emulator ? emulator->GetDomain() : server.GetDomain());
+	if (emulator) {
+		cout << " with " << networkConditions;
+	}
+	cout << endl;
+
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+
+	while (!s_bShouldStop) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+
+	if (emulator) {
+		emulator->Stop();
+	}
+	server.Stop();
+
+	MockServerStats stats = server.GetStats();
+	cout << endl
+	     << "Connections:        " << stats.connections << endl
+	     << "Commands:           " << stats.commands << endl
+	     << "Msgstream requests: " << stats.msgStreamRequests << endl
+	     << "Heartbeats:         " << stats.heartbeats << endl
+	     << "Messages sent:      " << stats.messagesSent << endl
+	     << "Messages confirmed: " << stats.messagesConfirmed << endl;
+
+	if (emulator) {
+		NetworkEmulatorStats networkStats = emulator->GetStats();
+		cout << "Emulated failures:  " << networkStats.failures << endl
+		     << "Emulated resets:    " << networkStats.resets << endl
+		     << "Emulated losses:    " << networkStats.losses << endl;
+	}
+
+	return 0;
+}
@@ -0,0 +1,300 @@
+#include <getopt.h>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#include <curl/curl.h>
+
+#include <mage.h>
+
+using namespace mage;
+using namespace std;
+
+static size_t discardWriter(char *data, size_t size, size_t nmemb, void *userData) {
+	return size * nmemb;
+}
+
+// Sends the recorded requests to another server than the one they were captured from
+static std::string GetTargetUrl(const std::string& url, const std::string& protocol, const std::string& domain) {
+	if (domain.empty()) {
+		return url;
+	}
+
+	size_t hostStart = url.find("://");
+	hostStart = (hostStart == std::string::npos) ? 0 : hostStart + 3;
+
+	size_t pathStart = url.find('/', hostStart);
+	std::string path = (pathStart == std::string::npos) ? "/" : url.substr(pathStart);
+
+	return FormatOrigin(protocol, domain) + path;
+}
+
+//
+// Sends the records from a few threads, each one reusing its connection.
+// With a speed of 0 the records are sent as fast as possible, otherwise
+// each record is sent at its timestamp divided by the speed.
+//
+class Replayer {
+	public:
+		Replayer(const std::vector<TrafficRecord>& records, const std::string& protocol,
+		         const std::string& domain, double speed)
+		: m_oRecords(records)
+		, m_sProtocol(protocol)
+		, m_sDomain(domain)
+		, m_dSpeed(speed)
+		, m_iNext(0)
+		, m_iLate(0) {}
+
+		void Run(size_t workerCount) {
+			m_oStart = std::chrono::steady_clock::now();
+
+			std::vector<std::thread> workers;
+			for (size_t i = 0; i < workerCount; ++i) {
+				workers.push_back(std::thread(&Replayer::Work, this));
+			}
+
+			for (size_t i = 0; i < workers.size(); ++i) {
+				workers[i].join();
+			}
+		}
+
+		const MetricsTable& GetRecorded() const { return m_oRecorded; }
+		const MetricsTable& GetReplayed() const { return m_oReplayed; }
+		// Number of records sent more than 10ms after their time
+		uint64_t GetLateCount() const { return m_iLate.load(); }
+
+	private:
+		void Work() {
+			CURL *c = curl_easy_init();
+			if (!c) {
+				cerr << "Unable to initialize curl" << endl;
+				return;
+			}
+
+			size_t index;
+			while ((index = m_iNext.fetch_add(1)) < m_oRecords.size()) {
+				const TrafficRecord& record = m_oRecords[index];
+
+				if (m_dSpeed > 0) {
+					std::chrono::steady_clock::time_point due = m_oStart +
+						std::chrono::microseconds(static_cast<int64_t>(record.timestamp / m_dSpeed));
+
+					if (std::chrono::steady_clock::now() > due + std::chrono::milliseconds(10)) {
+						m_iLate.fetch_add(1);
+					}
+					std::this_thread::sleep_until(due);
+				}
+
+				Send(c, record);
+			}
+
+			curl_easy_cleanup(c);
+		}
+
+		void Send(CURL *c, const TrafficRecord& record) {
+			std::string url = GetTargetUrl(record.url, m_sProtocol, m_sDomain);
+			struct curl_slist *headers = nullptr;
+
+			curl_easy_reset(c);
+
+			std::string socketPath;
+			std::string socketUrl;
+			if (ParseUnixSocketUrl(url, &socketPath, &socketUrl)) {
+				curl_easy_setopt(c, CURLOPT_UNIX_SOCKET_PATH, socketPath.c_str());
+				url = socketUrl;
+			}
+			curl_easy_setopt(c, CURLOPT_URL, url.c_str());
+			curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, discardWriter);
+
+			if (record.kind == COMMAND_REQUEST) {
+				headers = curl_slist_append(headers, "Content-Type: application/json");
+				if (!record.sessionKey.empty()) {
+					headers = curl_slist_append(headers, ("X-MAGE-SESSION: " + record.sessionKey).c_str());
+				}
+
+				curl_easy_setopt(c, CURLOPT_HTTPHEADER, headers);
+				curl_easy_setopt(c, CURLOPT_POSTFIELDS, record.request.c_str());
+				curl_easy_setopt(c, CURLOPT_POSTFIELDSIZE, static_cast<long>(record.request.size()));
+			}
+
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			CURLcode res = curl_easy_perform(c);
+			uint64_t latency = MicrosecondsSince(start);
+
+			long httpStatus = 0;
+			curl_easy_getinfo(c, CURLINFO_RESPONSE_CODE, &httpStatus);
+			curl_slist_free_all(headers);
+
+			bool isRecordedError = !record.error.empty();
+			bool isError = (res != CURLE_OK || httpStatus != 200);
+
+			m_oRecorded.Get(record.name)->Record(record.duration, isRecordedError ? MAGE_RPC_ERROR : MAGE_SUCCESS);
+			m_oReplayed.Get(record.name)->Record(latency, isError ? MAGE_RPC_ERROR : MAGE_SUCCESS);
+		}
+
+		const std::vector<TrafficRecord>& m_oRecords;
+		std::string m_sProtocol;
+		std::string m_sDomain;
+		double m_dSpeed;
+
+		std::chrono::steady_clock::time_point m_oStart;
+		std::atomic<size_t> m_iNext;
+		std::atomic<uint64_t> m_iLate;
+
+		MetricsTable m_oRecorded;
+		MetricsTable m_oReplayed;
+};
+
+void showHelp() {
+	cout << "  Usage: magereplay -f [capture] [-d [domain]] [-p [protocol]] [-s [speed]] [-c [connections]] "
+	        "[-k] [-o [file]] [-h]" << endl;
+	cout << endl;
+	cout << "    -f\tThe capture file, written by RPC::SetTrafficRecorder" << endl;
+	cout << "    -d\tSend the requests to this domain instead of the captured one" << endl;
+	cout << "    -p\tThe protocol to use with -d (default: http)" << endl;
+	cout << "    -s\tSpeed of the replay, 1 for the captured pace, 0 for as fast as possible (default: 1)" << endl;
+	cout << "    -c\tNumber of requests sent at the same time (default: 32)" << endl;
+	cout << "    -k\tSkip the message stream requests" << endl;
+	cout << "    -o\tWrite the results as JSON in this file" << endl;
+	cout << "    -h\tShow this help screen" << endl;
+	cout << endl;
+}
+
+int main(int argc, char *argv[]) {
+	std::string capture = "";
+	std::string domain = "";
+	std::string protocol = "http";
+	std::string output = "";
+	double speed = 1;
+	long connections = 32;
+	bool skipMsgStream = false;
+
+	int c;
+
+	while((c = getopt(argc, argv, "f:d:p:s:c:ko:h")) != -1) {
+		switch (c) {
+			case 'f':
+				capture = std::string(optarg);
+				break;
+			case 'd':
+				domain = std::string(optarg);
+				break;
+			case 'p':
+				protocol = std::string(optarg);
+				break;
+			case 's':
+				speed = atof(optarg);
+				break;
+			case 'c':
+				connections = atol(optarg);
+				break;
+			case 'k':
+				skipMsgStream = true;
+				break;
+			case 'o':
+				output = std::string(optarg);
+				break;
+			case 'h':
+				showHelp();
+				return 0;
+			default:
+				showHelp();
+				return 1;
+		}
+	}
+
+	if (capture == "" || speed < 0 || connections <= 0) {
+		cerr << "  Invalid parameters" << endl;
+		showHelp();
+		return 1;
+	}
+
+	TrafficReader reader;
+	if (!reader.Open(capture)) {
+		cerr << "  Unable to read the capture " << capture << endl;
+		return 1;
+	}
+
+	std::vector<TrafficRecord> records;
+	try {
+		TrafficRecord record;
+		while (reader.Next(&record)) {
+			if (skipMsgStream && record.kind == MSGSTREAM_REQUEST) {
+				continue;
+			}
+
+			// Only the requests are sent again
+			record.response.clear();
+			records.push_back(record);
+		}
+	} catch (const MageError& e) {
+		cerr << "  " << e.what() << " Replaying the first " << records.size() << " records." << endl;
+	}
+
+	cerr << "Replaying " << records.size() << " requests" << endl;
+
+	curl_global_init(CURL_GLOBAL_ALL);
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	Replayer replayer(records, protocol, domain, speed);
+	replayer.Run(static_cast<size_t>(connections));
+	double duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::vector<RequestStats> recorded = replayer.GetRecorded().GetStats();
+	std::vector<RequestStats> replayed = replayer.GetReplayed().GetStats();
+
+	cout << std::fixed << std::setprecision(1)
+	     << "Requests:   " << records.size() << " in " << duration << "s (" << records.size() / duration << "/s)"
+	     << endl
+	     << "Late:       " << replayer.GetLateCount() << endl
+	     << endl
+	     << std::left << std::setw(32) << "Request" << std::right
+	     << std::setw(10) << "count" << std::setw(10) << "errors"
+	     << std::setw(14) << "p50 ms (rec)" << std::setw(10) << "p50 ms"
+	     << std::setw(14) << "p99 ms (rec)" << std::setw(10) << "p99 ms" << endl;
+
+	Json::Value results;
+	results["capture"]         = capture;
+	results["speed"]           = speed;
+	results["durationSeconds"] = duration;
+	results["late"]            = static_cast<Json::UInt64>(replayer.GetLateCount());
+
+	for (size_t i = 0; i < replayed.size(); ++i) {
+		const RequestStats& stats = replayed[i];
+
+		const RequestStats *captured = nullptr;
+		for (size_t j = 0; j < recorded.size(); ++j) {
+			if (recorded[j].name == stats.name) {
+				captured = &recorded[j];
+			}
+		}
+
+		cout << std::left << std::setw(32) << stats.name << std::right
+		     << std::setw(10) << stats.count << std::setw(10) << stats.errors[MAGE_RPC_ERROR]
+		     << std::setw(14) << (captured ? captured->p50 / 1000.0 : 0) << std::setw(10) << stats.p50 / 1000.0
+		     << std::setw(14) << (captured ? captured->p99 / 1000.0 : 0) << std::setw(10) << stats.p99 / 1000.0
+		     << endl;
+	}
+
+	MetricsSnapshot snapshot = MetricsSnapshot();
+	snapshot.commands = recorded;
+	results["recorded"] = snapshot.ToJson()["commands"];
+	snapshot.commands = replayed;
+	results["replayed"] = snapshot.ToJson()["commands"];
+
+	if (!output.empty()) {
+		Json::StyledWriter writer;
+		std::ofstream file(output.c_str());
+		file << writer.write(results);
+		if (!file.good()) {
+			cerr << "  Unable to write " << output << endl;
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,61 @@
+#include "bufferPool.h"
+
+namespace mage {
+
+	BufferPool::BufferPool(size_t maxBuffers)
+	: m_iMaxBuffers(maxBuffers) {
+		m_oFreeBuffers.reserve(maxBuffers);
+	}
+
+	BufferPool::~BufferPool() {
+		std::vector<std::string*>::iterator it;
+		for (it = m_oFreeBuffers.begin(); it != m_oFreeBuffers.end(); ++it) {
+			delete *it;
+		}
+	}
+
+	std::string* BufferPool::Acquire(size_t sizeHint) {
+		std::string *buffer = nullptr;
+
+		m_oMutex.lock();
+		if (!m_oFreeBuffers.empty()) {
+			buffer = m_oFreeBuffers.back();
+			m_oFreeBuffers.pop_back();
+		}
+		m_oMutex.unlock();
+
+		if (buffer == nullptr) {
+			buffer = new std::string();
+		}
+
+		if (sizeHint > buffer->capacity()) {
+			buffer->reserve(sizeHint);
+		}
+
+		return buffer;
+	}
+
+	void BufferPool::Release(std::string *buffer) {
+		if (buffer == nullptr) {
+			return;
+		}
+
+		buffer->clear();
+
+		// Do not keep the memory of an exceptionally large response
+		if (buffer->capacity() > BUFFER_POOL_HIGH_WATER_MARK) {
+			delete buffer;
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(m_oMutex);
+
+		if (m_oFreeBuffers.size() >= m_iMaxBuffers) {
+			delete buffer;
+			return;
+		}
+
+		m_oFreeBuffers.push_back(buffer);
+	}
+
+}  // namespace mage
@@ -0,0 +1,62 @@
+#ifndef MAGEBUFFER_POOL_H
+#define MAGEBUFFER_POOL_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+
+#ifndef BUFFER_POOL_MAX_BUFFERS
+	#define BUFFER_POOL_MAX_BUFFERS 4
+#endif
+
+// Capacity above which a released buffer is freed rather than kept
+#ifndef BUFFER_POOL_HIGH_WATER_MARK
+	#define BUFFER_POOL_HIGH_WATER_MARK (1024 * 1024)
+#endif
+
+namespace mage {
+
+	//
+	// Keeps the receive buffers around between requests so that
+	// the transport does not have to allocate and grow a new one
+	// every time.
+	//
+	// Buffers which grew above the high-water mark (after a very large
+	// response for instance) are freed instead of being kept in the pool.
+	//
+	class BufferPool {
+		public:
+			explicit BufferPool(size_t maxBuffers = BUFFER_POOL_MAX_BUFFERS);
+			~BufferPool();
+
+			std::string* Acquire(size_t sizeHint = 0);
+			void Release(std::string *buffer);
+
+		private:
+			size_t m_iMaxBuffers;
+			std::vector<std::string*> m_oFreeBuffers;
+			std::mutex m_oMutex;
+	};
+
+	//
+	// Returns the buffer to its pool when going out of scope
+	//
+	class PooledBuffer {
+		public:
+			PooledBuffer(BufferPool *pool, size_t sizeHint = 0)
+			: m_pPool(pool)
+			, m_pBuffer(pool->Acquire(sizeHint)) {}
+			~PooledBuffer() { m_pPool->Release(m_pBuffer); }
+
+			std::string* Get() const { return m_pBuffer; }
+
+		private:
+			PooledBuffer(const PooledBuffer&);
+			PooledBuffer& operator=(const PooledBuffer&);
+
+			BufferPool  *m_pPool;
+			std::string *m_pBuffer;
+	};
+
+}  // namespace mage
+#endif /* MAGEBUFFER_POOL_H */
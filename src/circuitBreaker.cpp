@@ -0,0 +1,127 @@
+#include "circuitBreaker.h"
+
+namespace mage {
+
+	static const uint8_t FAILED = 1;
+	static const uint8_t SLOW   = 2;
+
+	const char* GetCircuitStateName(CircuitState state) {
+		switch (state) {
+			case CIRCUIT_CLOSED:
+				return "closed";
+			case CIRCUIT_OPEN:
+				return "open";
+			case CIRCUIT_HALF_OPEN:
+				return "half-open";
+			default:
+				return "unknown";
+		}
+	}
+
+	CircuitBreakerSettings::CircuitBreakerSettings()
+	: window(CIRCUIT_BREAKER_WINDOW)
+	, minRequests(CIRCUIT_BREAKER_MIN_REQUESTS)
+	, failureRate(CIRCUIT_BREAKER_FAILURE_RATE)
+	, slowCallDuration(CIRCUIT_BREAKER_SLOW_CALL_MS)
+	, slowCallRate(CIRCUIT_BREAKER_SLOW_CALL_RATE)
+	, openDuration(CIRCUIT_BREAKER_OPEN_MS)
+	, probes(CIRCUIT_BREAKER_PROBES) {
+	}
+
+	CircuitBreaker::CircuitBreaker(const CircuitBreakerSettings& settings)
+	: m_oSettings(settings)
+	, m_iState(CIRCUIT_CLOSED)
+	, m_oOutcomes((settings.window > 0) ? settings.window : 1, 0)
+	, m_iNextOutcome(0)
+	, m_iOutcomeCount(0)
+	, m_iFailures(0)
+	, m_iSlowCalls(0)
+	, m_iProbes(0)
+	, m_iProbeSuccesses(0) {
+		if (m_oSettings.probes == 0) {
+			m_oSettings.probes = 1;
+		}
+	}
+
+	bool CircuitBreaker::IsAvailable(const std::chrono::steady_clock::time_point& now) const {
+		switch (m_iState) {
+			case CIRCUIT_OPEN:
+				return now >= m_oOpenUntil;
+			case CIRCUIT_HALF_OPEN:
+				return m_iProbes < m_oSettings.probes;
+			default:
+				return true;
+		}
+	}
+
+	void CircuitBreaker::Acquire(const std::chrono::steady_clock::time_point& now) {
+		if (m_iState == CIRCUIT_OPEN && now >= m_oOpenUntil) {
+			m_iState          = CIRCUIT_HALF_OPEN;
+			m_iProbes         = 0;
+			m_iProbeSuccesses = 0;
+		}
+
+		if (m_iState == CIRCUIT_HALF_OPEN) {
+			++m_iProbes;
+		}
+	}
+
+	void CircuitBreaker::Record(bool isSuccess, uint64_t latency, const std::chrono::steady_clock::time_point& now) {
+		uint8_t outcome = isSuccess ? 0 : FAILED;
+		if (m_oSettings.slowCallDuration.count() > 0 &&
+		    latency >= static_cast<uint64_t>(m_oSettings.slowCallDuration.count()) * 1000) {
+			outcome |= SLOW;
+		}
+
+		switch (m_iState) {
+			case CIRCUIT_OPEN:
+				// Sent before the circuit opened
+				return;
+			case CIRCUIT_HALF_OPEN:
+				if (outcome != 0) {
+					Open(now);
+				} else if (++m_iProbeSuccesses >= m_oSettings.probes) {
+					Close();
+				}
+				return;
+			default:
+				break;
+		}
+
+		uint8_t& slot = m_oOutcomes[m_iNextOutcome];
+		if (m_iOutcomeCount == m_oOutcomes.size()) {
+			m_iFailures  -= (slot & FAILED) ? 1 : 0;
+			m_iSlowCalls -= (slot & SLOW) ? 1 : 0;
+		} else {
+			++m_iOutcomeCount;
+		}
+
+		slot = outcome;
+		m_iFailures  += (outcome & FAILED) ? 1 : 0;
+		m_iSlowCalls += (outcome & SLOW) ? 1 : 0;
+		m_iNextOutcome = (m_iNextOutcome + 1) % m_oOutcomes.size();
+
+		if (m_iOutcomeCount < m_oSettings.minRequests) {
+			return;
+		}
+
+		if ((m_oSettings.failureRate > 0 && m_iFailures * 100 >= m_oSettings.failureRate * m_iOutcomeCount) ||
+		    (m_oSettings.slowCallRate > 0 && m_iSlowCalls * 100 >= m_oSettings.slowCallRate * m_iOutcomeCount)) {
+			Open(now);
+		}
+	}
+
+	void CircuitBreaker::Open(const std::chrono::steady_clock::time_point& now) {
+		m_iState     = CIRCUIT_OPEN;
+		m_oOpenUntil = now + m_oSettings.openDuration;
+	}
+
+	void CircuitBreaker::Close() {
+		m_iState        = CIRCUIT_CLOSED;
+		m_iNextOutcome  = 0;
+		m_iOutcomeCount = 0;
+		m_iFailures     = 0;
+		m_iSlowCalls    = 0;
+	}
+
+}  // namespace mage
@@ -0,0 +1,113 @@
+#ifndef MAGECIRCUIT_BREAKER_H
+#define MAGECIRCUIT_BREAKER_H
+
+#include <vector>
+#include <chrono>
+#include <cstdint>
+
+// Number of the last requests the rates are measured on
+#ifndef CIRCUIT_BREAKER_WINDOW
+	#define CIRCUIT_BREAKER_WINDOW 20
+#endif
+
+// Requests in the window before the circuit can open
+#ifndef CIRCUIT_BREAKER_MIN_REQUESTS
+	#define CIRCUIT_BREAKER_MIN_REQUESTS 10
+#endif
+
+// Percentage of failed requests which opens the circuit
+#ifndef CIRCUIT_BREAKER_FAILURE_RATE
+	#define CIRCUIT_BREAKER_FAILURE_RATE 50
+#endif
+
+// Requests slower than this are slow, 0 to ignore the latency
+#ifndef CIRCUIT_BREAKER_SLOW_CALL_MS
+	#define CIRCUIT_BREAKER_SLOW_CALL_MS 5000
+#endif
+
+// Percentage of slow requests which opens the circuit
+#ifndef CIRCUIT_BREAKER_SLOW_CALL_RATE
+	#define CIRCUIT_BREAKER_SLOW_CALL_RATE 80
+#endif
+
+// Time an open circuit rejects the requests before probing
+#ifndef CIRCUIT_BREAKER_OPEN_MS
+	#define CIRCUIT_BREAKER_OPEN_MS 5000
+#endif
+
+// Requests let through by a half-open circuit, which all have to
+// succeed for it to close
+#ifndef CIRCUIT_BREAKER_PROBES
+	#define CIRCUIT_BREAKER_PROBES 1
+#endif
+
+namespace mage {
+
+	enum CircuitState {
+		// The requests go through
+		CIRCUIT_CLOSED = 0,
+		// The requests are rejected without being sent
+		CIRCUIT_OPEN,
+		// A few requests go through to probe for a recovery
+		CIRCUIT_HALF_OPEN
+	};
+
+	const char* GetCircuitStateName(CircuitState state);
+
+	struct CircuitBreakerSettings {
+		CircuitBreakerSettings();
+
+		size_t window;
+		size_t minRequests;
+		// Percentages, 0 never opens the circuit
+		unsigned int failureRate;
+		std::chrono::milliseconds slowCallDuration;
+		unsigned int slowCallRate;
+		std::chrono::milliseconds openDuration;
+		size_t probes;
+	};
+
+	//
+	// Closed, the circuit counts the failed and slow requests among the
+	// last ones, and opens once either rate crosses its threshold. Open,
+	// it rejects every request for a while, then turns half-open and
+	// lets a few probes through: it closes again when they succeed, and
+	// opens again as soon as one fails or is slow.
+	//
+	// Not thread safe: EndpointSelector guards the breaker of each
+	// endpoint with its own lock.
+	//
+	class CircuitBreaker {
+		public:
+			explicit CircuitBreaker(const CircuitBreakerSettings& settings = CircuitBreakerSettings());
+
+			CircuitState GetState() const { return m_iState; }
+
+			// Whether a request would be let through now
+			bool IsAvailable(const std::chrono::steady_clock::time_point& now) const;
+			// Called for each request let through, before it is sent
+			void Acquire(const std::chrono::steady_clock::time_point& now);
+			// Outcome of a request, with its latency in microseconds
+			void Record(bool isSuccess, uint64_t latency, const std::chrono::steady_clock::time_point& now);
+
+		private:
+			void Open(const std::chrono::steady_clock::time_point& now);
+			void Close();
+
+			CircuitBreakerSettings m_oSettings;
+			CircuitState m_iState;
+
+			// Last outcomes, as a ring of FAILED and SLOW flags
+			std::vector<uint8_t> m_oOutcomes;
+			size_t m_iNextOutcome;
+			size_t m_iOutcomeCount;
+			size_t m_iFailures;
+			size_t m_iSlowCalls;
+
+			std::chrono::steady_clock::time_point m_oOpenUntil;
+			size_t m_iProbes;
+			size_t m_iProbeSuccesses;
+	};
+
+}  // namespace mage
+#endif /* MAGECIRCUIT_BREAKER_H */
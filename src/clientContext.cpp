@@ -0,0 +1,403 @@
+#include "clientContext.h"
+#include "curlTransport.h"
+
+#include <curl/curl.h>
+
+#include <algorithm>
+#include <iostream>
+#include <exception>
+
+// curl_multi_poll and curl_multi_wakeup came with libcurl 7.68.0, the
+// loop waits on a pipe with select() on the older ones
+#if LIBCURL_VERSION_NUM >= 0x074400
+	#define CLIENT_CONTEXT_MULTI_POLL 1
+#else
+	#include <sys/select.h>
+	#include <fcntl.h>
+#endif
+
+#include <unistd.h>
+
+namespace mage {
+
+	struct ClientContext::Request {
+		Request()
+		: id(0)
+		, request(nullptr)
+		, timing(nullptr)
+		, isInline(false) {}
+
+		uint64_t id;
+		const HttpRequest *request;
+		RequestTiming *timing;
+		CurlRequest curlRequest;
+		Task done;
+		// Completed in the I/O thread, for the synchronous requests
+		bool isInline;
+		std::chrono::steady_clock::time_point startTime;
+	};
+
+	ClientContext::ClientContext(size_t workerCount)
+	: m_pMulti(curl_multi_init())
+	, m_pLoopThread(nullptr)
+	, m_bIsRunning(true)
+	, m_iNextRequestId(1)
+	, m_iActiveCount(0)
+	, m_bIsStopping(false)
+	, m_oBufferPool(workerCount * 2) {
+		m_aWakeupFds[0] = -1;
+		m_aWakeupFds[1] = -1;
+
+		curl_multi_setopt(m_pMulti, CURLMOPT_MAXCONNECTS, static_cast<long>(CLIENT_CONTEXT_MAX_CONNECTIONS));
+#if LIBCURL_VERSION_NUM >= 0x072B00
+		// The concurrent requests to a server share its HTTP/2 connection
+		curl_multi_setopt(m_pMulti, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+
+#if !defined(CLIENT_CONTEXT_MULTI_POLL)
+		if (pipe(m_aWakeupFds) == 0) {
+			fcntl(m_aWakeupFds[0], F_SETFL, fcntl(m_aWakeupFds[0], F_GETFL, 0) | O_NONBLOCK);
+			fcntl(m_aWakeupFds[1], F_SETFL, fcntl(m_aWakeupFds[1], F_GETFL, 0) | O_NONBLOCK);
+		}
+#endif
+
+		for (size_t i = 0; i < std::max<size_t>(workerCount, 1); ++i) {
+			m_oWorkers.push_back(std::thread(&ClientContext::RunWorker, this));
+		}
+
+		m_pLoopThread = new std::thread(&ClientContext::RunLoop, this);
+	}
+
+	ClientContext::~ClientContext() {
+		m_bIsRunning = false;
+		Wakeup();
+
+		m_pLoopThread->join();
+		delete m_pLoopThread;
+
+		// Nothing should be left, as the RPC instances wait for their requests
+		std::vector<Request*> remaining(m_oSubmitted);
+		std::map<uint64_t, Request*>::iterator itr;
+		for (itr = m_oDelayed.begin(); itr != m_oDelayed.end(); ++itr) {
+			remaining.push_back(itr->second);
+		}
+		for (itr = m_oActive.begin(); itr != m_oActive.end(); ++itr) {
+			curl_multi_remove_handle(m_pMulti, itr->second->curlRequest.handle);
+			remaining.push_back(itr->second);
+		}
+		m_oSubmitted.clear();
+		m_oDelayed.clear();
+		m_oActive.clear();
+
+		for (size_t i = 0; i < remaining.size(); ++i) {
+			remaining[i]->timing->error = "The client context was destroyed.";
+			Complete(remaining[i], CURLE_OK);
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_oTaskMutex);
+			m_bIsStopping = true;
+		}
+		m_oTaskCondition.notify_all();
+
+		for (size_t i = 0; i < m_oWorkers.size(); ++i) {
+			m_oWorkers[i].join();
+		}
+
+		for (size_t i = 0; i < m_oIdleHandles.size(); ++i) {
+			curl_easy_cleanup(m_oIdleHandles[i]);
+		}
+
+		curl_multi_cleanup(m_pMulti);
+
+		if (m_aWakeupFds[0] != -1) {
+			close(m_aWakeupFds[0]);
+			close(m_aWakeupFds[1]);
+		}
+	}
+
+	void ClientContext::Send(const HttpRequest& request, ResponseSink *sink, RequestTiming *timing) {
+		std::mutex mutex;
+		std::condition_variable condition;
+		bool isDone = false;
+
+		Request *pending = new Request();
+		pending->request          = &request;
+		pending->timing           = timing;
+		pending->curlRequest.sink = sink;
+		pending->isInline         = true;
+		pending->startTime        = std::chrono::steady_clock::now();
+		pending->done             = [&]() {
+			// Notified with the lock held: the frame of Send can not go away before
+			std::lock_guard<std::mutex> lock(mutex);
+			isDone = true;
+			condition.notify_one();
+		};
+
+		Submit(pending);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		condition.wait(lock, [&]() { return isDone; });
+	}
+
+	uint64_t ClientContext::SendAsync(const HttpRequest& request, ResponseSink *sink, RequestTiming *timing,
+	                                  const Task& done, std::chrono::milliseconds delay) {
+		Request *pending = new Request();
+		pending->request          = &request;
+		pending->timing           = timing;
+		pending->curlRequest.sink = sink;
+		pending->done             = done;
+		pending->startTime        = std::chrono::steady_clock::now() + delay;
+
+		return Submit(pending);
+	}
+
+	void ClientContext::Cancel(uint64_t requestId) {
+		{
+			std::lock_guard<std::mutex> lock(m_oSubmitMutex);
+			m_oCancelled.push_back(requestId);
+		}
+
+		Wakeup();
+	}
+
+	void ClientContext::Post(const Task& task) {
+		{
+			std::lock_guard<std::mutex> lock(m_oTaskMutex);
+			m_oTasks.push_back(task);
+		}
+
+		m_oTaskCondition.notify_one();
+	}
+
+	size_t ClientContext::GetActiveRequestCount() const {
+		return m_iActiveCount.load(std::memory_order_relaxed);
+	}
+
+	uint64_t ClientContext::Submit(Request *request) {
+		uint64_t id;
+		{
+			std::lock_guard<std::mutex> lock(m_oSubmitMutex);
+			id = m_iNextRequestId++;
+			request->id = id;
+			m_oSubmitted.push_back(request);
+		}
+
+		Wakeup();
+		return id;
+	}
+
+	void ClientContext::Complete(Request *request, int result) {
+		if (request->curlRequest.handle != nullptr) {
+			FinishCurlRequest(result, &request->curlRequest, request->timing);
+
+			// Kept for the next requests, with its connection
+			if (m_oIdleHandles.size() < CLIENT_CONTEXT_MAX_CONNECTIONS) {
+				m_oIdleHandles.push_back(request->curlRequest.handle);
+			} else {
+				curl_easy_cleanup(request->curlRequest.handle);
+			}
+		}
+
+		if (request->isInline) {
+			request->done();
+		} else {
+			Post(request->done);
+		}
+
+		delete request;
+	}
+
+	void ClientContext::Wakeup() {
+#if defined(CLIENT_CONTEXT_MULTI_POLL)
+		curl_multi_wakeup(m_pMulti);
+#else
+		if (m_aWakeupFds[1] != -1) {
+			char c = 0;
+			ssize_t written = write(m_aWakeupFds[1], &c, 1);
+			(void) written;
+		}
+#endif
+	}
+
+	void ClientContext::RunLoop() {
+		std::vector<Request*> submitted;
+		std::vector<uint64_t> cancelled;
+		std::multimap<std::chrono::steady_clock::time_point, Request*> delayed;
+
+		while (m_bIsRunning) {
+			{
+				std::lock_guard<std::mutex> lock(m_oSubmitMutex);
+				submitted.swap(m_oSubmitted);
+				cancelled.swap(m_oCancelled);
+			}
+
+			for (size_t i = 0; i < submitted.size(); ++i) {
+				delayed.insert(std::make_pair(submitted[i]->startTime, submitted[i]));
+				m_oDelayed[submitted[i]->id] = submitted[i];
+			}
+			submitted.clear();
+
+			for (size_t i = 0; i < cancelled.size(); ++i) {
+				Request *request = nullptr;
+
+				std::map<uint64_t, Request*>::iterator itr = m_oActive.find(cancelled[i]);
+				if (itr != m_oActive.end()) {
+					request = itr->second;
+					curl_multi_remove_handle(m_pMulti, request->curlRequest.handle);
+					m_oActive.erase(itr);
+					m_iActiveCount.fetch_sub(1, std::memory_order_relaxed);
+				} else if ((itr = m_oDelayed.find(cancelled[i])) != m_oDelayed.end()) {
+					request = itr->second;
+					m_oDelayed.erase(itr);
+
+					std::multimap<std::chrono::steady_clock::time_point, Request*>::iterator ditr;
+					for (ditr = delayed.begin(); ditr != delayed.end(); ++ditr) {
+						if (ditr->second == request) {
+							delayed.erase(ditr);
+							break;
+						}
+					}
+				}
+
+				if (request != nullptr) {
+					request->timing->error = "Request cancelled.";
+					Complete(request, CURLE_OK);
+				}
+			}
+			cancelled.clear();
+
+			// Start the requests which are due
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			while (!delayed.empty() && delayed.begin()->first <= now) {
+				Request *request = delayed.begin()->second;
+				delayed.erase(delayed.begin());
+				m_oDelayed.erase(request->id);
+
+				if (!m_oIdleHandles.empty()) {
+					request->curlRequest.handle = m_oIdleHandles.back();
+					m_oIdleHandles.pop_back();
+				} else {
+					request->curlRequest.handle = curl_easy_init();
+				}
+
+				if (request->curlRequest.handle == nullptr) {
+					request->timing->error = "Unable to initialize curl.";
+					Complete(request, CURLE_OK);
+					continue;
+				}
+
+				PrepareCurlRequest(*request->request, request->curlRequest.sink, &request->curlRequest);
+				curl_easy_setopt(request->curlRequest.handle, CURLOPT_PRIVATE, request);
+				curl_multi_add_handle(m_pMulti, request->curlRequest.handle);
+
+				m_oActive[request->id] = request;
+				m_iActiveCount.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			int running = 0;
+			curl_multi_perform(m_pMulti, &running);
+
+			CURLMsg *message;
+			int queued;
+			while ((message = curl_multi_info_read(m_pMulti, &queued)) != nullptr) {
+				if (message->msg != CURLMSG_DONE) {
+					continue;
+				}
+
+				char *privateData = nullptr;
+				curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, &privateData);
+				Request *request = reinterpret_cast<Request*>(privateData);
+				CURLcode result = message->data.result;
+
+				curl_multi_remove_handle(m_pMulti, message->easy_handle);
+
+				if (ShouldRetryCurlRequest(result, &request->curlRequest)) {
+					PrepareCurlRequest(*request->request, request->curlRequest.sink, &request->curlRequest);
+					curl_easy_setopt(request->curlRequest.handle, CURLOPT_PRIVATE, request);
+					curl_multi_add_handle(m_pMulti, request->curlRequest.handle);
+					continue;
+				}
+
+				m_oActive.erase(request->id);
+				m_iActiveCount.fetch_sub(1, std::memory_order_relaxed);
+
+				Complete(request, result);
+			}
+
+			long timeout = -1;
+			curl_multi_timeout(m_pMulti, &timeout);
+			if (timeout < 0 || timeout > 1000) {
+				timeout = 1000;
+			}
+
+			if (!delayed.empty()) {
+				int64_t untilNext = std::chrono::duration_cast<std::chrono::milliseconds>(
+					delayed.begin()->first - std::chrono::steady_clock::now()).count();
+				timeout = std::max<int64_t>(0, std::min<int64_t>(timeout, untilNext + 1));
+			}
+
+			if (timeout == 0) {
+				continue;
+			}
+
+#if defined(CLIENT_CONTEXT_MULTI_POLL)
+			curl_multi_poll(m_pMulti, nullptr, 0, static_cast<int>(timeout), nullptr);
+#else
+			fd_set readFds, writeFds, errorFds;
+			int maxFd = -1;
+			FD_ZERO(&readFds);
+			FD_ZERO(&writeFds);
+			FD_ZERO(&errorFds);
+			curl_multi_fdset(m_pMulti, &readFds, &writeFds, &errorFds, &maxFd);
+
+			if (m_aWakeupFds[0] != -1) {
+				FD_SET(m_aWakeupFds[0], &readFds);
+				maxFd = std::max(maxFd, m_aWakeupFds[0]);
+			}
+
+			struct timeval wait;
+			wait.tv_sec  = timeout / 1000;
+			wait.tv_usec = (timeout % 1000) * 1000;
+			select(maxFd + 1, &readFds, &writeFds, &errorFds, &wait);
+
+			if (m_aWakeupFds[0] != -1 && FD_ISSET(m_aWakeupFds[0], &readFds)) {
+				char drain[64];
+				while (read(m_aWakeupFds[0], drain, sizeof(drain)) > 0) {}
+			}
+#endif
+		}
+
+		// The requests left in m_oSubmitted, m_oDelayed and m_oActive are
+		// ended by the destructor
+	}
+
+	void ClientContext::RunWorker() {
+		std::unique_lock<std::mutex> lock(m_oTaskMutex);
+
+		while (true) {
+			m_oTaskCondition.wait(lock, [this]() { return m_bIsStopping || !m_oTasks.empty(); });
+
+			// The remaining tasks are run before stopping
+			if (m_oTasks.empty()) {
+				return;
+			}
+
+			Task task;
+			task.swap(m_oTasks.front());
+			m_oTasks.pop_front();
+			lock.unlock();
+
+			try {
+				task();
+			} catch (const std::exception& e) {
+				std::cerr << e.what() << std::endl;
+			} catch (...) {
+				std::cerr << "Unknown error in a client context task" << std::endl;
+			}
+
+			lock.lock();
+		}
+	}
+
+}  // namespace mage
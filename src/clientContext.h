@@ -0,0 +1,116 @@
+#ifndef MAGECLIENT_CONTEXT_H
+#define MAGECLIENT_CONTEXT_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "httpTransport.h"
+#include "bufferPool.h"
+#include "metrics.h"
+
+#ifndef CLIENT_CONTEXT_WORKERS
+	#define CLIENT_CONTEXT_WORKERS 4
+#endif
+
+// Connections kept open by the I/O loop, for all the sessions
+#ifndef CLIENT_CONTEXT_MAX_CONNECTIONS
+	#define CLIENT_CONTEXT_MAX_CONNECTIONS 256
+#endif
+
+namespace mage {
+
+	//
+	// Shared by many RPC instances, so that a process can host thousands
+	// of sessions on a handful of threads:
+	//
+	// - a single I/O thread runs every request on a curl multi handle,
+	//   whose connections are kept and reused by all the sessions;
+	// - a pool of workers parses the responses, dispatches the events and
+	//   runs the callbacks, so that the I/O thread never waits on them;
+	// - the metrics and the receive buffers are shared.
+	//
+	// An RPC created with a context sends its synchronous calls through
+	// the I/O loop, runs its asynchronous calls without any thread of its
+	// own, and long polls without a polling thread. Every RPC must be
+	// destroyed before its context.
+	//
+	class ClientContext : public HttpTransport {
+		public:
+			typedef std::function<void()> Task;
+
+			explicit ClientContext(size_t workerCount = CLIENT_CONTEXT_WORKERS);
+			~ClientContext();
+
+			// Blocks until the request is over
+			virtual void Send(const HttpRequest& request, ResponseSink *sink, RequestTiming *timing);
+
+			// Starts the request from the I/O thread after the delay, and runs
+			// done in a worker once it is over. The request, the sink and the
+			// timing must stay alive until then; the sink is written from the
+			// I/O thread. Returns an id for Cancel.
+			uint64_t SendAsync(const HttpRequest& request, ResponseSink *sink, RequestTiming *timing,
+			                   const Task& done,
+			                   std::chrono::milliseconds delay = std::chrono::milliseconds::zero());
+			// Ends the request with an error, done is still called. Does
+			// nothing when the request is already over.
+			void Cancel(uint64_t requestId);
+
+			// Runs the task in a worker
+			void Post(const Task& task);
+
+			Metrics* GetMetrics() { return &m_oMetrics; }
+			BufferPool* GetBufferPool() { return &m_oBufferPool; }
+
+			// Number of requests started and not over yet
+			size_t GetActiveRequestCount() const;
+
+		private:
+			ClientContext(const ClientContext&);
+			ClientContext& operator=(const ClientContext&);
+
+			struct Request;
+
+			uint64_t Submit(Request *request);
+			void Complete(Request *request, int result);
+			void RunLoop();
+			void RunWorker();
+			void Wakeup();
+
+			void *m_pMulti;
+			std::thread *m_pLoopThread;
+			std::atomic<bool> m_bIsRunning;
+			int m_aWakeupFds[2];
+
+			// Handed over to the I/O thread
+			std::mutex m_oSubmitMutex;
+			std::vector<Request*> m_oSubmitted;
+			std::vector<uint64_t> m_oCancelled;
+			uint64_t m_iNextRequestId;
+
+			// Only used by the I/O thread
+			std::map<uint64_t, Request*> m_oDelayed;
+			std::map<uint64_t, Request*> m_oActive;
+			std::vector<void*> m_oIdleHandles;
+			std::atomic<size_t> m_iActiveCount;
+
+			std::vector<std::thread> m_oWorkers;
+			std::deque<Task> m_oTasks;
+			std::mutex m_oTaskMutex;
+			std::condition_variable m_oTaskCondition;
+			bool m_bIsStopping;
+
+			Metrics m_oMetrics;
+			BufferPool m_oBufferPool;
+	};
+
+}  // namespace mage
+#endif /* MAGECLIENT_CONTEXT_H */
@@ -0,0 +1,326 @@
+#include "curlTransport.h"
+
+#include <curl/curl.h>
+#include <strings.h>
+
+#include <map>
+
+// HTTP/2 with prior knowledge came with libcurl 7.49.0, the version of a
+// transfer with 7.50.0 and CURLE_WEIRD_SERVER_REPLY with 7.51.0
+#if LIBCURL_VERSION_NUM >= 0x073300
+	#define CURL_TRANSPORT_PRIOR_KNOWLEDGE 1
+#endif
+
+namespace mage {
+
+#if CURL_SHARE_CACHE
+	//
+	// Process-wide curl share, locked per type of data
+	//
+	class CurlShare {
+		public:
+			CurlShare()
+			: m_pShare(curl_share_init()) {
+				curl_share_setopt(m_pShare, CURLSHOPT_LOCKFUNC, Lock);
+				curl_share_setopt(m_pShare, CURLSHOPT_UNLOCKFUNC, Unlock);
+				curl_share_setopt(m_pShare, CURLSHOPT_USERDATA, this);
+				curl_share_setopt(m_pShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+				curl_share_setopt(m_pShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+				// Not the connections: libcurl does not support sharing them
+				// between handles used from several threads at once. They are
+				// reused by the idle handles of each transport, and by the
+				// multi handle of a context.
+			}
+
+			CURLSH* Get() const { return m_pShare; }
+
+		private:
+			static void Lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userData) {
+				static_cast<CurlShare*>(userData)->m_aMutexes[data].lock();
+			}
+
+			static void Unlock(CURL *handle, curl_lock_data data, void *userData) {
+				static_cast<CurlShare*>(userData)->m_aMutexes[data].unlock();
+			}
+
+			CURLSH *m_pShare;
+			std::mutex m_aMutexes[CURL_LOCK_DATA_LAST];
+	};
+
+	static CURLSH* GetCurlShare() {
+		// Never freed: handles may still use it while the process exits
+		static CurlShare *share = new CurlShare();
+		return share->Get();
+	}
+#endif
+
+#if defined(CURL_TRANSPORT_PRIOR_KNOWLEDGE)
+	//
+	// Whether each origin served HTTP/2 with prior knowledge (true) or
+	// refused it (false), for the whole process
+	//
+	class Http2Origins {
+		public:
+			static Http2Origins& Get() {
+				static Http2Origins origins;
+				return origins;
+			}
+
+			bool IsRefused(const std::string& origin) {
+				std::lock_guard<std::mutex> lock(m_oMutex);
+				std::map<std::string, bool>::const_iterator itr = m_oOrigins.find(origin);
+				return itr != m_oOrigins.end() && !itr->second;
+			}
+
+			// Only the first answer of an origin counts: one which served
+			// HTTP/2 before is not given up for a failed request
+			bool Record(const std::string& origin, bool isServed) {
+				std::lock_guard<std::mutex> lock(m_oMutex);
+				return m_oOrigins.insert(std::make_pair(origin, isServed)).second;
+			}
+
+		private:
+			std::mutex m_oMutex;
+			std::map<std::string, bool> m_oOrigins;
+	};
+
+	// The libcurl loaded may be older than the headers: before 8.0.0, the
+	// h2c connections can not be relied on (7.88.1 fails every request
+	// sent on an idle one, or waiting for one)
+	static bool IsPriorKnowledgeUsable() {
+		static const bool isUsable = curl_version_info(CURLVERSION_NOW)->version_num >= 0x080000;
+		return isUsable;
+	}
+
+	static std::string GetOrigin(const std::string& url) {
+		size_t start = url.find("://");
+		start = (start == std::string::npos) ? 0 : start + 3;
+		return url.substr(0, url.find('/', start));
+	}
+#endif
+
+	static size_t sinkWriter(char *data, size_t size, size_t nmemb, CurlRequest *curlRequest) {
+		// Size the receive buffer once from the Content-Length header (of
+		// the compressed body when there is one: only a lower bound)
+		if (!curlRequest->isSized) {
+#if LIBCURL_VERSION_NUM >= 0x073700
+			curl_off_t contentLength = -1;
+			curl_easy_getinfo(curlRequest->handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &contentLength);
+#else
+			double contentLength = -1;
+			curl_easy_getinfo(curlRequest->handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &contentLength);
+#endif
+			if (contentLength > 0) {
+				curlRequest->sink->Reserve(static_cast<size_t>(contentLength));
+			}
+			curlRequest->isSized = true;
+		}
+
+		curlRequest->bytesDecoded += size * nmemb;
+
+		// Returning less than the chunk size aborts the transfer
+		return curlRequest->sink->Write(data, size * nmemb) ? size * nmemb : 0;
+	}
+
+	static size_t headerReader(char *data, size_t size, size_t nmemb, CurlRequest *curlRequest) {
+		static const char name[] = "accept-encoding:";
+		static const size_t nameLength = sizeof(name) - 1;
+
+		size_t length = size * nmemb;
+		if (length > nameLength && strncasecmp(data, name, nameLength) == 0) {
+			std::string value(data + nameLength, length - nameLength);
+			size_t start = value.find_first_not_of(" \t");
+			size_t end   = value.find_last_not_of(" \t\r\n");
+			curlRequest->acceptEncoding = (start == std::string::npos) ? "" : value.substr(start, end - start + 1);
+		}
+
+		return length;
+	}
+
+	void PrepareCurlRequest(const HttpRequest& request, ResponseSink *sink, CurlRequest *curlRequest) {
+		CURL *c = curlRequest->handle;
+
+		curl_easy_reset(c);
+
+#if CURL_SHARE_CACHE
+		curl_easy_setopt(c, CURLOPT_SHARE, GetCurlShare());
+#endif
+
+		struct curl_slist *headers = nullptr;
+		std::vector<std::string>::const_iterator citr;
+		for (citr = request.headers.cbegin(); citr != request.headers.cend(); ++citr) {
+			headers = curl_slist_append(headers, citr->c_str());
+		}
+
+		curlRequest->headers          = headers;
+		curlRequest->sink             = sink;
+		curlRequest->isSized          = false;
+		curlRequest->bytesDecoded     = 0;
+		curlRequest->isPriorKnowledge = false;
+		curlRequest->acceptEncoding.clear();
+
+		std::string socketPath;
+		std::string socketUrl;
+		if (ParseUnixSocketUrl(request.url, &socketPath, &socketUrl)) {
+#if LIBCURL_VERSION_NUM >= 0x072800
+			// Since libcurl 7.40.0. The connections are only reused for
+			// the same socket.
+			curl_easy_setopt(c, CURLOPT_UNIX_SOCKET_PATH, socketPath.c_str());
+			curl_easy_setopt(c, CURLOPT_URL, socketUrl.c_str());
+#else
+			// Fails with an unsupported protocol
+			curl_easy_setopt(c, CURLOPT_URL, request.url.c_str());
+#endif
+		} else {
+			curl_easy_setopt(c, CURLOPT_URL, request.url.c_str());
+		}
+		curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, sinkWriter);
+		curl_easy_setopt(c, CURLOPT_WRITEDATA, curlRequest);
+		curl_easy_setopt(c, CURLOPT_HEADERFUNCTION, headerReader);
+		curl_easy_setopt(c, CURLOPT_HEADERDATA, curlRequest);
+
+		if (headers != nullptr) {
+			curl_easy_setopt(c, CURLOPT_HTTPHEADER, headers);
+		}
+
+		if (request.body != nullptr) {
+			curl_easy_setopt(c, CURLOPT_POSTFIELDS, request.body->c_str());
+			curl_easy_setopt(c, CURLOPT_POSTFIELDSIZE, static_cast<long>(request.body->size()));
+		} else if (request.isHead) {
+			curl_easy_setopt(c, CURLOPT_NOBODY, 1L);
+		}
+
+		if (request.timeout > 0) {
+			curl_easy_setopt(c, CURLOPT_TIMEOUT_MS, request.timeout);
+		}
+
+		if (request.isCompressionAccepted) {
+			// Every encoding libcurl was built with (deflate and gzip, br
+			// and zstd when available), decoded as the body arrives
+			curl_easy_setopt(c, CURLOPT_ACCEPT_ENCODING, "");
+		}
+
+		switch (request.version) {
+			case HTTP_VERSION_1_1:
+				curl_easy_setopt(c, CURLOPT_HTTP_VERSION, static_cast<long>(CURL_HTTP_VERSION_1_1));
+				break;
+#if defined(CURL_TRANSPORT_PRIOR_KNOWLEDGE)
+			case HTTP_VERSION_2_PRIOR_KNOWLEDGE:
+				curlRequest->origin = GetOrigin(request.url);
+				if (IsPriorKnowledgeUsable() && !Http2Origins::Get().IsRefused(curlRequest->origin)) {
+					curlRequest->isPriorKnowledge = true;
+					curl_easy_setopt(c, CURLOPT_HTTP_VERSION, static_cast<long>(CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE));
+					// Waits for a connection to multiplex on rather than opening another
+					curl_easy_setopt(c, CURLOPT_PIPEWAIT, 1L);
+				} else {
+					curl_easy_setopt(c, CURLOPT_HTTP_VERSION, static_cast<long>(CURL_HTTP_VERSION_1_1));
+				}
+				break;
+#endif
+			default:
+#if LIBCURL_VERSION_NUM >= 0x072F00
+				// Since libcurl 7.47.0, the default from 7.62.0
+				curl_easy_setopt(c, CURLOPT_HTTP_VERSION, static_cast<long>(CURL_HTTP_VERSION_2TLS));
+#endif
+				break;
+		}
+	}
+
+	void FinishCurlRequest(int result, CurlRequest *curlRequest, RequestTiming *timing) {
+		ReadRequestTiming(curlRequest->handle, timing);
+		timing->bytesDecoded   = curlRequest->bytesDecoded;
+		timing->acceptEncoding = curlRequest->acceptEncoding;
+
+		curl_slist_free_all(static_cast<struct curl_slist*>(curlRequest->headers));
+		curlRequest->headers = nullptr;
+
+		if (result != CURLE_OK) {
+			timing->error = std::string("Curl error: ") + curl_easy_strerror(static_cast<CURLcode>(result));
+		}
+	}
+
+	bool ShouldRetryCurlRequest(int result, CurlRequest *curlRequest) {
+#if defined(CURL_TRANSPORT_PRIOR_KNOWLEDGE)
+		if (!curlRequest->isPriorKnowledge) {
+			return false;
+		}
+
+		if (result == CURLE_OK) {
+			long version = 0;
+			curl_easy_getinfo(curlRequest->handle, CURLINFO_HTTP_VERSION, &version);
+			Http2Origins::Get().Record(curlRequest->origin, version == CURL_HTTP_VERSION_2_0);
+			return false;
+		}
+
+		// What an HTTP/1.1 server answers to the connection preface. Any
+		// other failure, like a connection lost, is not taken for a refusal.
+		if (result != CURLE_HTTP2 && result != CURLE_WEIRD_SERVER_REPLY) {
+			return false;
+		}
+
+		// Only sent again when the server could not have run the request,
+		// and the sink (which can not be rewound) got nothing of it
+#if LIBCURL_VERSION_NUM >= 0x073700
+		curl_off_t uploaded = 0;
+		curl_easy_getinfo(curlRequest->handle, CURLINFO_SIZE_UPLOAD_T, &uploaded);
+#else
+		double uploaded = 0;
+		curl_easy_getinfo(curlRequest->handle, CURLINFO_SIZE_UPLOAD, &uploaded);
+#endif
+		if (uploaded > 0 || curlRequest->bytesDecoded != 0) {
+			return false;
+		}
+
+		if (!Http2Origins::Get().Record(curlRequest->origin, false)) {
+			return false;
+		}
+
+		curl_slist_free_all(static_cast<struct curl_slist*>(curlRequest->headers));
+		curlRequest->headers = nullptr;
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	CurlTransport::~CurlTransport() {
+		for (size_t i = 0; i < m_oIdleHandles.size(); ++i) {
+			curl_easy_cleanup(m_oIdleHandles[i]);
+		}
+	}
+
+	void CurlTransport::Send(const HttpRequest& request, ResponseSink *sink, RequestTiming *timing) {
+		CurlRequest curlRequest;
+
+		m_oHandleMutex.lock();
+		if (!m_oIdleHandles.empty()) {
+			curlRequest.handle = m_oIdleHandles.back();
+			m_oIdleHandles.pop_back();
+		}
+		m_oHandleMutex.unlock();
+
+		if (curlRequest.handle == nullptr) {
+			curlRequest.handle = curl_easy_init();
+			if (!curlRequest.handle) {
+				timing->error = "Unable to initialize curl.";
+				return;
+			}
+		}
+
+		PrepareCurlRequest(request, sink, &curlRequest);
+		CURLcode res = curl_easy_perform(curlRequest.handle);
+		if (ShouldRetryCurlRequest(res, &curlRequest)) {
+			PrepareCurlRequest(request, sink, &curlRequest);
+			res = curl_easy_perform(curlRequest.handle);
+		}
+		FinishCurlRequest(res, &curlRequest, timing);
+
+		std::lock_guard<std::mutex> lock(m_oHandleMutex);
+		if (m_oIdleHandles.size() < CURL_TRANSPORT_IDLE_HANDLES) {
+			m_oIdleHandles.push_back(curlRequest.handle);
+		} else {
+			curl_easy_cleanup(curlRequest.handle);
+		}
+	}
+
+}  // namespace mage
@@ -0,0 +1,85 @@
+#ifndef MAGECURL_TRANSPORT_H
+#define MAGECURL_TRANSPORT_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <cstdint>
+
+#include "httpTransport.h"
+
+// The DNS cache and the TLS sessions are shared by every curl handle
+// of the process, so that a new client or a reconnection skips the
+// name lookup and the full handshake
+#ifndef CURL_SHARE_CACHE
+	#define CURL_SHARE_CACHE 1
+#endif
+
+// Handles kept by a CurlTransport between two requests
+#ifndef CURL_TRANSPORT_IDLE_HANDLES
+	#define CURL_TRANSPORT_IDLE_HANDLES 4
+#endif
+
+namespace mage {
+
+	//
+	// Default transport of RPC, with libcurl. Its handles are reused from
+	// one request to the next, along with their connections.
+	//
+	class CurlTransport : public HttpTransport {
+		public:
+			CurlTransport() {}
+			~CurlTransport();
+
+			virtual void Send(const HttpRequest& request, ResponseSink *sink, RequestTiming *timing);
+
+		private:
+			CurlTransport(const CurlTransport&);
+			CurlTransport& operator=(const CurlTransport&);
+
+			std::mutex m_oHandleMutex;
+			std::vector<void*> m_oIdleHandles;
+	};
+
+	//
+	// A request set up on a curl easy handle, also used by ClientContext
+	// to run the requests on its own loop. The handle and the headers
+	// are a CURL* and a curl_slist*, so that curl.h is not exposed.
+	//
+	struct CurlRequest {
+		CurlRequest()
+		: handle(nullptr)
+		, headers(nullptr)
+		, sink(nullptr)
+		, isSized(false)
+		, bytesDecoded(0)
+		, isPriorKnowledge(false) {}
+
+		void *handle;
+		void *headers;
+		ResponseSink *sink;
+		bool isSized;
+		uint64_t bytesDecoded;
+		// From the Accept-Encoding response header
+		std::string acceptEncoding;
+		// Sent over HTTP/2 without upgrade, to the scheme, host and port of origin
+		bool isPriorKnowledge;
+		std::string origin;
+	};
+
+	// Sets the options of the handle for the request, which must stay
+	// alive until the transfer is over. The handle may have been used
+	// before: its previous options are reset.
+	void PrepareCurlRequest(const HttpRequest& request, ResponseSink *sink, CurlRequest *curlRequest);
+	// Reads the timing of the transfer, with its result (a CURLcode), and
+	// frees the headers. The handle is left to the caller.
+	void FinishCurlRequest(int result, CurlRequest *curlRequest, RequestTiming *timing);
+	// Called with the result of each transfer, before FinishCurlRequest:
+	// returns true when the server refused HTTP/2 with prior knowledge
+	// before any of the body was sent or received, the request must then
+	// be prepared and sent again (over HTTP/1.1 from now on for this
+	// server). Its headers are already freed.
+	bool ShouldRetryCurlRequest(int result, CurlRequest *curlRequest);
+
+}  // namespace mage
+#endif /* MAGECURL_TRANSPORT_H */
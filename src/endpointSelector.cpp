@@ -0,0 +1,312 @@
+#include "endpointSelector.h"
+
+#include <algorithm>
+
+namespace mage {
+
+	// Weight of each new sample in the moving average of the latency
+	static const uint64_t LATENCY_DECAY = 8;
+
+	static uint64_t GetScore(uint64_t latency, uint64_t outstanding) {
+		// The endpoints without any measure yet are tried first
+		return (latency + 1) * (outstanding + 1);
+	}
+
+	EndpointSelector::EndpointSelector(const std::string& domain)
+	: m_oRandom(std::random_device()())
+	, m_bIsBreakerEnabled(false) {
+		m_oEndpoints.push_back(Endpoint(domain, m_oBreakerSettings));
+	}
+
+	void EndpointSelector::SetCircuitBreaker(bool isEnabled, const CircuitBreakerSettings& settings) {
+		std::lock_guard<std::mutex> lock(m_oMutex);
+
+		m_bIsBreakerEnabled = isEnabled;
+		m_oBreakerSettings  = settings;
+
+		for (size_t i = 0; i < m_oEndpoints.size(); ++i) {
+			m_oEndpoints[i].breaker = CircuitBreaker(settings);
+		}
+	}
+
+	void EndpointSelector::SetCircuitHook(const CircuitHook& hook) {
+		std::lock_guard<std::mutex> lock(m_oHookMutex);
+		m_oCircuitHook = hook;
+	}
+
+	void EndpointSelector::SetDomains(const std::vector<std::string>& domains) {
+		std::lock_guard<std::mutex> lock(m_oMutex);
+
+		std::vector<Endpoint> endpoints;
+		for (size_t i = 0; i < domains.size(); ++i) {
+			Endpoint *known = Find(domains[i]);
+			endpoints.push_back((known != nullptr) ? *known : Endpoint(domains[i], m_oBreakerSettings));
+		}
+
+		m_oEndpoints.swap(endpoints);
+
+		if (Find(m_sStickyDomain) == nullptr) {
+			m_sStickyDomain.clear();
+		}
+	}
+
+	std::vector<std::string> EndpointSelector::GetDomains() const {
+		std::lock_guard<std::mutex> lock(m_oMutex);
+
+		std::vector<std::string> domains;
+		for (size_t i = 0; i < m_oEndpoints.size(); ++i) {
+			domains.push_back(m_oEndpoints[i].domain);
+		}
+
+		return domains;
+	}
+
+	std::string EndpointSelector::Acquire(const std::set<std::string>& excluded) {
+		std::string domain;
+
+		{
+			std::lock_guard<std::mutex> lock(m_oMutex);
+
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+			Endpoint *endpoint = Pick(excluded, now);
+			if (endpoint == nullptr) {
+				return std::string();
+			}
+
+			if (m_bIsBreakerEnabled) {
+				CircuitState previous = endpoint->breaker.GetState();
+				endpoint->breaker.Acquire(now);
+				AddTransition(*endpoint, previous);
+			}
+
+			++endpoint->outstanding;
+			domain = endpoint->domain;
+		}
+
+		NotifyTransitions();
+		return domain;
+	}
+
+	void EndpointSelector::Release(const std::string& domain, bool isSuccess, uint64_t latency) {
+		{
+			std::lock_guard<std::mutex> lock(m_oMutex);
+
+			// Removed by SetDomains in the meantime
+			Endpoint *endpoint = Find(domain);
+			if (endpoint == nullptr) {
+				return;
+			}
+
+			if (endpoint->outstanding > 0) {
+				--endpoint->outstanding;
+			}
+
+			if (isSuccess) {
+				endpoint->latency = (endpoint->latency == 0) ? latency :
+				                    (endpoint->latency * (LATENCY_DECAY - 1) + latency) / LATENCY_DECAY;
+			}
+
+			if (m_bIsBreakerEnabled) {
+				CircuitState previous = endpoint->breaker.GetState();
+				endpoint->breaker.Record(isSuccess, latency, std::chrono::steady_clock::now());
+				AddTransition(*endpoint, previous);
+			}
+
+			Report(endpoint, isSuccess);
+		}
+
+		NotifyTransitions();
+	}
+
+	std::string EndpointSelector::GetStickyDomain() {
+		std::lock_guard<std::mutex> lock(m_oMutex);
+
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+		Endpoint *sticky = Find(m_sStickyDomain);
+		if (sticky == nullptr || sticky->downUntil > now) {
+			// The best endpoint now, for as long as it does not fail
+			Endpoint *best = nullptr;
+			for (size_t i = 0; i < m_oEndpoints.size(); ++i) {
+				Endpoint *endpoint = &m_oEndpoints[i];
+				if (endpoint->downUntil <= now &&
+				    (best == nullptr || GetScore(endpoint->latency, 0) < GetScore(best->latency, 0))) {
+					best = endpoint;
+				}
+			}
+
+			if (best != nullptr) {
+				m_sStickyDomain = best->domain;
+			} else if (sticky == nullptr) {
+				// Even through an open circuit, which only rejects commands
+				Endpoint *first = Pick(std::set<std::string>(), now);
+				m_sStickyDomain = (first != nullptr) ? first->domain : m_oEndpoints[0].domain;
+			}
+		}
+
+		return m_sStickyDomain;
+	}
+
+	void EndpointSelector::ReportSticky(bool isSuccess) {
+		std::lock_guard<std::mutex> lock(m_oMutex);
+
+		Endpoint *endpoint = Find(m_sStickyDomain);
+		if (endpoint != nullptr) {
+			Report(endpoint, isSuccess);
+		}
+	}
+
+	void EndpointSelector::SetGzipAccepted(const std::string& domain, bool isAccepted) {
+		std::lock_guard<std::mutex> lock(m_oMutex);
+
+		Endpoint *endpoint = Find(domain);
+		if (endpoint != nullptr) {
+			endpoint->isGzipAccepted = isAccepted;
+		}
+	}
+
+	bool EndpointSelector::IsGzipAccepted(const std::string& domain) const {
+		std::lock_guard<std::mutex> lock(m_oMutex);
+
+		const Endpoint *endpoint = Find(domain);
+		return endpoint != nullptr && endpoint->isGzipAccepted;
+	}
+
+	void EndpointSelector::ResetGzipAccepted() {
+		std::lock_guard<std::mutex> lock(m_oMutex);
+
+		for (size_t i = 0; i < m_oEndpoints.size(); ++i) {
+			m_oEndpoints[i].isGzipAccepted = false;
+		}
+	}
+
+	std::vector<EndpointStatus> EndpointSelector::GetStatus() const {
+		std::lock_guard<std::mutex> lock(m_oMutex);
+
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+		std::vector<EndpointStatus> status(m_oEndpoints.size());
+		for (size_t i = 0; i < m_oEndpoints.size(); ++i) {
+			status[i].domain              = m_oEndpoints[i].domain;
+			status[i].isHealthy           = m_oEndpoints[i].downUntil <= now;
+			status[i].outstanding         = m_oEndpoints[i].outstanding;
+			status[i].latency             = m_oEndpoints[i].latency;
+			status[i].consecutiveFailures = m_oEndpoints[i].consecutiveFailures;
+			status[i].circuitState        = m_oEndpoints[i].breaker.GetState();
+		}
+
+		return status;
+	}
+
+	EndpointSelector::Endpoint* EndpointSelector::Find(const std::string& domain) {
+		for (size_t i = 0; i < m_oEndpoints.size(); ++i) {
+			if (m_oEndpoints[i].domain == domain) {
+				return &m_oEndpoints[i];
+			}
+		}
+
+		return nullptr;
+	}
+
+	const EndpointSelector::Endpoint* EndpointSelector::Find(const std::string& domain) const {
+		return const_cast<EndpointSelector*>(this)->Find(domain);
+	}
+
+	EndpointSelector::Endpoint* EndpointSelector::Pick(const std::set<std::string>& excluded,
+	                                                   const std::chrono::steady_clock::time_point& now) {
+		std::vector<Endpoint*> candidates;
+		for (size_t i = 0; i < m_oEndpoints.size(); ++i) {
+			if (excluded.count(m_oEndpoints[i].domain) == 0 && m_oEndpoints[i].downUntil <= now &&
+			    IsAvailable(m_oEndpoints[i], now)) {
+				candidates.push_back(&m_oEndpoints[i]);
+			}
+		}
+
+		if (candidates.empty()) {
+			// All left aside: the one which should be back first
+			Endpoint *first = nullptr;
+			for (size_t i = 0; i < m_oEndpoints.size(); ++i) {
+				if (excluded.count(m_oEndpoints[i].domain) == 0 && IsAvailable(m_oEndpoints[i], now) &&
+				    (first == nullptr || m_oEndpoints[i].downUntil < first->downUntil)) {
+					first = &m_oEndpoints[i];
+				}
+			}
+			return first;
+		}
+
+		if (candidates.size() == 1) {
+			return candidates[0];
+		}
+
+		size_t a = m_oRandom() % candidates.size();
+		size_t b = m_oRandom() % (candidates.size() - 1);
+		if (b >= a) {
+			++b;
+		}
+
+		uint64_t scoreA = GetScore(candidates[a]->latency, candidates[a]->outstanding);
+		uint64_t scoreB = GetScore(candidates[b]->latency, candidates[b]->outstanding);
+
+		return (scoreA <= scoreB) ? candidates[a] : candidates[b];
+	}
+
+	bool EndpointSelector::IsAvailable(const Endpoint& endpoint,
+	                                   const std::chrono::steady_clock::time_point& now) const {
+		return !m_bIsBreakerEnabled || endpoint.breaker.IsAvailable(now);
+	}
+
+	void EndpointSelector::AddTransition(const Endpoint& endpoint, CircuitState previous) {
+		if (endpoint.breaker.GetState() == previous) {
+			return;
+		}
+
+		Transition transition;
+		transition.domain   = endpoint.domain;
+		transition.previous = previous;
+		transition.state    = endpoint.breaker.GetState();
+		m_oTransitions.push_back(transition);
+	}
+
+	void EndpointSelector::NotifyTransitions() {
+		std::vector<Transition> transitions;
+		{
+			std::lock_guard<std::mutex> lock(m_oMutex);
+			if (m_oTransitions.empty()) {
+				return;
+			}
+			transitions.swap(m_oTransitions);
+		}
+
+		CircuitHook hook;
+		{
+			std::lock_guard<std::mutex> lock(m_oHookMutex);
+			hook = m_oCircuitHook;
+		}
+
+		if (!hook) {
+			return;
+		}
+
+		for (size_t i = 0; i < transitions.size(); ++i) {
+			hook(transitions[i].domain, transitions[i].previous, transitions[i].state);
+		}
+	}
+
+	void EndpointSelector::Report(Endpoint *endpoint, bool isSuccess) {
+		if (isSuccess) {
+			endpoint->consecutiveFailures = 0;
+			return;
+		}
+
+		uint64_t downTime = ENDPOINT_SELECTOR_DOWN_MS;
+		for (uint64_t i = 0; i < endpoint->consecutiveFailures && downTime < ENDPOINT_SELECTOR_MAX_DOWN_MS; ++i) {
+			downTime *= 2;
+		}
+
+		++endpoint->consecutiveFailures;
+		endpoint->downUntil = std::chrono::steady_clock::now() +
+		                      std::chrono::milliseconds(std::min<uint64_t>(downTime, ENDPOINT_SELECTOR_MAX_DOWN_MS));
+	}
+
+}  // namespace mage
@@ -0,0 +1,141 @@
+#ifndef MAGEENDPOINT_SELECTOR_H
+#define MAGEENDPOINT_SELECTOR_H
+
+#include <string>
+#include <vector>
+#include <set>
+#include <mutex>
+#include <random>
+#include <chrono>
+#include <functional>
+#include <cstdint>
+
+#include "circuitBreaker.h"
+
+// Time an endpoint is left aside after a failure, doubled with each
+// consecutive one up to the maximum
+#ifndef ENDPOINT_SELECTOR_DOWN_MS
+	#define ENDPOINT_SELECTOR_DOWN_MS 1000
+#endif
+
+#ifndef ENDPOINT_SELECTOR_MAX_DOWN_MS
+	#define ENDPOINT_SELECTOR_MAX_DOWN_MS 30000
+#endif
+
+namespace mage {
+
+	struct EndpointStatus {
+		std::string domain;
+		// Not left aside after a failure
+		bool isHealthy;
+		// Requests sent and not over yet
+		uint64_t outstanding;
+		// Moving average of the successful requests, in microseconds (0
+		// until the first one)
+		uint64_t latency;
+		uint64_t consecutiveFailures;
+		// Always closed without circuit breakers
+		CircuitState circuitState;
+	};
+
+	//
+	// Spreads the requests of an RPC over several domains serving the
+	// same application.
+	//
+	// Each request goes to the best of two endpoints picked at random
+	// (power of two choices), by latency times outstanding requests:
+	// close to the least loaded one, without every client rushing to the
+	// same endpoint. An endpoint which fails is left aside for a while,
+	// longer after each consecutive failure, then tried again.
+	//
+	// The message stream sticks to one endpoint, only moving to another
+	// once it fails.
+	//
+	// With circuit breakers, an endpoint whose circuit is open is not
+	// picked at all, and no endpoint is given once they all are.
+	//
+	class EndpointSelector {
+		public:
+			// Called on each change of state of a circuit, out of any lock
+			typedef std::function<void(const std::string& domain, CircuitState previous, CircuitState state)>
+			        CircuitHook;
+
+			explicit EndpointSelector(const std::string& domain);
+
+			// Starts every endpoint with a closed circuit
+			void SetCircuitBreaker(bool isEnabled, const CircuitBreakerSettings& settings);
+			void SetCircuitHook(const CircuitHook& hook);
+
+			// Keeps the state of the domains already known
+			void SetDomains(const std::vector<std::string>& domains);
+			std::vector<std::string> GetDomains() const;
+
+			// The endpoint of a request, to be given back to Release once
+			// it is over. An empty string when there is none: the excluded
+			// ones are never picked, nor the endpoints whose circuit is open.
+			std::string Acquire(const std::set<std::string>& excluded = std::set<std::string>());
+			void Release(const std::string& domain, bool isSuccess, uint64_t latency);
+
+			// The endpoint of the message stream
+			std::string GetStickyDomain();
+			void ReportSticky(bool isSuccess);
+
+			// Whether the server at domain accepts gzipped request bodies,
+			// as it last told. Unknown domains do not.
+			void SetGzipAccepted(const std::string& domain, bool isAccepted);
+			bool IsGzipAccepted(const std::string& domain) const;
+			// Until each server tells again
+			void ResetGzipAccepted();
+
+			std::vector<EndpointStatus> GetStatus() const;
+
+		private:
+			struct Endpoint {
+				Endpoint(const std::string& domain, const CircuitBreakerSettings& settings)
+				: domain(domain)
+				, outstanding(0)
+				, latency(0)
+				, consecutiveFailures(0)
+				, isGzipAccepted(false)
+				, breaker(settings) {}
+
+				std::string domain;
+				uint64_t outstanding;
+				uint64_t latency;
+				uint64_t consecutiveFailures;
+				std::chrono::steady_clock::time_point downUntil;
+				bool isGzipAccepted;
+				CircuitBreaker breaker;
+			};
+
+			struct Transition {
+				std::string domain;
+				CircuitState previous;
+				CircuitState state;
+			};
+
+			// Must be called with m_oMutex held
+			Endpoint* Find(const std::string& domain);
+			const Endpoint* Find(const std::string& domain) const;
+			Endpoint* Pick(const std::set<std::string>& excluded, const std::chrono::steady_clock::time_point& now);
+			void Report(Endpoint *endpoint, bool isSuccess);
+			bool IsAvailable(const Endpoint& endpoint, const std::chrono::steady_clock::time_point& now) const;
+			void AddTransition(const Endpoint& endpoint, CircuitState previous);
+
+			// Called without m_oMutex
+			void NotifyTransitions();
+
+			mutable std::mutex m_oMutex;
+			std::vector<Endpoint> m_oEndpoints;
+			std::string m_sStickyDomain;
+			std::minstd_rand m_oRandom;
+			bool m_bIsBreakerEnabled;
+			CircuitBreakerSettings m_oBreakerSettings;
+			std::vector<Transition> m_oTransitions;
+
+			std::mutex m_oHookMutex;
+			CircuitHook m_oCircuitHook;
+	};
+
+}  // namespace mage
+#endif /* MAGEENDPOINT_SELECTOR_H */
@@ -10,8 +10,14 @@ namespace mage {
 	, m_iType(type) {
 	}
 
+	MageError::MageError(mage_error_t type, const std::string& message, const std::string& code)
+	: std::runtime_error(message)
+	, m_iType(type)
+	, m_sCode(code) {
+	}
+
 	std::string MageError::code() const {
-		return "unknown";
+		return m_sCode.empty() ? "unknown" : m_sCode;
 	}
 
 	MageSuccess::MageSuccess(const std::string& message)
@@ -26,8 +32,18 @@ namespace mage {
 	: MageError::MageError(MAGE_CLIENT_ERROR, message) {
 	}
 
+	MageClientError::MageClientError(const std::string& message, const std::string& code)
+	: MageError::MageError(MAGE_CLIENT_ERROR, message, code) {
+	}
+
 	std::string MageClientError::code() const {
-		return "client error";
+		return m_sCode.empty() ? "client error" : m_sCode;
+	}
+
+	const char* const MageCircuitOpenError::CODE = "circuit open";
+
+	MageCircuitOpenError::MageCircuitOpenError(const std::string& message)
+	: MageClientError::MageClientError(message, CODE) {
 	}
 
 	MageRPCError::MageRPCError(int code, const std::string& message)
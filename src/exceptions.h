@@ -22,7 +22,11 @@ namespace mage {
 			int type() const { return m_iType; }
 		protected:
 			MageError(mage_error_t _type, const std::string& message);
+			// The code is kept by the base class, so that it survives the
+			// copies into a MageError (such as the callbacks of RPC::Call)
+			MageError(mage_error_t _type, const std::string& message, const std::string& code);
 			const mage_error_t m_iType;
+			const std::string m_sCode;
 	};
 
 	class MageSuccess: public MageError {
@@ -37,6 +41,19 @@ namespace mage {
 			MageClientError(const std::string& message = "");
 			virtual ~MageClientError() {}
 			virtual std::string code() const;
+		protected:
+			MageClientError(const std::string& message, const std::string& code);
+	};
+
+	// Thrown without sending the command, as the circuit breaker of every
+	// endpoint is open. A callback receiving it as a MageError can tell
+	// it by its code: error.code() == MageCircuitOpenError::CODE.
+	class MageCircuitOpenError: public MageClientError {
+		public:
+			static const char* const CODE;
+
+			MageCircuitOpenError(const std::string& message = "");
+			virtual ~MageCircuitOpenError() {}
 	};
 
 	class MageRPCError: public MageError {
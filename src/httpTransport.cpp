@@ -0,0 +1,67 @@
+#include "httpTransport.h"
+
+#include <cctype>
+#include <cstdlib>
+
+namespace mage {
+
+	static const char UNIX_SOCKET_SUFFIX[] = "+unix";
+	static const size_t UNIX_SOCKET_SUFFIX_LENGTH = sizeof(UNIX_SOCKET_SUFFIX) - 1;
+
+	bool IsUnixSocketProtocol(const std::string& protocol) {
+		return protocol.size() > UNIX_SOCKET_SUFFIX_LENGTH &&
+		       protocol.compare(protocol.size() - UNIX_SOCKET_SUFFIX_LENGTH, UNIX_SOCKET_SUFFIX_LENGTH,
+		                        UNIX_SOCKET_SUFFIX) == 0;
+	}
+
+	std::string FormatOrigin(const std::string& protocol, const std::string& domain) {
+		if (!IsUnixSocketProtocol(protocol)) {
+			return protocol + "://" + domain;
+		}
+
+		static const char hex[] = "0123456789ABCDEF";
+
+		std::string origin = protocol + "://";
+		for (size_t i = 0; i < domain.size(); ++i) {
+			unsigned char c = static_cast<unsigned char>(domain[i]);
+			if (isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~') {
+				origin += static_cast<char>(c);
+			} else {
+				origin += '%';
+				origin += hex[c >> 4];
+				origin += hex[c & 0x0F];
+			}
+		}
+
+		return origin;
+	}
+
+	bool ParseUnixSocketUrl(const std::string& url, std::string *socketPath, std::string *httpUrl) {
+		size_t schemeEnd = url.find("://");
+		if (schemeEnd == std::string::npos || !IsUnixSocketProtocol(url.substr(0, schemeEnd))) {
+			return false;
+		}
+
+		size_t hostStart = schemeEnd + 3;
+		size_t pathStart = url.find('/', hostStart);
+		if (pathStart == std::string::npos) {
+			pathStart = url.size();
+		}
+
+		socketPath->clear();
+		for (size_t i = hostStart; i < pathStart; ++i) {
+			if (url[i] == '%' && i + 2 < pathStart && isxdigit(url[i + 1]) && isxdigit(url[i + 2])) {
+				socketPath->push_back(static_cast<char>(strtol(url.substr(i + 1, 2).c_str(), nullptr, 16)));
+				i += 2;
+			} else {
+				socketPath->push_back(url[i]);
+			}
+		}
+
+		std::string path = (pathStart == url.size()) ? "/" : url.substr(pathStart);
+		*httpUrl = url.substr(0, schemeEnd - UNIX_SOCKET_SUFFIX_LENGTH) + "://localhost" + path;
+
+		return !socketPath->empty();
+	}
+
+}  // namespace mage
@@ -0,0 +1,104 @@
+#ifndef MAGEHTTP_TRANSPORT_H
+#define MAGEHTTP_TRANSPORT_H
+
+#include <string>
+#include <vector>
+
+#include "requestTiming.h"
+
+namespace mage {
+
+	enum HttpVersion {
+		// HTTP/2 when negotiated with TLS (ALPN), HTTP/1.1 otherwise
+		HTTP_VERSION_DEFAULT = 0,
+		HTTP_VERSION_1_1,
+		// HTTP/2 over cleartext without upgrade (h2c), falling back to
+		// HTTP/1.1 for the servers which refuse it
+		HTTP_VERSION_2_PRIOR_KNOWLEDGE
+	};
+
+	struct HttpRequest {
+		HttpRequest()
+		: body(nullptr)
+		, isHead(false)
+		, version(HTTP_VERSION_DEFAULT)
+		, isCompressionAccepted(false)
+		, timeout(0) {}
+
+		std::string url;
+		// Each one formatted as "Name: value"
+		std::vector<std::string> headers;
+		// Sent as a POST when set, otherwise the request is a GET
+		const std::string *body;
+		// A HEAD request instead of a GET, whose response has no body
+		bool isHead;
+		// A hint: the transports without HTTP/2 ignore it
+		HttpVersion version;
+		// The response may be compressed (Accept-Encoding), the transport
+		// then decodes it before the sink
+		bool isCompressionAccepted;
+		// Of the whole request, connection included, in milliseconds (0
+		// waits as long as it takes)
+		long timeout;
+	};
+
+	//
+	// Receives the body of a response, chunk by chunk, as it arrives
+	//
+	class ResponseSink {
+		public:
+			virtual ~ResponseSink() {}
+
+			// Called before the first chunk when the size of the body is known
+			virtual void Reserve(size_t size) {}
+			// Returning false aborts the request. Must not throw: the
+			// transport may be calling from C code.
+			virtual bool Write(const char *data, size_t size) = 0;
+	};
+
+	class StringSink : public ResponseSink {
+		public:
+			explicit StringSink(std::string *buffer) : m_pBuffer(buffer) {}
+
+			virtual void Reserve(size_t size) { m_pBuffer->reserve(m_pBuffer->size() + size); }
+			virtual bool Write(const char *data, size_t size) {
+				m_pBuffer->append(data, size);
+				return true;
+			}
+
+		private:
+			std::string *m_pBuffer;
+	};
+
+	// Protocols ending with "+unix" ("http+unix", "https+unix") reach the
+	// server through a Unix domain socket, whose path is the domain
+	bool IsUnixSocketProtocol(const std::string& protocol);
+	// "protocol://domain", with the socket path percent-encoded as the
+	// host for a Unix domain socket: http+unix://%2Fvar%2Frun%2Fmage.sock
+	std::string FormatOrigin(const std::string& protocol, const std::string& domain);
+	// Splits a URL formatted as above into the path of the socket and the
+	// URL to request through it (http://localhost/...). Returns false for
+	// the other URLs.
+	bool ParseUnixSocketUrl(const std::string& url, std::string *socketPath, std::string *httpUrl);
+
+	//
+	// Sends the HTTP requests of an RPC: the commands (POST) and the
+	// message stream (GET). The MAGE protocol itself (serialization,
+	// sessions, errors, events) stays in RPC, so that a transport only
+	// has to move bytes.
+	//
+	// Send is called concurrently from every thread making calls, and
+	// must be thread safe.
+	//
+	class HttpTransport {
+		public:
+			virtual ~HttpTransport() {}
+
+			// Fills the status, durations and sizes of the timing. A failure
+			// to send the request or to receive the response is reported in
+			// timing->error rather than thrown.
+			virtual void Send(const HttpRequest& request, ResponseSink *sink, RequestTiming *timing) = 0;
+	};
+
+}  // namespace mage
+#endif /* MAGEHTTP_TRANSPORT_H */
@@ -0,0 +1,41 @@
+#include "loopbackTransport.h"
+#include "metrics.h"
+
+#include <chrono>
+#include <exception>
+
+namespace mage {
+
+	LoopbackTransport::LoopbackTransport(const Handler& handler)
+	: m_oHandler(handler) {
+	}
+
+	void LoopbackTransport::Send(const HttpRequest& request, ResponseSink *sink, RequestTiming *timing) {
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		LoopbackResponse response;
+
+		try {
+			m_oHandler(request, &response);
+		} catch (const std::exception& e) {
+			timing->error = std::string("Loopback error: ") + e.what();
+		}
+
+		timing->waitTime      = MicrosecondsSince(start);
+		timing->httpStatus    = timing->error.empty() ? response.status : 0;
+		timing->bytesUploaded = (request.body != nullptr) ? request.body->size() : 0;
+
+		if (timing->error.empty()) {
+			sink->Reserve(response.body.size());
+			if (!sink->Write(response.body.data(), response.body.size())) {
+				timing->error = "Loopback error: the response was rejected";
+			}
+			timing->bytesDownloaded = response.body.size();
+			timing->bytesDecoded    = response.body.size();
+			timing->acceptEncoding  = response.acceptEncoding;
+		}
+
+		timing->totalTime    = MicrosecondsSince(start);
+		timing->transferTime = timing->totalTime - timing->waitTime;
+	}
+
+}  // namespace mage
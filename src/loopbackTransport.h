@@ -0,0 +1,41 @@
+#ifndef MAGELOOPBACK_TRANSPORT_H
+#define MAGELOOPBACK_TRANSPORT_H
+
+#include <string>
+#include <functional>
+
+#include "httpTransport.h"
+
+namespace mage {
+
+	struct LoopbackResponse {
+		LoopbackResponse() : status(200) {}
+
+		long status;
+		std::string body;
+		// Content codings accepted in the requests (Accept-Encoding), if any
+		std::string acceptEncoding;
+	};
+
+	//
+	// In-memory transport: each request is handed to a function in the
+	// calling thread, and its response goes back to the RPC without any
+	// socket or HTTP framing (see MockServer::Handle in src/mock).
+	//
+	// It measures the CPU cost of the SDK alone, and lets an RPC be
+	// tested without a server.
+	//
+	class LoopbackTransport : public HttpTransport {
+		public:
+			typedef std::function<void(const HttpRequest& request, LoopbackResponse *response)> Handler;
+
+			explicit LoopbackTransport(const Handler& handler);
+
+			virtual void Send(const HttpRequest& request, ResponseSink *sink, RequestTiming *timing);
+
+		private:
+			Handler m_oHandler;
+	};
+
+}  // namespace mage
+#endif /* MAGELOOPBACK_TRANSPORT_H */
@@ -2,5 +2,8 @@
 #define MAGE_H
 
 #include "rpc.h"
+#include "loopbackTransport.h"
+#include "clientContext.h"
+#include "traceRecorder.h"
 
 #endif
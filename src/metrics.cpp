@@ -0,0 +1,633 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <sstream>
+
+namespace mage {
+
+	static const char* const ERROR_TYPE_NAMES[MAGE_ERROR_TYPE_COUNT] = {
+		"error",
+		"success",
+		"client_error",
+		"rpc_error",
+		"error_message"
+	};
+
+	static inline int GetHighestBit(uint64_t value) {
+#if defined(__GNUC__)
+		return 63 - __builtin_clzll(value);
+#else
+		int bit = 0;
+		while (value >>= 1) {
+			++bit;
+		}
+		return bit;
+#endif
+	}
+
+	//
+	// LatencyHistogram
+	//
+
+	LatencyHistogram::LatencyHistogram()
+	: m_iCount(0)
+	, m_iSum(0)
+	, m_iMin(std::numeric_limits<uint64_t>::max())
+	, m_iMax(0) {
+		for (int i = 0; i < BUCKET_COUNT; ++i) {
+			m_aBuckets[i].store(0, std::memory_order_relaxed);
+		}
+	}
+
+	int LatencyHistogram::GetBucketIndex(uint64_t value) {
+		if (value < SUB_BUCKET_COUNT) {
+			return static_cast<int>(value);
+		}
+
+		if (value >= (1ULL << MAX_VALUE_BITS)) {
+			value = (1ULL << MAX_VALUE_BITS) - 1;
+		}
+
+		int shift = GetHighestBit(value) - SUB_BUCKET_BITS;
+		int subBucket = static_cast<int>(value >> shift) - SUB_BUCKET_COUNT;
+
+		return SUB_BUCKET_COUNT + shift * SUB_BUCKET_COUNT + subBucket;
+	}
+
+	uint64_t LatencyHistogram::GetBucketUpperBound(int index) {
+		if (index < SUB_BUCKET_COUNT) {
+			return index;
+		}
+
+		int shift = (index - SUB_BUCKET_COUNT) / SUB_BUCKET_COUNT;
+		uint64_t subBucket = (index - SUB_BUCKET_COUNT) % SUB_BUCKET_COUNT;
+
+		return ((SUB_BUCKET_COUNT + subBucket) << shift) + (1ULL << shift) - 1;
+	}
+
+	void LatencyHistogram::Record(uint64_t value) {
+		m_aBuckets[GetBucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+		m_iCount.fetch_add(1, std::memory_order_relaxed);
+		m_iSum.fetch_add(value, std::memory_order_relaxed);
+
+		uint64_t current = m_iMin.load(std::memory_order_relaxed);
+		while (value < current &&
+		       !m_iMin.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+		}
+
+		current = m_iMax.load(std::memory_order_relaxed);
+		while (value > current &&
+		       !m_iMax.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+		}
+	}
+
+	uint64_t LatencyHistogram::GetCount() const {
+		return m_iCount.load(std::memory_order_relaxed);
+	}
+
+	uint64_t LatencyHistogram::GetSum() const {
+		return m_iSum.load(std::memory_order_relaxed);
+	}
+
+	uint64_t LatencyHistogram::GetMin() const {
+		return GetCount() == 0 ? 0 : m_iMin.load(std::memory_order_relaxed);
+	}
+
+	uint64_t LatencyHistogram::GetMax() const {
+		return m_iMax.load(std::memory_order_relaxed);
+	}
+
+	uint64_t LatencyHistogram::GetValueAtPercentile(double percentile) const {
+		uint64_t counts[BUCKET_COUNT];
+		uint64_t total = 0;
+
+		for (int i = 0; i < BUCKET_COUNT; ++i) {
+			counts[i] = m_aBuckets[i].load(std::memory_order_relaxed);
+			total += counts[i];
+		}
+
+		if (total == 0) {
+			return 0;
+		}
+
+		uint64_t rank = static_cast<uint64_t>(percentile / 100.0 * total + 0.5);
+		rank = std::max<uint64_t>(1, std::min(rank, total));
+
+		uint64_t seen = 0;
+		for (int i = 0; i < BUCKET_COUNT; ++i) {
+			seen += counts[i];
+			if (seen >= rank) {
+				return std::min(GetBucketUpperBound(i), GetMax());
+			}
+		}
+
+		return GetMax();
+	}
+
+	//
+	// RequestMetrics
+	//
+
+	RequestMetrics::RequestMetrics(const std::string& name)
+	: m_sName(name) {
+		for (int i = 0; i < MAGE_ERROR_TYPE_COUNT; ++i) {
+			m_aErrors[i].store(0, std::memory_order_relaxed);
+		}
+	}
+
+	void RequestMetrics::Record(uint64_t latency, mage_error_t result) {
+		m_oLatency.Record(latency);
+
+		if (result != MAGE_SUCCESS) {
+			m_aErrors[result].fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	uint64_t RequestMetrics::GetErrorCount(mage_error_t type) const {
+		return m_aErrors[type].load(std::memory_order_relaxed);
+	}
+
+	static RequestStats GetRequestStats(const RequestMetrics& metrics) {
+		const LatencyHistogram& latency = metrics.GetLatency();
+
+		RequestStats stats;
+		stats.name  = metrics.GetName();
+		stats.count = latency.GetCount();
+		stats.sum   = latency.GetSum();
+		stats.min   = latency.GetMin();
+		stats.max   = latency.GetMax();
+		stats.p50   = latency.GetValueAtPercentile(50.0);
+		stats.p90   = latency.GetValueAtPercentile(90.0);
+		stats.p99   = latency.GetValueAtPercentile(99.0);
+		stats.p999  = latency.GetValueAtPercentile(99.9);
+
+		for (int i = 0; i < MAGE_ERROR_TYPE_COUNT; ++i) {
+			stats.errors[i] = metrics.GetErrorCount(static_cast<mage_error_t>(i));
+		}
+
+		return stats;
+	}
+
+	static bool CompareRequestStats(const RequestStats& a, const RequestStats& b) {
+		return a.name < b.name;
+	}
+
+	//
+	// TransportMetrics
+	//
+
+	TransportMetrics::TransportMetrics()
+	: m_iRequests(0)
+	, m_iFailures(0)
+	, m_iNewConnections(0)
+	, m_iBytesUploaded(0)
+	, m_iBytesDownloaded(0)
+	, m_iBytesDecoded(0)
+	, m_iNameLookupTime(0)
+	, m_iConnectTime(0)
+	, m_iTlsTime(0)
+	, m_iWaitTime(0)
+	, m_iTransferTime(0)
+	, m_iTotalTime(0) {
+	}
+
+	void TransportMetrics::Record(const RequestTiming& timing) {
+		m_iRequests.fetch_add(1, std::memory_order_relaxed);
+		if (!timing.error.empty()) {
+			m_iFailures.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		m_iNewConnections.fetch_add(timing.newConnections, std::memory_order_relaxed);
+		m_iBytesUploaded.fetch_add(timing.bytesUploaded, std::memory_order_relaxed);
+		m_iBytesDownloaded.fetch_add(timing.bytesDownloaded, std::memory_order_relaxed);
+		m_iBytesDecoded.fetch_add(timing.bytesDecoded, std::memory_order_relaxed);
+		m_iNameLookupTime.fetch_add(timing.nameLookupTime, std::memory_order_relaxed);
+		m_iConnectTime.fetch_add(timing.connectTime, std::memory_order_relaxed);
+		m_iTlsTime.fetch_add(timing.tlsTime, std::memory_order_relaxed);
+		m_iWaitTime.fetch_add(timing.waitTime, std::memory_order_relaxed);
+		m_iTransferTime.fetch_add(timing.transferTime, std::memory_order_relaxed);
+		m_iTotalTime.fetch_add(timing.totalTime, std::memory_order_relaxed);
+	}
+
+	TransportStats TransportMetrics::GetStats() const {
+		TransportStats stats;
+		stats.requests        = m_iRequests.load(std::memory_order_relaxed);
+		stats.failures        = m_iFailures.load(std::memory_order_relaxed);
+		stats.newConnections  = m_iNewConnections.load(std::memory_order_relaxed);
+		stats.bytesUploaded   = m_iBytesUploaded.load(std::memory_order_relaxed);
+		stats.bytesDownloaded = m_iBytesDownloaded.load(std::memory_order_relaxed);
+		stats.bytesDecoded    = m_iBytesDecoded.load(std::memory_order_relaxed);
+		stats.nameLookupTime  = m_iNameLookupTime.load(std::memory_order_relaxed);
+		stats.connectTime     = m_iConnectTime.load(std::memory_order_relaxed);
+		stats.tlsTime         = m_iTlsTime.load(std::memory_order_relaxed);
+		stats.waitTime        = m_iWaitTime.load(std::memory_order_relaxed);
+		stats.transferTime    = m_iTransferTime.load(std::memory_order_relaxed);
+		stats.totalTime       = m_iTotalTime.load(std::memory_order_relaxed);
+		return stats;
+	}
+
+	//
+	// MetricsTable
+	//
+
+	MetricsTable::MetricsTable()
+	: m_oOther("other") {
+		for (int i = 0; i < METRICS_MAX_COMMANDS; ++i) {
+			m_aSlots[i].store(nullptr, std::memory_order_relaxed);
+		}
+	}
+
+	MetricsTable::~MetricsTable() {
+		for (int i = 0; i < METRICS_MAX_COMMANDS; ++i) {
+			delete m_aSlots[i].load(std::memory_order_relaxed);
+		}
+	}
+
+	RequestMetrics* MetricsTable::Get(const std::string& name) {
+		size_t hash = std::hash<std::string>()(name);
+
+		// Open addressing: probe the following slots until
+		// the entry or a free slot is found
+		for (size_t i = 0; i < METRICS_MAX_COMMANDS; ++i) {
+			std::atomic<RequestMetrics*>& slot = m_aSlots[(hash + i) % METRICS_MAX_COMMANDS];
+			RequestMetrics *metrics = slot.load(std::memory_order_acquire);
+
+			if (metrics == nullptr) {
+				RequestMetrics *created = new RequestMetrics(name);
+				if (slot.compare_exchange_strong(metrics, created, std::memory_order_acq_rel)) {
+					return created;
+				}
+
+				// Another thread took the slot first, metrics now points to its entry
+				delete created;
+			}
+
+			if (metrics->GetName() == name) {
+				return metrics;
+			}
+		}
+
+		return &m_oOther;
+	}
+
+	std::vector<RequestStats> MetricsTable::GetStats() const {
+		std::vector<RequestStats> res;
+
+		for (int i = 0; i < METRICS_MAX_COMMANDS; ++i) {
+			const RequestMetrics *metrics = m_aSlots[i].load(std::memory_order_acquire);
+			if (metrics != nullptr) {
+				res.push_back(GetRequestStats(*metrics));
+			}
+		}
+
+		std::sort(res.begin(), res.end(), CompareRequestStats);
+
+		if (m_oOther.GetLatency().GetCount() > 0) {
+			res.push_back(GetRequestStats(m_oOther));
+		}
+
+		return res;
+	}
+
+	//
+	// RateCounter
+	//
+
+	RateCounter::RateCounter()
+	: m_iTotal(0) {
+		for (int i = 0; i < SLOT_COUNT; ++i) {
+			m_aSeconds[i].store(-1, std::memory_order_relaxed);
+			m_aCounts[i].store(0, std::memory_order_relaxed);
+		}
+	}
+
+	int64_t RateCounter::GetCurrentSecond() {
+		return std::chrono::duration_cast<std::chrono::seconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	void RateCounter::Add(uint64_t count) {
+		m_iTotal.fetch_add(count, std::memory_order_relaxed);
+
+		int64_t second = GetCurrentSecond();
+		int slot = static_cast<int>(second % SLOT_COUNT);
+
+		// The first event of a second recycles the slot
+		int64_t slotSecond = m_aSeconds[slot].load(std::memory_order_relaxed);
+		if (slotSecond != second &&
+		    m_aSeconds[slot].compare_exchange_strong(slotSecond, second, std::memory_order_relaxed)) {
+			m_aCounts[slot].store(0, std::memory_order_relaxed);
+		}
+
+		m_aCounts[slot].fetch_add(count, std::memory_order_relaxed);
+	}
+
+	uint64_t RateCounter::GetTotal() const {
+		return m_iTotal.load(std::memory_order_relaxed);
+	}
+
+	double RateCounter::GetRate() const {
+		int64_t second = GetCurrentSecond();
+		uint64_t count = 0;
+
+		// The current second is not over yet, and is left out
+		for (int i = 0; i < SLOT_COUNT; ++i) {
+			int64_t slotSecond = m_aSeconds[i].load(std::memory_order_relaxed);
+			if (slotSecond < second && slotSecond >= second - RATE_WINDOW_SECS) {
+				count += m_aCounts[i].load(std::memory_order_relaxed);
+			}
+		}
+
+		return static_cast<double>(count) / RATE_WINDOW_SECS;
+	}
+
+	//
+	// Metrics
+	//
+
+	Metrics::Metrics()
+	: m_oShortPolling("shortpolling")
+	, m_oLongPolling("longpolling")
+	, m_oBatchSize("batchSize")
+	, m_oParseTime("parseTime")
+	, m_oDeliveryLag("deliveryLag") {
+	}
+
+	void Metrics::RecordCommand(const std::string& name, uint64_t latency,
+	                            mage_error_t result) {
+		m_oCommands.Get(name)->Record(latency, result);
+	}
+
+	void Metrics::RecordMsgStream(int transport, uint64_t latency,
+	                              mage_error_t result) {
+		// 0 is SHORTPOLLING, see the Transport enum
+		if (transport == 0) {
+			m_oShortPolling.Record(latency, result);
+		} else {
+			m_oLongPolling.Record(latency, result);
+		}
+	}
+
+	void Metrics::RecordTransfer(const RequestTiming& timing) {
+		m_aTransport[timing.kind].Record(timing);
+	}
+
+	void Metrics::RecordEventBatch(uint64_t eventCount, uint64_t parseTime) {
+		m_oEventsReceived.Add(eventCount);
+		m_oBatchSize.Record(eventCount);
+		m_oParseTime.Record(parseTime);
+	}
+
+	void Metrics::RecordEventDelivery(uint64_t lag) {
+		m_oDeliveryLag.Record(lag);
+	}
+
+	RequestMetrics* Metrics::GetObserverMetrics(const std::string& name) {
+		return m_oObservers.Get(name);
+	}
+
+	MetricsSnapshot Metrics::GetSnapshot() const {
+		MetricsSnapshot snapshot;
+
+		snapshot.commands = m_oCommands.GetStats();
+
+		snapshot.msgStream.push_back(GetRequestStats(m_oShortPolling));
+		snapshot.msgStream.push_back(GetRequestStats(m_oLongPolling));
+
+		snapshot.transport[COMMAND_REQUEST]   = m_aTransport[COMMAND_REQUEST].GetStats();
+		snapshot.transport[MSGSTREAM_REQUEST] = m_aTransport[MSGSTREAM_REQUEST].GetStats();
+
+		snapshot.events.received          = m_oEventsReceived.GetTotal();
+		snapshot.events.receivedPerSecond = m_oEventsReceived.GetRate();
+		snapshot.events.batchSize         = GetRequestStats(m_oBatchSize);
+		snapshot.events.parseTime         = GetRequestStats(m_oParseTime);
+		snapshot.events.deliveryLag       = GetRequestStats(m_oDeliveryLag);
+
+		snapshot.observers = m_oObservers.GetStats();
+
+		return snapshot;
+	}
+
+	//
+	// MetricsSnapshot
+	//
+
+	static Json::Value DistributionToJson(const RequestStats& stats) {
+		Json::Value res;
+		res["min"]  = static_cast<Json::UInt64>(stats.min);
+		res["max"]  = static_cast<Json::UInt64>(stats.max);
+		res["mean"] = stats.count > 0 ? static_cast<double>(stats.sum) / stats.count : 0.0;
+		res["p50"]  = static_cast<Json::UInt64>(stats.p50);
+		res["p90"]  = static_cast<Json::UInt64>(stats.p90);
+		res["p99"]  = static_cast<Json::UInt64>(stats.p99);
+		res["p999"] = static_cast<Json::UInt64>(stats.p999);
+
+		return res;
+	}
+
+	static Json::Value RequestStatsToJson(const RequestStats& stats) {
+		Json::Value res;
+		res["count"] = static_cast<Json::UInt64>(stats.count);
+
+		Json::Value& errors = res["errors"];
+		errors = Json::Value(Json::objectValue);
+		for (int i = 0; i < MAGE_ERROR_TYPE_COUNT; ++i) {
+			if (i != MAGE_SUCCESS && stats.errors[i] > 0) {
+				errors[ERROR_TYPE_NAMES[i]] = static_cast<Json::UInt64>(stats.errors[i]);
+			}
+		}
+
+		// All the latencies are in microseconds
+		res["latency"] = DistributionToJson(stats);
+
+		return res;
+	}
+
+	static const char* const REQUEST_KIND_NAMES[2] = {
+		"commands",
+		"msgStream"
+	};
+
+	static Json::Value TransportStatsToJson(const TransportStats& stats) {
+		Json::Value res;
+		res["requests"]        = static_cast<Json::UInt64>(stats.requests);
+		res["failures"]        = static_cast<Json::UInt64>(stats.failures);
+		res["newConnections"]  = static_cast<Json::UInt64>(stats.newConnections);
+		res["bytesUploaded"]   = static_cast<Json::UInt64>(stats.bytesUploaded);
+		res["bytesDownloaded"] = static_cast<Json::UInt64>(stats.bytesDownloaded);
+		res["bytesDecoded"]    = static_cast<Json::UInt64>(stats.bytesDecoded);
+
+		// Total time spent in each phase, in microseconds
+		Json::Value& time = res["time"];
+		time["nameLookup"] = static_cast<Json::UInt64>(stats.nameLookupTime);
+		time["connect"]    = static_cast<Json::UInt64>(stats.connectTime);
+		time["tls"]        = static_cast<Json::UInt64>(stats.tlsTime);
+		time["wait"]       = static_cast<Json::UInt64>(stats.waitTime);
+		time["transfer"]   = static_cast<Json::UInt64>(stats.transferTime);
+		time["total"]      = static_cast<Json::UInt64>(stats.totalTime);
+
+		return res;
+	}
+
+	Json::Value MetricsSnapshot::ToJson() const {
+		Json::Value res;
+
+		res["commands"] = Json::Value(Json::objectValue);
+		std::vector<RequestStats>::const_iterator citr;
+		for (citr = commands.begin(); citr != commands.end(); ++citr) {
+			res["commands"][citr->name] = RequestStatsToJson(*citr);
+		}
+
+		res["msgStream"] = Json::Value(Json::objectValue);
+		for (citr = msgStream.begin(); citr != msgStream.end(); ++citr) {
+			res["msgStream"][citr->name] = RequestStatsToJson(*citr);
+		}
+
+		for (int i = COMMAND_REQUEST; i <= MSGSTREAM_REQUEST; ++i) {
+			res["transport"][REQUEST_KIND_NAMES[i]] = TransportStatsToJson(transport[i]);
+		}
+
+		Json::Value& eventStats = res["events"];
+		eventStats["received"]          = static_cast<Json::UInt64>(events.received);
+		eventStats["receivedPerSecond"] = events.receivedPerSecond;
+		eventStats["batches"]           = static_cast<Json::UInt64>(events.batchSize.count);
+		eventStats["batchSize"]         = DistributionToJson(events.batchSize);
+		eventStats["parseTime"]         = DistributionToJson(events.parseTime);
+		eventStats["deliveryLag"]       = DistributionToJson(events.deliveryLag);
+
+		res["observers"] = Json::Value(Json::objectValue);
+		for (citr = observers.begin(); citr != observers.end(); ++citr) {
+			res["observers"][citr->name] = RequestStatsToJson(*citr);
+		}
+
+		return res;
+	}
+
+	static std::string EscapeLabel(const std::string& value) {
+		std::string res;
+		res.reserve(value.size());
+
+		for (std::string::const_iterator it = value.begin(); it != value.end(); ++it) {
+			switch (*it) {
+				case '\\':
+					res += "\\\\";
+					break;
+				case '"':
+					res += "\\\"";
+					break;
+				case '\n':
+					res += "\\n";
+					break;
+				default:
+					res += *it;
+			}
+		}
+
+		return res;
+	}
+
+	static void WriteSummary(std::ostream& out, const std::string& metric,
+	                         const std::string& label, const std::vector<RequestStats>& list) {
+		out << "# TYPE " << metric << "_latency_microseconds summary\n";
+		std::vector<RequestStats>::const_iterator citr;
+		for (citr = list.begin(); citr != list.end(); ++citr) {
+			std::string labels = label + "=\"" + EscapeLabel(citr->name) + "\"";
+			out << metric << "_latency_microseconds{" << labels << ",quantile=\"0.5\"} " << citr->p50 << "\n"
+			    << metric << "_latency_microseconds{" << labels << ",quantile=\"0.9\"} " << citr->p90 << "\n"
+			    << metric << "_latency_microseconds{" << labels << ",quantile=\"0.99\"} " << citr->p99 << "\n"
+			    << metric << "_latency_microseconds{" << labels << ",quantile=\"0.999\"} " << citr->p999 << "\n"
+			    << metric << "_latency_microseconds_sum{" << labels << "} " << citr->sum << "\n"
+			    << metric << "_latency_microseconds_count{" << labels << "} " << citr->count << "\n";
+		}
+
+		out << "# TYPE " << metric << "_errors_total counter\n";
+		for (citr = list.begin(); citr != list.end(); ++citr) {
+			for (int i = 0; i < MAGE_ERROR_TYPE_COUNT; ++i) {
+				if (i == MAGE_SUCCESS) {
+					continue;
+				}
+
+				out << metric << "_errors_total{" << label << "=\"" << EscapeLabel(citr->name) << "\""
+				    << ",type=\"" << ERROR_TYPE_NAMES[i] << "\"} " << citr->errors[i] << "\n";
+			}
+		}
+	}
+
+	static void WriteDistribution(std::ostream& out, const std::string& metric,
+	                              const RequestStats& stats) {
+		out << "# TYPE " << metric << " summary\n"
+		    << metric << "{quantile=\"0.5\"} " << stats.p50 << "\n"
+		    << metric << "{quantile=\"0.9\"} " << stats.p90 << "\n"
+		    << metric << "{quantile=\"0.99\"} " << stats.p99 << "\n"
+		    << metric << "{quantile=\"0.999\"} " << stats.p999 << "\n"
+		    << metric << "_sum " << stats.sum << "\n"
+		    << metric << "_count " << stats.count << "\n";
+	}
+
+	std::string MetricsSnapshot::ToPrometheus() const {
+		std::stringstream ss;
+
+		WriteSummary(ss, "mage_command", "command", commands);
+		WriteSummary(ss, "mage_msgstream", "transport", msgStream);
+
+		ss << "# TYPE mage_http_requests_total counter\n";
+		for (int i = COMMAND_REQUEST; i <= MSGSTREAM_REQUEST; ++i) {
+			ss << "mage_http_requests_total{kind=\"" << REQUEST_KIND_NAMES[i] << "\"} "
+			   << transport[i].requests << "\n";
+		}
+
+		ss << "# TYPE mage_http_failures_total counter\n";
+		for (int i = COMMAND_REQUEST; i <= MSGSTREAM_REQUEST; ++i) {
+			ss << "mage_http_failures_total{kind=\"" << REQUEST_KIND_NAMES[i] << "\"} "
+			   << transport[i].failures << "\n";
+		}
+
+		ss << "# TYPE mage_http_connections_total counter\n";
+		for (int i = COMMAND_REQUEST; i <= MSGSTREAM_REQUEST; ++i) {
+			ss << "mage_http_connections_total{kind=\"" << REQUEST_KIND_NAMES[i] << "\"} "
+			   << transport[i].newConnections << "\n";
+		}
+
+		ss << "# TYPE mage_http_bytes_total counter\n";
+		for (int i = COMMAND_REQUEST; i <= MSGSTREAM_REQUEST; ++i) {
+			ss << "mage_http_bytes_total{kind=\"" << REQUEST_KIND_NAMES[i] << "\",direction=\"up\"} "
+			   << transport[i].bytesUploaded << "\n"
+			   << "mage_http_bytes_total{kind=\"" << REQUEST_KIND_NAMES[i] << "\",direction=\"down\"} "
+			   << transport[i].bytesDownloaded << "\n";
+		}
+
+		ss << "# TYPE mage_http_decoded_bytes_total counter\n";
+		for (int i = COMMAND_REQUEST; i <= MSGSTREAM_REQUEST; ++i) {
+			ss << "mage_http_decoded_bytes_total{kind=\"" << REQUEST_KIND_NAMES[i] << "\"} "
+			   << transport[i].bytesDecoded << "\n";
+		}
+
+		ss << "# TYPE mage_http_phase_microseconds_total counter\n";
+		for (int i = COMMAND_REQUEST; i <= MSGSTREAM_REQUEST; ++i) {
+			const TransportStats& stats = transport[i];
+			std::string prefix = std::string("mage_http_phase_microseconds_total{kind=\"") +
+			                     REQUEST_KIND_NAMES[i] + "\",phase=\"";
+			ss << prefix << "name_lookup\"} " << stats.nameLookupTime << "\n"
+			   << prefix << "connect\"} " << stats.connectTime << "\n"
+			   << prefix << "tls\"} " << stats.tlsTime << "\n"
+			   << prefix << "wait\"} " << stats.waitTime << "\n"
+			   << prefix << "transfer\"} " << stats.transferTime << "\n";
+		}
+
+		ss << "# TYPE mage_events_received_total counter\n"
+		   << "mage_events_received_total " << events.received << "\n"
+		   << "# TYPE mage_events_received_per_second gauge\n"
+		   << "mage_events_received_per_second " << events.receivedPerSecond << "\n";
+
+		WriteDistribution(ss, "mage_event_batch_size", events.batchSize);
+		WriteDistribution(ss, "mage_event_parse_microseconds", events.parseTime);
+		WriteDistribution(ss, "mage_event_delivery_lag_microseconds", events.deliveryLag);
+
+		WriteSummary(ss, "mage_observer", "observer", observers);
+
+		return ss.str();
+	}
+
+}  // namespace mage
@@ -0,0 +1,254 @@
+#ifndef MAGEMETRICS_H
+#define MAGEMETRICS_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include <jsonrpc/rpc.h>
+
+#include "exceptions.h"
+#include "requestTiming.h"
+
+#ifndef METRICS_MAX_COMMANDS
+	#define METRICS_MAX_COMMANDS 128
+#endif
+
+namespace mage {
+
+	static const int MAGE_ERROR_TYPE_COUNT = MAGE_ERROR_MESSAGE + 1;
+
+	inline uint64_t MicrosecondsSince(const std::chrono::steady_clock::time_point& start) {
+		return std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - start).count();
+	}
+
+	//
+	// Log-linear histogram, in the spirit of HdrHistogram.
+	//
+	// Values below 16 are counted exactly, then each power of two is
+	// split into 16 linear sub-buckets, which keeps the error on any
+	// percentile under 6.25%. Recording is a few relaxed atomic
+	// operations and never takes a lock.
+	//
+	class LatencyHistogram {
+		public:
+			LatencyHistogram();
+
+			void Record(uint64_t value);
+
+			uint64_t GetCount() const;
+			uint64_t GetSum() const;
+			uint64_t GetMin() const;
+			uint64_t GetMax() const;
+			uint64_t GetValueAtPercentile(double percentile) const;
+
+		private:
+			LatencyHistogram(const LatencyHistogram&);
+			LatencyHistogram& operator=(const LatencyHistogram&);
+
+			static const int SUB_BUCKET_BITS  = 4;
+			static const int SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+			// Values are clamped to 2^40 (about 12 days in microseconds)
+			static const int MAX_VALUE_BITS   = 40;
+			static const int BUCKET_COUNT     = SUB_BUCKET_COUNT * (MAX_VALUE_BITS - SUB_BUCKET_BITS + 1);
+
+			static int GetBucketIndex(uint64_t value);
+			static uint64_t GetBucketUpperBound(int index);
+
+			std::atomic<uint64_t> m_aBuckets[BUCKET_COUNT];
+			std::atomic<uint64_t> m_iCount;
+			std::atomic<uint64_t> m_iSum;
+			std::atomic<uint64_t> m_iMin;
+			std::atomic<uint64_t> m_iMax;
+	};
+
+	//
+	// Latency (in microseconds) and errors of one kind of request
+	//
+	class RequestMetrics {
+		public:
+			explicit RequestMetrics(const std::string& name = "");
+
+			void Record(uint64_t latency, mage_error_t result = MAGE_SUCCESS);
+
+			const std::string& GetName() const { return m_sName; }
+			const LatencyHistogram& GetLatency() const { return m_oLatency; }
+			uint64_t GetErrorCount(mage_error_t type) const;
+
+		private:
+			std::string m_sName;
+			LatencyHistogram m_oLatency;
+			std::atomic<uint64_t> m_aErrors[MAGE_ERROR_TYPE_COUNT];
+	};
+
+	struct RequestStats {
+		std::string name;
+		uint64_t count;
+		uint64_t errors[MAGE_ERROR_TYPE_COUNT];
+		uint64_t sum;
+		uint64_t min;
+		uint64_t max;
+		uint64_t p50;
+		uint64_t p90;
+		uint64_t p99;
+		uint64_t p999;
+	};
+
+	//
+	// Lock-free table of RequestMetrics keyed by name.
+	//
+	// An entry gets its slot the first time it is looked up, and keeps
+	// it until the table is destroyed. Once METRICS_MAX_COMMANDS entries
+	// are known, the others are recorded together under "other".
+	//
+	class MetricsTable {
+		public:
+			MetricsTable();
+			~MetricsTable();
+
+			RequestMetrics* Get(const std::string& name);
+			std::vector<RequestStats> GetStats() const;
+
+		private:
+			MetricsTable(const MetricsTable&);
+			MetricsTable& operator=(const MetricsTable&);
+
+			std::atomic<RequestMetrics*> m_aSlots[METRICS_MAX_COMMANDS];
+			RequestMetrics m_oOther;
+	};
+
+	//
+	// Counts the events, and the number of events per second received
+	// during the last RATE_WINDOW_SECS full seconds. Concurrent updates
+	// at the turn of a second may be lost, so the rate is approximate.
+	//
+	class RateCounter {
+		public:
+			RateCounter();
+
+			void Add(uint64_t count);
+
+			uint64_t GetTotal() const;
+			double GetRate() const;
+
+		private:
+			static const int RATE_WINDOW_SECS = 10;
+			static const int SLOT_COUNT       = RATE_WINDOW_SECS + 1;
+
+			static int64_t GetCurrentSecond();
+
+			std::atomic<uint64_t> m_iTotal;
+			std::atomic<int64_t>  m_aSeconds[SLOT_COUNT];
+			std::atomic<uint64_t> m_aCounts[SLOT_COUNT];
+	};
+
+	struct EventStats {
+		uint64_t received;
+		double receivedPerSecond;
+		// Number of events per response (msgstream or command)
+		RequestStats batchSize;
+		// Time spent parsing each response
+		RequestStats parseTime;
+		// From the arrival of the event to the end of its dispatch
+		RequestStats deliveryLag;
+	};
+
+	//
+	// Totals of the HTTP requests sent, durations are in microseconds
+	//
+	struct TransportStats {
+		uint64_t requests;
+		uint64_t failures;
+		uint64_t newConnections;
+		uint64_t bytesUploaded;
+		uint64_t bytesDownloaded;
+		// Downloaded once decompressed
+		uint64_t bytesDecoded;
+		uint64_t nameLookupTime;
+		uint64_t connectTime;
+		uint64_t tlsTime;
+		uint64_t waitTime;
+		uint64_t transferTime;
+		uint64_t totalTime;
+	};
+
+	class TransportMetrics {
+		public:
+			TransportMetrics();
+
+			void Record(const RequestTiming& timing);
+			TransportStats GetStats() const;
+
+		private:
+			std::atomic<uint64_t> m_iRequests;
+			std::atomic<uint64_t> m_iFailures;
+			std::atomic<uint64_t> m_iNewConnections;
+			std::atomic<uint64_t> m_iBytesUploaded;
+			std::atomic<uint64_t> m_iBytesDownloaded;
+			std::atomic<uint64_t> m_iBytesDecoded;
+			std::atomic<uint64_t> m_iNameLookupTime;
+			std::atomic<uint64_t> m_iConnectTime;
+			std::atomic<uint64_t> m_iTlsTime;
+			std::atomic<uint64_t> m_iWaitTime;
+			std::atomic<uint64_t> m_iTransferTime;
+			std::atomic<uint64_t> m_iTotalTime;
+	};
+
+	//
+	// Copy of the metrics at a given time
+	//
+	class MetricsSnapshot {
+		public:
+			std::vector<RequestStats> commands;
+			std::vector<RequestStats> msgStream;
+			// Indexed by RequestKind
+			TransportStats transport[2];
+			EventStats events;
+			// Time spent in each EventObserver::ReceiveEvent
+			std::vector<RequestStats> observers;
+
+			Json::Value ToJson() const;
+			std::string ToPrometheus() const;
+	};
+
+	//
+	// Metrics collected by an RPC instance
+	//
+	class Metrics {
+		public:
+			Metrics();
+
+			void RecordCommand(const std::string& name, uint64_t latency,
+			                   mage_error_t result = MAGE_SUCCESS);
+			void RecordMsgStream(int transport, uint64_t latency,
+			                     mage_error_t result = MAGE_SUCCESS);
+			void RecordTransfer(const RequestTiming& timing);
+			void RecordEventBatch(uint64_t eventCount, uint64_t parseTime);
+			void RecordEventDelivery(uint64_t lag);
+
+			// The returned entry can be kept to record the observer's
+			// handler time without looking it up every time
+			RequestMetrics* GetObserverMetrics(const std::string& name);
+
+			MetricsSnapshot GetSnapshot() const;
+
+		private:
+			Metrics(const Metrics&);
+			Metrics& operator=(const Metrics&);
+
+			MetricsTable m_oCommands;
+			MetricsTable m_oObservers;
+			RequestMetrics m_oShortPolling;
+			RequestMetrics m_oLongPolling;
+			TransportMetrics m_aTransport[2];
+			RateCounter m_oEventsReceived;
+			RequestMetrics m_oBatchSize;
+			RequestMetrics m_oParseTime;
+			RequestMetrics m_oDeliveryLag;
+	};
+
+}  // namespace mage
+#endif /* MAGEMETRICS_H */
@@ -0,0 +1,794 @@
+#include "http2Session.h"
+
+#include <unordered_map>
+#include <algorithm>
+
+// Streams a client may open at once
+#ifndef MOCK_HTTP2_MAX_STREAMS
+	#define MOCK_HTTP2_MAX_STREAMS 1024
+#endif
+
+namespace mage {
+
+	enum FrameType {
+		FRAME_DATA = 0,
+		FRAME_HEADERS,
+		FRAME_PRIORITY,
+		FRAME_RST_STREAM,
+		FRAME_SETTINGS,
+		FRAME_PUSH_PROMISE,
+		FRAME_PING,
+		FRAME_GOAWAY,
+		FRAME_WINDOW_UPDATE,
+		FRAME_CONTINUATION
+	};
+
+	static const uint8_t FLAG_END_STREAM  = 0x1;
+	static const uint8_t FLAG_ACK         = 0x1;
+	static const uint8_t FLAG_END_HEADERS = 0x4;
+	static const uint8_t FLAG_PADDED      = 0x8;
+	static const uint8_t FLAG_PRIORITY    = 0x20;
+
+	static const uint16_t SETTINGS_HEADER_TABLE_SIZE     = 0x1;
+	static const uint16_t SETTINGS_MAX_CONCURRENT_STREAMS = 0x3;
+	static const uint16_t SETTINGS_INITIAL_WINDOW_SIZE   = 0x4;
+	static const uint16_t SETTINGS_MAX_FRAME_SIZE        = 0x5;
+
+	static const uint32_t DEFAULT_WINDOW_SIZE  = 65535;
+	static const uint32_t MAX_WINDOW_SIZE      = 0x7fffffff;
+	static const uint32_t DEFAULT_FRAME_SIZE   = 16384;
+	static const size_t DEFAULT_HEADER_TABLE   = 4096;
+
+	// Size of the frame header
+	static const size_t FRAME_HEADER_SIZE = 9;
+
+	// RFC 7541, appendix A
+	static const char *s_aStaticTable[][2] = {
+		{":authority", ""},
+		{":method", "GET"},
+		{":method", "POST"},
+		{":path", "/"},
+		{":path", "/index.html"},
+		{":scheme", "http"},
+		{":scheme", "https"},
+		{":status", "200"},
+		{":status", "204"},
+		{":status", "206"},
+		{":status", "304"},
+		{":status", "400"},
+		{":status", "404"},
+		{":status", "500"},
+		{"accept-charset", ""},
+		{"accept-encoding", "gzip, deflate"},
+		{"accept-language", ""},
+		{"accept-ranges", ""},
+		{"accept", ""},
+		{"access-control-allow-origin", ""},
+		{"age", ""},
+		{"allow", ""},
+		{"authorization", ""},
+		{"cache-control", ""},
+		{"content-disposition", ""},
+		{"content-encoding", ""},
+		{"content-language", ""},
+		{"content-length", ""},
+		{"content-location", ""},
+		{"content-range", ""},
+		{"content-type", ""},
+		{"cookie", ""},
+		{"date", ""},
+		{"etag", ""},
+		{"expect", ""},
+		{"expires", ""},
+		{"from", ""},
+		{"host", ""},
+		{"if-match", ""},
+		{"if-modified-since", ""},
+		{"if-none-match", ""},
+		{"if-range", ""},
+		{"if-unmodified-since", ""},
+		{"last-modified", ""},
+		{"link", ""},
+		{"location", ""},
+		{"max-forwards", ""},
+		{"proxy-authenticate", ""},
+		{"proxy-authorization", ""},
+		{"range", ""},
+		{"referer", ""},
+		{"refresh", ""},
+		{"retry-after", ""},
+		{"server", ""},
+		{"set-cookie", ""},
+		{"strict-transport-security", ""},
+		{"transfer-encoding", ""},
+		{"user-agent", ""},
+		{"vary", ""},
+		{"via", ""},
+		{"www-authenticate", ""},
+	};
+
+	// RFC 7541, appendix B: code and length in bits of each byte (EOS excluded)
+	static const uint32_t s_aHuffmanCodes[256] = {
+		0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+		0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+		0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+		0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+		0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+		0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+		0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+		0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+		0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+		0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+		0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+		0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+		0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+		0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+		0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+		0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+		0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+		0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+		0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+		0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+		0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+		0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+		0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+		0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+		0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+		0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+		0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+		0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+		0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+		0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+		0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+		0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+	};
+
+	static const uint8_t s_aHuffmanLengths[256] = {
+		13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+		28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+		6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+		5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+		13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+		7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+		15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+		6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+		20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+		24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+		22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+		21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+		26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+		19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+		20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+		26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+	};
+
+	static const size_t STATIC_TABLE_SIZE = sizeof(s_aStaticTable) / sizeof(s_aStaticTable[0]);
+
+	static uint32_t ReadUInt32(const char *data) {
+		const unsigned char *bytes = reinterpret_cast<const unsigned char*>(data);
+		return (static_cast<uint32_t>(bytes[0]) << 24) | (static_cast<uint32_t>(bytes[1]) << 16) |
+		       (static_cast<uint32_t>(bytes[2]) << 8) | static_cast<uint32_t>(bytes[3]);
+	}
+
+	static void AppendUInt32(std::string *output, uint32_t value) {
+		output->push_back(static_cast<char>(value >> 24));
+		output->push_back(static_cast<char>(value >> 16));
+		output->push_back(static_cast<char>(value >> 8));
+		output->push_back(static_cast<char>(value));
+	}
+
+	static void AppendFrame(std::string *output, uint8_t type, uint8_t flags, uint32_t streamId,
+	                        const char *payload, size_t length) {
+		output->push_back(static_cast<char>(length >> 16));
+		output->push_back(static_cast<char>(length >> 8));
+		output->push_back(static_cast<char>(length));
+		output->push_back(static_cast<char>(type));
+		output->push_back(static_cast<char>(flags));
+		AppendUInt32(output, streamId);
+		output->append(payload, length);
+	}
+
+	static void AppendWindowUpdate(std::string *output, uint32_t streamId, uint32_t increment) {
+		std::string payload;
+		AppendUInt32(&payload, increment);
+		AppendFrame(output, FRAME_WINDOW_UPDATE, 0, streamId, payload.data(), payload.size());
+	}
+
+	//
+	// HPACK primitives (RFC 7541, section 5)
+	//
+	static void EncodeInteger(std::string *output, uint64_t value, int prefixBits, uint8_t flags) {
+		uint64_t max = (1u << prefixBits) - 1;
+		if (value < max) {
+			output->push_back(static_cast<char>(flags | value));
+			return;
+		}
+
+		output->push_back(static_cast<char>(flags | max));
+		value -= max;
+		while (value >= 0x80) {
+			output->push_back(static_cast<char>((value & 0x7f) | 0x80));
+			value >>= 7;
+		}
+		output->push_back(static_cast<char>(value));
+	}
+
+	// Literal header field without indexing, with an indexed name
+	static void EncodeField(std::string *output, size_t nameIndex, const std::string& value) {
+		EncodeInteger(output, nameIndex, 4, 0x00);
+		EncodeInteger(output, value.size(), 7, 0x00);
+		output->append(value);
+	}
+
+	static bool DecodeInteger(const std::string& block, size_t *position, int prefixBits, uint64_t *value) {
+		if (*position >= block.size()) {
+			return false;
+		}
+
+		uint64_t max = (1u << prefixBits) - 1;
+		uint64_t result = static_cast<unsigned char>(block[(*position)++]) & max;
+		if (result < max) {
+			*value = result;
+			return true;
+		}
+
+		for (int shift = 0; *position < block.size() && shift <= 28; shift += 7) {
+			unsigned char byte = static_cast<unsigned char>(block[(*position)++]);
+			result += static_cast<uint64_t>(byte & 0x7f) << shift;
+			if ((byte & 0x80) == 0) {
+				*value = result;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	typedef std::unordered_map<uint64_t, unsigned char> HuffmanCodes;
+
+	// Symbols by length and code
+	static HuffmanCodes BuildHuffmanCodes() {
+		HuffmanCodes codes;
+		for (int i = 0; i < 256; ++i) {
+			uint64_t key = (static_cast<uint64_t>(s_aHuffmanLengths[i]) << 32) | s_aHuffmanCodes[i];
+			codes[key] = static_cast<unsigned char>(i);
+		}
+		return codes;
+	}
+
+	static bool DecodeHuffman(const char *data, size_t size, std::string *output) {
+		static const HuffmanCodes s_oCodes = BuildHuffmanCodes();
+
+		uint64_t code = 0;
+		uint64_t bits = 0;
+
+		for (size_t i = 0; i < size; ++i) {
+			unsigned char byte = static_cast<unsigned char>(data[i]);
+
+			for (int bit = 7; bit >= 0; --bit) {
+				code = (code << 1) | ((byte >> bit) & 1);
+				++bits;
+
+				if (bits > 30) {
+					return false;
+				}
+
+				HuffmanCodes::const_iterator citr = s_oCodes.find((bits << 32) | code);
+				if (citr != s_oCodes.end()) {
+					output->push_back(static_cast<char>(citr->second));
+					code = 0;
+					bits = 0;
+				}
+			}
+		}
+
+		// Padded with the most significant bits of EOS: all ones
+		return bits < 8 && code == (1u << bits) - 1;
+	}
+
+	static bool DecodeString(const std::string& block, size_t *position, std::string *output) {
+		if (*position >= block.size()) {
+			return false;
+		}
+
+		bool isHuffman = (static_cast<unsigned char>(block[*position]) & 0x80) != 0;
+
+		uint64_t length;
+		if (!DecodeInteger(block, position, 7, &length) || length > block.size() - *position) {
+			return false;
+		}
+
+		const char *data = block.data() + *position;
+		*position += length;
+
+		if (isHuffman) {
+			return DecodeHuffman(data, length, output);
+		}
+
+		output->assign(data, length);
+		return true;
+	}
+
+	Http2Session::Http2Session()
+	: m_bHasPreface(false)
+	, m_iPeerMaxFrameSize(DEFAULT_FRAME_SIZE)
+	, m_iPeerInitialWindow(DEFAULT_WINDOW_SIZE)
+	, m_iSendWindow(DEFAULT_WINDOW_SIZE)
+	, m_iLastStreamId(0)
+	, m_iHeaderStreamId(0)
+	, m_bIsHeaderEndStream(false)
+	, m_iDynamicTableSize(0)
+	, m_iMaxDynamicTableSize(DEFAULT_HEADER_TABLE) {
+	}
+
+	const std::string& Http2Session::GetPreface() {
+		static const std::string preface("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n");
+		return preface;
+	}
+
+	bool Http2Session::Receive(std::string *input, std::string *output, std::vector<Http2Request> *requests,
+	                           std::vector<uint32_t> *resetStreams) {
+		if (!m_bHasPreface) {
+			const std::string& preface = GetPreface();
+			if (input->size() < preface.size()) {
+				return true;
+			}
+
+			if (input->compare(0, preface.size(), preface) != 0) {
+				return false;
+			}
+
+			input->erase(0, preface.size());
+			m_bHasPreface = true;
+
+			// The client may send as much as it wants: the windows are
+			// opened to the maximum, and the connection one kept there
+			std::string settings;
+			settings.push_back(0);
+			settings.push_back(SETTINGS_MAX_CONCURRENT_STREAMS);
+			AppendUInt32(&settings, MOCK_HTTP2_MAX_STREAMS);
+			settings.push_back(0);
+			settings.push_back(SETTINGS_INITIAL_WINDOW_SIZE);
+			AppendUInt32(&settings, MAX_WINDOW_SIZE);
+
+			AppendFrame(output, FRAME_SETTINGS, 0, 0, settings.data(), settings.size());
+			AppendWindowUpdate(output, 0, MAX_WINDOW_SIZE - DEFAULT_WINDOW_SIZE);
+		}
+
+		size_t offset = 0;
+		bool isOpen = true;
+
+		while (isOpen && input->size() - offset >= FRAME_HEADER_SIZE) {
+			const unsigned char *header = reinterpret_cast<const unsigned char*>(input->data() + offset);
+			size_t length = (static_cast<size_t>(header[0]) << 16) | (static_cast<size_t>(header[1]) << 8) | header[2];
+
+			if (length > DEFAULT_FRAME_SIZE) {
+				isOpen = false;
+				break;
+			}
+
+			if (input->size() - offset < FRAME_HEADER_SIZE + length) {
+				break;
+			}
+
+			uint32_t streamId = ReadUInt32(input->data() + offset + 5) & 0x7fffffff;
+			isOpen = HandleFrame(header[3], header[4], streamId, input->data() + offset + FRAME_HEADER_SIZE, length,
+			                     output, requests, resetStreams);
+
+			offset += FRAME_HEADER_SIZE + length;
+		}
+
+		input->erase(0, offset);
+		return isOpen;
+	}
+
+	// Removes the padding of a DATA or HEADERS frame
+	static bool GetFramePayload(uint8_t flags, const char *payload, size_t length, size_t *start, size_t *end) {
+		*start = 0;
+		*end   = length;
+
+		if (flags & FLAG_PADDED) {
+			if (length < 1) {
+				return false;
+			}
+
+			size_t padding = static_cast<unsigned char>(payload[0]);
+			if (padding > length - 1) {
+				return false;
+			}
+
+			*start = 1;
+			*end   = length - padding;
+		}
+
+		return true;
+	}
+
+	bool Http2Session::HandleFrame(uint8_t type, uint8_t flags, uint32_t streamId, const char *payload,
+	                               size_t length, std::string *output, std::vector<Http2Request> *requests,
+	                               std::vector<uint32_t> *resetStreams) {
+		// A header block must be followed by its CONTINUATION frames
+		if (m_iHeaderStreamId != 0 && type != FRAME_CONTINUATION) {
+			return false;
+		}
+
+		size_t start, end;
+
+		switch (type) {
+			case FRAME_DATA: {
+				if (streamId == 0 || !GetFramePayload(flags, payload, length, &start, &end)) {
+					return false;
+				}
+
+				// The whole frame counts for the flow control
+				if (length > 0) {
+					AppendWindowUpdate(output, 0, static_cast<uint32_t>(length));
+				}
+
+				std::map<uint32_t, Stream>::iterator itr = m_oStreams.find(streamId);
+				if (itr == m_oStreams.end() || itr->second.isRequestComplete) {
+					return true;
+				}
+
+				itr->second.request.body.append(payload + start, end - start);
+
+				if (flags & FLAG_END_STREAM) {
+					CompleteRequest(streamId, requests);
+				}
+				return true;
+			}
+
+			case FRAME_HEADERS:
+				if (streamId == 0 || !GetFramePayload(flags, payload, length, &start, &end)) {
+					return false;
+				}
+
+				if (flags & FLAG_PRIORITY) {
+					start += 5;
+					if (start > end) {
+						return false;
+					}
+				}
+
+				m_sHeaderBlock.assign(payload + start, end - start);
+				m_bIsHeaderEndStream = (flags & FLAG_END_STREAM) != 0;
+
+				if (flags & FLAG_END_HEADERS) {
+					return HandleHeaders(streamId, m_bIsHeaderEndStream, requests);
+				}
+
+				m_iHeaderStreamId = streamId;
+				return true;
+
+			case FRAME_CONTINUATION:
+				if (streamId == 0 || streamId != m_iHeaderStreamId) {
+					return false;
+				}
+
+				m_sHeaderBlock.append(payload, length);
+
+				if (flags & FLAG_END_HEADERS) {
+					m_iHeaderStreamId = 0;
+					return HandleHeaders(streamId, m_bIsHeaderEndStream, requests);
+				}
+				return true;
+
+			case FRAME_RST_STREAM:
+				if (streamId == 0 || length != 4) {
+					return false;
+				}
+
+				m_oStreams.erase(streamId);
+				resetStreams->push_back(streamId);
+				return true;
+
+			case FRAME_SETTINGS:
+				if (streamId != 0 || length % 6 != 0) {
+					return false;
+				}
+
+				if (flags & FLAG_ACK) {
+					return true;
+				}
+
+				for (size_t i = 0; i < length; i += 6) {
+					uint16_t id = static_cast<uint16_t>((static_cast<unsigned char>(payload[i]) << 8) |
+					                                    static_cast<unsigned char>(payload[i + 1]));
+					uint32_t value = ReadUInt32(payload + i + 2);
+
+					if (id == SETTINGS_INITIAL_WINDOW_SIZE) {
+						if (value > MAX_WINDOW_SIZE) {
+							return false;
+						}
+
+						// Applies to the streams already open
+						int64_t delta = static_cast<int64_t>(value) - m_iPeerInitialWindow;
+						std::map<uint32_t, Stream>::iterator itr;
+						for (itr = m_oStreams.begin(); itr != m_oStreams.end(); ++itr) {
+							itr->second.sendWindow += delta;
+						}
+						m_iPeerInitialWindow = value;
+					} else if (id == SETTINGS_MAX_FRAME_SIZE) {
+						m_iPeerMaxFrameSize = std::min<uint32_t>(std::max<uint32_t>(value, DEFAULT_FRAME_SIZE),
+						                                         0xffffff);
+					}
+				}
+
+				AppendFrame(output, FRAME_SETTINGS, FLAG_ACK, 0, nullptr, 0);
+				FlushData(output);
+				return true;
+
+			case FRAME_PING:
+				if (streamId != 0 || length != 8) {
+					return false;
+				}
+
+				if (!(flags & FLAG_ACK)) {
+					AppendFrame(output, FRAME_PING, FLAG_ACK, 0, payload, length);
+				}
+				return true;
+
+			case FRAME_WINDOW_UPDATE: {
+				if (length != 4) {
+					return false;
+				}
+
+				uint32_t increment = ReadUInt32(payload) & 0x7fffffff;
+				if (streamId == 0) {
+					m_iSendWindow += increment;
+				} else {
+					std::map<uint32_t, Stream>::iterator itr = m_oStreams.find(streamId);
+					if (itr != m_oStreams.end()) {
+						itr->second.sendWindow += increment;
+					}
+				}
+
+				FlushData(output);
+				return true;
+			}
+
+			case FRAME_GOAWAY:
+			case FRAME_PUSH_PROMISE:
+				return false;
+
+			default:
+				// PRIORITY, and the unknown types
+				return true;
+		}
+	}
+
+	bool Http2Session::HandleHeaders(uint32_t streamId, bool isEndStream, std::vector<Http2Request> *requests) {
+		// Every block is decoded, to keep the dynamic table in sync
+		Http2Request request;
+		request.streamId = streamId;
+
+		bool isValid = DecodeHeaderBlock(m_sHeaderBlock, &request);
+		m_sHeaderBlock.clear();
+
+		if (!isValid) {
+			return false;
+		}
+
+		std::map<uint32_t, Stream>::iterator itr = m_oStreams.find(streamId);
+		if (itr == m_oStreams.end()) {
+			// A stream which was reset or is over
+			if (streamId <= m_iLastStreamId) {
+				return true;
+			}
+
+			m_iLastStreamId = streamId;
+
+			Stream& stream = m_oStreams[streamId];
+			stream.sendWindow = m_iPeerInitialWindow;
+			std::swap(stream.request, request);
+		}
+
+		// Otherwise the trailers of the request, which are ignored
+		if (isEndStream) {
+			CompleteRequest(streamId, requests);
+		}
+
+		return true;
+	}
+
+	void Http2Session::CompleteRequest(uint32_t streamId, std::vector<Http2Request> *requests) {
+		Stream& stream = m_oStreams[streamId];
+		if (stream.isRequestComplete) {
+			return;
+		}
+
+		stream.isRequestComplete = true;
+
+		requests->push_back(Http2Request());
+		std::swap(requests->back(), stream.request);
+	}
+
+	void Http2Session::SendResponse(uint32_t streamId, int status, const std::string& body,
+	                                const std::string& contentEncoding, std::string *output) {
+		std::map<uint32_t, Stream>::iterator itr = m_oStreams.find(streamId);
+		if (itr == m_oStreams.end()) {
+			// Reset by the client
+			return;
+		}
+
+		std::string block;
+
+		// Indexes of the static table
+		switch (status) {
+			case 200:
+				block.push_back(static_cast<char>(0x80 | 8));
+				break;
+			case 400:
+				block.push_back(static_cast<char>(0x80 | 12));
+				break;
+			case 404:
+				block.push_back(static_cast<char>(0x80 | 13));
+				break;
+			case 500:
+				block.push_back(static_cast<char>(0x80 | 14));
+				break;
+			default:
+				EncodeField(&block, 8, std::to_string(status));
+		}
+
+		EncodeField(&block, 31, "application/json");
+		EncodeField(&block, 28, std::to_string(body.size()));
+		if (!contentEncoding.empty()) {
+			EncodeField(&block, 26, contentEncoding);
+		}
+		// The request bodies may be gzipped
+		EncodeField(&block, 16, "gzip");
+
+		uint8_t flags = FLAG_END_HEADERS | (body.empty() ? FLAG_END_STREAM : 0);
+		AppendFrame(output, FRAME_HEADERS, flags, streamId, block.data(), block.size());
+
+		if (body.empty()) {
+			m_oStreams.erase(itr);
+			return;
+		}
+
+		Stream& stream = itr->second;
+		stream.isResponding = true;
+		stream.data         = body;
+		stream.dataOffset   = 0;
+
+		if (SendData(streamId, &stream, output)) {
+			m_oStreams.erase(itr);
+		}
+	}
+
+	void Http2Session::FlushData(std::string *output) {
+		std::map<uint32_t, Stream>::iterator itr = m_oStreams.begin();
+		while (itr != m_oStreams.end() && m_iSendWindow > 0) {
+			if (itr->second.isResponding && SendData(itr->first, &itr->second, output)) {
+				itr = m_oStreams.erase(itr);
+			} else {
+				++itr;
+			}
+		}
+	}
+
+	bool Http2Session::SendData(uint32_t streamId, Stream *stream, std::string *output) {
+		while (stream->dataOffset < stream->data.size()) {
+			int64_t size = std::min<int64_t>(stream->data.size() - stream->dataOffset, m_iPeerMaxFrameSize);
+			size = std::min(size, std::min(m_iSendWindow, stream->sendWindow));
+
+			if (size <= 0) {
+				return false;
+			}
+
+			bool isLast = (stream->dataOffset + size == stream->data.size());
+			AppendFrame(output, FRAME_DATA, isLast ? FLAG_END_STREAM : 0, streamId,
+			            stream->data.data() + stream->dataOffset, static_cast<size_t>(size));
+
+			stream->dataOffset += size;
+			stream->sendWindow -= size;
+			m_iSendWindow      -= size;
+		}
+
+		return true;
+	}
+
+	bool Http2Session::DecodeHeaderBlock(const std::string& block, Http2Request *request) {
+		size_t position = 0;
+
+		while (position < block.size()) {
+			unsigned char first = static_cast<unsigned char>(block[position]);
+			std::pair<std::string, std::string> field;
+
+			if (first & 0x80) {
+				// Indexed header field
+				uint64_t index;
+				if (!DecodeInteger(block, &position, 7, &index) || !GetIndexedField(index, &field)) {
+					return false;
+				}
+			} else if ((first & 0xe0) == 0x20) {
+				// Dynamic table size update
+				uint64_t size;
+				if (!DecodeInteger(block, &position, 5, &size) || size > DEFAULT_HEADER_TABLE) {
+					return false;
+				}
+
+				m_iMaxDynamicTableSize = static_cast<size_t>(size);
+				EvictDynamicFields();
+				continue;
+			} else {
+				// Literal header field, with incremental indexing or not
+				bool isIndexing = (first & 0xc0) == 0x40;
+
+				uint64_t index;
+				if (!DecodeInteger(block, &position, isIndexing ? 6 : 4, &index)) {
+					return false;
+				}
+
+				if (index == 0) {
+					if (!DecodeString(block, &position, &field.first)) {
+						return false;
+					}
+				} else {
+					std::pair<std::string, std::string> indexed;
+					if (!GetIndexedField(index, &indexed)) {
+						return false;
+					}
+					field.first.swap(indexed.first);
+				}
+
+				if (!DecodeString(block, &position, &field.second)) {
+					return false;
+				}
+
+				if (isIndexing) {
+					AddDynamicField(field);
+				}
+			}
+
+			if (field.first == ":method") {
+				request->method.swap(field.second);
+			} else if (field.first == ":path") {
+				request->path.swap(field.second);
+			} else if (!field.first.empty() && field.first[0] != ':') {
+				request->headers.push_back(field);
+			}
+		}
+
+		return true;
+	}
+
+	bool Http2Session::GetIndexedField(uint64_t index, std::pair<std::string, std::string> *field) const {
+		if (index == 0) {
+			return false;
+		}
+
+		if (index <= STATIC_TABLE_SIZE) {
+			field->first  = s_aStaticTable[index - 1][0];
+			field->second = s_aStaticTable[index - 1][1];
+			return true;
+		}
+
+		index -= STATIC_TABLE_SIZE + 1;
+		if (index >= m_oDynamicTable.size()) {
+			return false;
+		}
+
+		*field = m_oDynamicTable[index];
+		return true;
+	}
+
+	void Http2Session::AddDynamicField(const std::pair<std::string, std::string>& field) {
+		size_t size = field.first.size() + field.second.size() + 32;
+
+		m_oDynamicTable.push_front(field);
+		m_iDynamicTableSize += size;
+
+		EvictDynamicFields();
+	}
+
+	void Http2Session::EvictDynamicFields() {
+		while (m_iDynamicTableSize > m_iMaxDynamicTableSize && !m_oDynamicTable.empty()) {
+			const std::pair<std::string, std::string>& oldest = m_oDynamicTable.back();
+			m_iDynamicTableSize -= oldest.first.size() + oldest.second.size() + 32;
+			m_oDynamicTable.pop_back();
+		}
+	}
+
+}  // namespace mage
@@ -0,0 +1,96 @@
+#ifndef MAGEHTTP2_SESSION_H
+#define MAGEHTTP2_SESSION_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <utility>
+#include <cstdint>
+
+namespace mage {
+
+	struct Http2Request {
+		uint32_t streamId;
+		std::string method;
+		// With the query string
+		std::string path;
+		// Regular headers, with lower case names
+		std::vector<std::pair<std::string, std::string> > headers;
+		std::string body;
+	};
+
+	//
+	// Server side of an HTTP/2 connection over cleartext (h2c, with prior
+	// knowledge), for MockServer: framing, HPACK decoding and flow
+	// control, without any I/O. Enough for curl, not a general server:
+	// no server push, no priorities, and responses without trailers.
+	//
+	class Http2Session {
+		public:
+			Http2Session();
+
+			// The client connection preface, which opens an h2c connection
+			static const std::string& GetPreface();
+
+			// Consumes the frames of input, and appends the frames to send
+			// to output. The requests fully received are added to requests,
+			// and the streams cancelled by the client to resetStreams.
+			// Returns false when the connection must be closed.
+			bool Receive(std::string *input, std::string *output, std::vector<Http2Request> *requests,
+			             std::vector<uint32_t> *resetStreams);
+
+			// Appends the response to output, as far as the flow control
+			// windows allow: the rest is sent as the client opens them. The
+			// content encoding is only sent when not empty.
+			void SendResponse(uint32_t streamId, int status, const std::string& body,
+			                  const std::string& contentEncoding, std::string *output);
+
+		private:
+			struct Stream {
+				Stream() : sendWindow(0), isRequestComplete(false), isResponding(false), dataOffset(0) {}
+
+				Http2Request request;
+				int64_t sendWindow;
+				bool isRequestComplete;
+				bool isResponding;
+				// Body of the response, sent from dataOffset as the flow
+				// control windows allow
+				std::string data;
+				size_t dataOffset;
+			};
+
+			bool HandleFrame(uint8_t type, uint8_t flags, uint32_t streamId, const char *payload, size_t length,
+			                 std::string *output, std::vector<Http2Request> *requests,
+			                 std::vector<uint32_t> *resetStreams);
+			bool HandleHeaders(uint32_t streamId, bool isEndStream, std::vector<Http2Request> *requests);
+			void CompleteRequest(uint32_t streamId, std::vector<Http2Request> *requests);
+			void FlushData(std::string *output);
+			bool SendData(uint32_t streamId, Stream *stream, std::string *output);
+
+			// HPACK
+			bool DecodeHeaderBlock(const std::string& block, Http2Request *request);
+			bool GetIndexedField(uint64_t index, std::pair<std::string, std::string> *field) const;
+			void AddDynamicField(const std::pair<std::string, std::string>& field);
+			void EvictDynamicFields();
+
+			bool m_bHasPreface;
+			uint32_t m_iPeerMaxFrameSize;
+			int64_t m_iPeerInitialWindow;
+			int64_t m_iSendWindow;
+			uint32_t m_iLastStreamId;
+
+			// Header block of the stream being received, until END_HEADERS
+			uint32_t m_iHeaderStreamId;
+			bool m_bIsHeaderEndStream;
+			std::string m_sHeaderBlock;
+
+			std::map<uint32_t, Stream> m_oStreams;
+
+			std::deque<std::pair<std::string, std::string> > m_oDynamicTable;
+			size_t m_iDynamicTableSize;
+			size_t m_iMaxDynamicTableSize;
+	};
+
+}  // namespace mage
+#endif /* MAGEHTTP2_SESSION_H */
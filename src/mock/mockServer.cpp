@@ -0,0 +1,1233 @@
+#include "mockServer.h"
+#include "http2Session.h"
+
+#include <zlib.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <strings.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <memory>
+#include <sstream>
+#include <set>
+#include <system_error>
+
+#ifndef MOCK_MAX_REQUEST_SIZE
+	#define MOCK_MAX_REQUEST_SIZE (16 * 1024 * 1024)
+#endif
+
+#if defined(MSG_NOSIGNAL)
+	#define MOCK_SEND_FLAGS MSG_NOSIGNAL
+#else
+	#define MOCK_SEND_FLAGS 0
+#endif
+
+namespace mage {
+
+	struct MockServer::Connection {
+		enum State {
+			READING = 0,
+			// The response is ready but held for the latency of the server
+			DELAYED,
+			// Long polling request waiting for a message
+			POLLING,
+			WRITING,
+			CLOSED
+		};
+
+		explicit Connection(int fd)
+		: fd(fd)
+		, state(READING)
+		, outputOffset(0)
+		, closeAfterWrite(false)
+		, http2(nullptr)
+		, parent(nullptr)
+		, streamId(0)
+		, status(0)
+		, isGzipAccepted(false)
+		, isGzipped(false) {}
+
+		~Connection() {
+			delete http2;
+		}
+
+		// -1 for the streams of an HTTP/2 connection
+		int fd;
+		State state;
+		std::string input;
+		std::string output;
+		size_t outputOffset;
+		bool closeAfterWrite;
+		std::string sessionKey;
+		// When a delayed response is sent, or when a long polling
+		// request receives a heartbeat
+		std::chrono::steady_clock::time_point deadline;
+
+		// HTTP/2 over cleartext, once the client sent the preface. Each
+		// request is then served by a stream, with the same states as a
+		// connection, whose response is framed on the parent connection.
+		Http2Session *http2;
+		std::map<uint32_t, Connection*> streams;
+		Connection *parent;
+		uint32_t streamId;
+		// Of the response of a stream, in output until it is framed
+		int status;
+
+		// Accept-Encoding of the request, and Content-Encoding of its response
+		bool isGzipAccepted;
+		bool isGzipped;
+	};
+
+	static std::string Serialize(const Json::Value& value) {
+		Json::FastWriter writer;
+		std::string content = writer.write(value);
+
+		// Drop the trailing new line
+		if (!content.empty() && content[content.size() - 1] == '\n') {
+			content.resize(content.size() - 1);
+		}
+
+		return content;
+	}
+
+	static const char* GetReasonPhrase(int status) {
+		switch (status) {
+			case 200:
+				return "OK";
+			case 400:
+				return "Bad Request";
+			case 404:
+				return "Not Found";
+			case 415:
+				return "Unsupported Media Type";
+			case 500:
+				return "Internal Server Error";
+			case 503:
+				return "Service Unavailable";
+			default:
+				return "Error";
+		}
+	}
+
+	static bool SetNonBlocking(int fd) {
+		int flags = fcntl(fd, F_GETFL, 0);
+		return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+	}
+
+	static std::map<std::string, std::string> ParseQuery(const std::string& query) {
+		std::map<std::string, std::string> params;
+		std::istringstream stream(query);
+		std::string param;
+
+		while (std::getline(stream, param, '&')) {
+			size_t separator = param.find('=');
+			if (separator == std::string::npos) {
+				params[param] = "";
+			} else {
+				params[param.substr(0, separator)] = param.substr(separator + 1);
+			}
+		}
+
+		return params;
+	}
+
+	static bool EqualsIgnoreCase(const std::string& a, const char *b) {
+		return strcasecmp(a.c_str(), b) == 0;
+	}
+
+	static bool Gzip(const std::string& data, std::string *output) {
+		z_stream stream;
+		memset(&stream, 0, sizeof(stream));
+
+		// 16 + 15: a gzip header and the largest window
+		if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			return false;
+		}
+
+		output->resize(deflateBound(&stream, data.size()));
+		stream.next_in   = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+		stream.avail_in  = static_cast<uInt>(data.size());
+		stream.next_out  = reinterpret_cast<Bytef*>(&(*output)[0]);
+		stream.avail_out = static_cast<uInt>(output->size());
+
+		int result = deflate(&stream, Z_FINISH);
+		output->resize(stream.total_out);
+		deflateEnd(&stream);
+
+		return result == Z_STREAM_END;
+	}
+
+	static bool Gunzip(const std::string& data, std::string *output) {
+		z_stream stream;
+		memset(&stream, 0, sizeof(stream));
+
+		if (inflateInit2(&stream, 16 + 15) != Z_OK) {
+			return false;
+		}
+
+		stream.next_in  = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+		stream.avail_in = static_cast<uInt>(data.size());
+
+		char buffer[16384];
+		int result = Z_OK;
+		while (result == Z_OK) {
+			stream.next_out  = reinterpret_cast<Bytef*>(buffer);
+			stream.avail_out = sizeof(buffer);
+			result = inflate(&stream, Z_NO_FLUSH);
+			output->append(buffer, sizeof(buffer) - stream.avail_out);
+		}
+		inflateEnd(&stream);
+
+		return result == Z_STREAM_END && output->size() <= MOCK_MAX_REQUEST_SIZE;
+	}
+
+	// Decodes a request body sent with a Content-Encoding, returns the
+	// HTTP status to answer when it can not be
+	static int DecodeBody(const std::string& body, const std::string& contentEncoding, std::string *decoded) {
+		if (contentEncoding.empty() || EqualsIgnoreCase(contentEncoding, "identity")) {
+			*decoded = body;
+			return 200;
+		}
+
+		if (!EqualsIgnoreCase(contentEncoding, "gzip")) {
+			return 415;
+		}
+
+		return Gunzip(body, decoded) ? 200 : 400;
+	}
+
+	// Only removes a socket, never a file given by mistake
+	static bool RemoveSocket(const std::string& path) {
+		struct stat info;
+		if (lstat(path.c_str(), &info) == -1) {
+			return errno == ENOENT;
+		}
+
+		return S_ISSOCK(info.st_mode) && unlink(path.c_str()) == 0;
+	}
+
+	MockServer::MockServer(const std::string& application,
+	                       unsigned short port,
+	                       const std::string& address)
+	: m_sApplication(application)
+	, m_sAddress(address)
+	, m_iPort(port)
+	, m_iListenFd(-1)
+	, m_pThread(nullptr)
+	, m_bIsRunning(false)
+	, m_oLongPollingTimeout(std::chrono::seconds(30))
+	, m_iCompressionThreshold(0)
+	, m_oGeneratorInterval(0)
+	, m_iCommands(0)
+	, m_iMsgStreamRequests(0)
+	, m_iHeartbeats(0)
+	, m_iMessagesSent(0)
+	, m_iMessagesConfirmed(0)
+	, m_iConnections(0) {
+		m_aWakeupFds[0] = -1;
+		m_aWakeupFds[1] = -1;
+
+		// Echo the parameters
+		m_oDefaultHandler = [](const MockCommand& command, MockReply *reply) {
+			reply->result = command.params;
+		};
+	}
+
+	MockServer::~MockServer() {
+		Stop();
+	}
+
+	void MockServer::Start() {
+		if (m_pThread != nullptr) {
+			return;
+		}
+
+		m_iListenFd = socket(IsUnixSocket() ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+		if (m_iListenFd == -1) {
+			throw std::system_error(errno, std::generic_category(), "Unable to create the mock server socket");
+		}
+
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		struct sockaddr_un unixAddr;
+		memset(&unixAddr, 0, sizeof(unixAddr));
+
+		struct sockaddr *boundAddr;
+		socklen_t boundLength;
+
+		if (IsUnixSocket()) {
+			if (m_sAddress.size() >= sizeof(unixAddr.sun_path)) {
+				close(m_iListenFd);
+				m_iListenFd = -1;
+				throw std::system_error(ENAMETOOLONG, std::generic_category(), "Invalid mock server socket path");
+			}
+
+			unixAddr.sun_family = AF_UNIX;
+			memcpy(unixAddr.sun_path, m_sAddress.c_str(), m_sAddress.size());
+
+			// Left by a previous server
+			if (!RemoveSocket(m_sAddress)) {
+				close(m_iListenFd);
+				m_iListenFd = -1;
+				throw std::system_error(EEXIST, std::generic_category(),
+				                        "The mock server socket path is taken by another file");
+			}
+
+			boundAddr   = reinterpret_cast<struct sockaddr*>(&unixAddr);
+			boundLength = sizeof(unixAddr);
+		} else {
+			int reuse = 1;
+			setsockopt(m_iListenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+			addr.sin_family = AF_INET;
+			addr.sin_port   = htons(m_iPort);
+
+			if (inet_pton(AF_INET, m_sAddress.c_str(), &addr.sin_addr) != 1) {
+				close(m_iListenFd);
+				m_iListenFd = -1;
+				throw std::system_error(EINVAL, std::generic_category(), "Invalid mock server address");
+			}
+
+			boundAddr   = reinterpret_cast<struct sockaddr*>(&addr);
+			boundLength = sizeof(addr);
+		}
+
+		if (bind(m_iListenFd, boundAddr, boundLength) == -1 ||
+		    listen(m_iListenFd, SOMAXCONN) == -1 ||
+		    !SetNonBlocking(m_iListenFd) ||
+		    pipe(m_aWakeupFds) == -1) {
+			int error = errno;
+			close(m_iListenFd);
+			m_iListenFd = -1;
+			throw std::system_error(error, std::generic_category(), "Unable to start the mock server");
+		}
+
+		SetNonBlocking(m_aWakeupFds[0]);
+		SetNonBlocking(m_aWakeupFds[1]);
+
+		if (!IsUnixSocket()) {
+			socklen_t length = sizeof(addr);
+			getsockname(m_iListenFd, reinterpret_cast<struct sockaddr*>(&addr), &length);
+			m_iPort = ntohs(addr.sin_port);
+		}
+
+		m_bIsRunning = true;
+		m_pThread = new std::thread(&MockServer::Run, this);
+	}
+
+	void MockServer::Stop() {
+		if (m_pThread == nullptr) {
+			return;
+		}
+
+		m_bIsRunning = false;
+		Wakeup();
+
+		m_pThread->join();
+		delete m_pThread;
+		m_pThread = nullptr;
+
+		std::vector<Connection*>::iterator itr;
+		for (itr = m_oConnections.begin(); itr != m_oConnections.end(); ++itr) {
+			close((*itr)->fd);
+			delete *itr;
+		}
+		m_oConnections.clear();
+
+		close(m_iListenFd);
+		close(m_aWakeupFds[0]);
+		close(m_aWakeupFds[1]);
+		if (IsUnixSocket()) {
+			RemoveSocket(m_sAddress);
+		}
+		m_iListenFd = -1;
+		m_aWakeupFds[0] = -1;
+		m_aWakeupFds[1] = -1;
+	}
+
+	unsigned short MockServer::GetPort() const {
+		return m_iPort;
+	}
+
+	std::string MockServer::GetDomain() const {
+		if (IsUnixSocket()) {
+			return m_sAddress;
+		}
+
+		return m_sAddress + ":" + std::to_string(m_iPort);
+	}
+
+	std::string MockServer::GetProtocol() const {
+		return IsUnixSocket() ? "http+unix" : "http";
+	}
+
+	bool MockServer::IsUnixSocket() const {
+		return !m_sAddress.empty() && m_sAddress[0] == '/';
+	}
+
+	void MockServer::SetCommandHandler(const std::string& name, const CommandHandler& handler) {
+		std::lock_guard<std::mutex> lock(m_oMutex);
+		m_oHandlers[name] = handler;
+	}
+
+	void MockServer::SetDefaultHandler(const CommandHandler& handler) {
+		std::lock_guard<std::mutex> lock(m_oMutex);
+		m_oDefaultHandler = handler;
+	}
+
+	void MockServer::SetCommandLatency(const LatencyGenerator& generator) {
+		std::lock_guard<std::mutex> lock(m_oMutex);
+		m_oCommandLatency = generator;
+	}
+
+	void MockServer::SetMsgStreamLatency(const LatencyGenerator& generator) {
+		std::lock_guard<std::mutex> lock(m_oMutex);
+		m_oMsgStreamLatency = generator;
+	}
+
+	void MockServer::SetLongPollingTimeout(std::chrono::milliseconds timeout) {
+		std::lock_guard<std::mutex> lock(m_oMutex);
+		m_oLongPollingTimeout = timeout;
+	}
+
+	void MockServer::SetCompressionThreshold(size_t size) {
+		m_iCompressionThreshold = size;
+	}
+
+	void MockServer::PushMessage(const std::string& sessionKey, const Json::Value& events) {
+		std::string content = Serialize(events);
+
+		{
+			std::lock_guard<std::mutex> lock(m_oMutex);
+
+			if (sessionKey.empty()) {
+				std::map<std::string, Session>::iterator itr;
+				for (itr = m_oSessions.begin(); itr != m_oSessions.end(); ++itr) {
+					QueueMessage(itr->first, &itr->second, content);
+				}
+			} else {
+				QueueMessage(sessionKey, &GetSession(sessionKey), content);
+			}
+		}
+
+		// Release the long polling requests
+		m_oMessageCondition.notify_all();
+		Wakeup();
+	}
+
+	void MockServer::SetMessageGenerator(std::chrono::milliseconds interval, const MessageGenerator& generator) {
+		std::lock_guard<std::mutex> lock(m_oMutex);
+		m_oGeneratorInterval = interval;
+		// A null interval disables the generator
+		m_oMessageGenerator  = (interval.count() > 0) ? generator : MessageGenerator();
+		m_oNextGeneration    = std::chrono::steady_clock::now() + interval;
+	}
+
+	MockServerStats MockServer::GetStats() const {
+		MockServerStats stats;
+		stats.commands          = m_iCommands.load(std::memory_order_relaxed);
+		stats.msgStreamRequests = m_iMsgStreamRequests.load(std::memory_order_relaxed);
+		stats.heartbeats        = m_iHeartbeats.load(std::memory_order_relaxed);
+		stats.messagesSent      = m_iMessagesSent.load(std::memory_order_relaxed);
+		stats.messagesConfirmed = m_iMessagesConfirmed.load(std::memory_order_relaxed);
+		stats.connections       = m_iConnections.load(std::memory_order_relaxed);
+		return stats;
+	}
+
+	MockServer::LatencyGenerator MockServer::UniformLatency(std::chrono::microseconds min,
+	                                                        std::chrono::microseconds max,
+	                                                        unsigned int seed) {
+		std::shared_ptr<std::mt19937> engine = std::make_shared<std::mt19937>(seed);
+		std::uniform_int_distribution<int64_t> distribution(min.count(), max.count());
+
+		return [engine, distribution]() mutable {
+			return std::chrono::microseconds(distribution(*engine));
+		};
+	}
+
+	Json::Value MockServer::GenerateEvents(const std::string& name, size_t count, size_t payloadSize) {
+		Json::Value events(Json::arrayValue);
+
+		Json::Value event(Json::arrayValue);
+		event.append(name);
+		event.append(Json::Value(Json::objectValue));
+		event[1u]["payload"] = std::string(payloadSize, 'x');
+
+		for (size_t i = 0; i < count; ++i) {
+			events.append(event);
+		}
+
+		return events;
+	}
+
+	MockServer::Session& MockServer::GetSession(const std::string& sessionKey) {
+		return m_oSessions[sessionKey];
+	}
+
+	std::chrono::microseconds MockServer::GetLatency(const LatencyGenerator& generator) {
+		return generator ? generator() : std::chrono::microseconds::zero();
+	}
+
+	void MockServer::Wakeup() {
+		if (m_aWakeupFds[1] != -1) {
+			char c = 0;
+			ssize_t written = write(m_aWakeupFds[1], &c, 1);
+			(void) written;
+		}
+	}
+
+	void MockServer::Run() {
+		std::vector<struct pollfd> fds;
+
+		while (m_bIsRunning) {
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			std::chrono::steady_clock::time_point next = std::chrono::steady_clock::time_point::max();
+
+			{
+				std::lock_guard<std::mutex> lock(m_oMutex);
+				if (m_oMessageGenerator) {
+					next = m_oNextGeneration;
+				}
+			}
+
+			fds.clear();
+
+			struct pollfd wakeupFd = {m_aWakeupFds[0], POLLIN, 0};
+			struct pollfd listenFd = {m_iListenFd, POLLIN, 0};
+			fds.push_back(wakeupFd);
+			fds.push_back(listenFd);
+
+			std::vector<Connection*>::iterator itr;
+			for (itr = m_oConnections.begin(); itr != m_oConnections.end(); ++itr) {
+				Connection *connection = *itr;
+				struct pollfd fd = {connection->fd, POLLIN, 0};
+
+				if (connection->state == Connection::WRITING) {
+					fd.events = POLLOUT;
+				} else if (connection->state == Connection::DELAYED ||
+				           connection->state == Connection::POLLING) {
+					next = std::min(next, connection->deadline);
+				}
+
+				fds.push_back(fd);
+			}
+
+			int timeout = -1;
+			if (next != std::chrono::steady_clock::time_point::max()) {
+				// Round up, to not wake up before the deadline
+				int64_t delay = std::chrono::duration_cast<std::chrono::microseconds>(next - now).count();
+				timeout = delay <= 0 ? 0 : static_cast<int>((delay + 999) / 1000);
+			}
+
+			if (poll(&fds[0], fds.size(), timeout) == -1 && errno != EINTR) {
+				break;
+			}
+
+			if (fds[0].revents & POLLIN) {
+				char drain[64];
+				while (read(m_aWakeupFds[0], drain, sizeof(drain)) > 0) {}
+			}
+
+			GenerateMessages();
+
+			std::set<std::string> queuedSessions;
+			{
+				std::lock_guard<std::mutex> lock(m_oMutex);
+				queuedSessions.swap(m_oQueuedSessions);
+			}
+
+			now = std::chrono::steady_clock::now();
+
+			// fds[i + 2] is the descriptor of m_oConnections[i], the streams
+			// opened meanwhile are appended after them
+			for (size_t i = 0; i < m_oConnections.size(); ++i) {
+				Connection *connection = m_oConnections[i];
+				short revents = (i + 2 < fds.size()) ? fds[i + 2].revents : 0;
+
+				if ((revents & (POLLIN | POLLHUP | POLLERR)) && !Read(connection)) {
+					connection->state = Connection::CLOSED;
+					continue;
+				}
+
+				if (connection->state == Connection::WRITING && (revents & POLLOUT) && !Write(connection)) {
+					connection->state = Connection::CLOSED;
+					continue;
+				}
+
+				if (connection->state == Connection::DELAYED && now >= connection->deadline) {
+					connection->state = Connection::WRITING;
+					if (!Write(connection)) {
+						connection->state = Connection::CLOSED;
+					}
+				} else if (connection->state == Connection::POLLING &&
+				           (now >= connection->deadline || queuedSessions.count(connection->sessionKey) > 0)) {
+					ServeMessages(connection, now >= connection->deadline);
+				}
+			}
+
+			if (fds[1].revents & POLLIN) {
+				Accept();
+			}
+
+			// The streams of a closed connection are closed with it
+			for (size_t i = 0; i < m_oConnections.size(); ++i) {
+				Connection *parent = m_oConnections[i]->parent;
+				if (parent != nullptr && parent->state == Connection::CLOSED) {
+					m_oConnections[i]->state  = Connection::CLOSED;
+					m_oConnections[i]->parent = nullptr;
+				}
+			}
+
+			// Drop the closed connections
+			size_t kept = 0;
+			for (size_t i = 0; i < m_oConnections.size(); ++i) {
+				Connection *connection = m_oConnections[i];
+				if (connection->state == Connection::CLOSED) {
+					if (connection->parent != nullptr) {
+						connection->parent->streams.erase(connection->streamId);
+					}
+					if (connection->fd != -1) {
+						close(connection->fd);
+					}
+					delete connection;
+				} else {
+					m_oConnections[kept++] = m_oConnections[i];
+				}
+			}
+			m_oConnections.resize(kept);
+		}
+	}
+
+	void MockServer::Accept() {
+		int fd;
+		while ((fd = accept(m_iListenFd, nullptr, nullptr)) != -1) {
+			if (!SetNonBlocking(fd)) {
+				close(fd);
+				continue;
+			}
+
+			if (!IsUnixSocket()) {
+				int noDelay = 1;
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+			}
+
+#if defined(SO_NOSIGPIPE)
+			int noSigPipe = 1;
+			setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof(noSigPipe));
+#endif
+
+			m_oConnections.push_back(new Connection(fd));
+			m_iConnections.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	bool MockServer::Read(Connection *connection) {
+		char buffer[16384];
+
+		while (true) {
+			ssize_t received = recv(connection->fd, buffer, sizeof(buffer), 0);
+
+			if (received > 0) {
+				connection->input.append(buffer, received);
+				if (connection->input.size() > MOCK_MAX_REQUEST_SIZE) {
+					return false;
+				}
+				continue;
+			}
+
+			if (received == 0) {
+				// Closed by the client
+				return false;
+			}
+
+			if (errno == EINTR) {
+				continue;
+			}
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+
+			return false;
+		}
+
+		// Requests sent while a response is pending are kept for later,
+		// except on HTTP/2 where the requests are concurrent
+		if (connection->state == Connection::READING || connection->http2 != nullptr) {
+			HandleRequest(connection);
+		}
+
+		return connection->state != Connection::CLOSED;
+	}
+
+	bool MockServer::Write(Connection *connection) {
+		if (connection->parent != nullptr) {
+			// The response of a stream goes to its connection, then the stream is over
+			Connection *parent = connection->parent;
+			parent->http2->SendResponse(connection->streamId, connection->status, connection->output,
+			                            connection->isGzipped ? "gzip" : "", &parent->output);
+			parent->streams.erase(connection->streamId);
+			connection->parent = nullptr;
+
+			SendOutput(parent);
+			return false;
+		}
+
+		while (connection->outputOffset < connection->output.size()) {
+			ssize_t sent = send(connection->fd,
+			                    connection->output.data() + connection->outputOffset,
+			                    connection->output.size() - connection->outputOffset,
+			                    MOCK_SEND_FLAGS);
+
+			if (sent > 0) {
+				connection->outputOffset += sent;
+				continue;
+			}
+
+			if (sent == -1 && errno == EINTR) {
+				continue;
+			}
+
+			if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				return true;
+			}
+
+			return false;
+		}
+
+		if (connection->closeAfterWrite) {
+			return false;
+		}
+
+		connection->output.clear();
+		connection->outputOffset = 0;
+		connection->state = Connection::READING;
+
+		// Handle a request which was already received
+		HandleRequest(connection);
+		return connection->state != Connection::CLOSED;
+	}
+
+	void MockServer::SendOutput(Connection *connection) {
+		if (connection->state != Connection::READING || connection->output.empty()) {
+			return;
+		}
+
+		connection->state = Connection::WRITING;
+		if (!Write(connection)) {
+			connection->state = Connection::CLOSED;
+		}
+	}
+
+	void MockServer::HandleRequest(Connection *connection) {
+		std::string& input = connection->input;
+
+		// HTTP/2 with prior knowledge, on the same port
+		if (connection->http2 == nullptr) {
+			const std::string& preface = Http2Session::GetPreface();
+			size_t size = std::min(input.size(), preface.size());
+			if (size > 0 && input.compare(0, size, preface, 0, size) == 0) {
+				if (size < preface.size()) {
+					return;
+				}
+				connection->http2 = new Http2Session();
+			}
+		}
+
+		if (connection->http2 != nullptr) {
+			HandleHttp2(connection);
+			return;
+		}
+
+		size_t headerEnd = input.find("\r\n\r\n");
+		if (headerEnd == std::string::npos) {
+			return;
+		}
+
+		std::istringstream headers(input.substr(0, headerEnd));
+		std::string method, target, version, line;
+		headers >> method >> target >> version;
+		std::getline(headers, line);
+
+		size_t contentLength = 0;
+		std::string sessionKey;
+		bool keepAlive = (version == "HTTP/1.1");
+		bool isGzipAccepted = false;
+		std::string contentEncoding;
+
+		while (std::getline(headers, line)) {
+			if (!line.empty() && line[line.size() - 1] == '\r') {
+				line.resize(line.size() - 1);
+			}
+
+			size_t separator = line.find(':');
+			if (separator == std::string::npos) {
+				continue;
+			}
+
+			size_t valueStart = line.find_first_not_of(' ', separator + 1);
+			std::string name  = line.substr(0, separator);
+			std::string value = (valueStart == std::string::npos) ? "" : line.substr(valueStart);
+
+			if (EqualsIgnoreCase(name, "Content-Length")) {
+				contentLength = strtoul(value.c_str(), nullptr, 10);
+			} else if (EqualsIgnoreCase(name, "X-MAGE-SESSION")) {
+				sessionKey = value;
+			} else if (EqualsIgnoreCase(name, "Connection")) {
+				keepAlive = !EqualsIgnoreCase(value, "close");
+			} else if (EqualsIgnoreCase(name, "Accept-Encoding")) {
+				isGzipAccepted = (value.find("gzip") != std::string::npos);
+			} else if (EqualsIgnoreCase(name, "Content-Encoding")) {
+				contentEncoding = value;
+			}
+		}
+
+		size_t bodyStart = headerEnd + 4;
+		if (input.size() < bodyStart + contentLength) {
+			return;
+		}
+
+		std::string body = input.substr(bodyStart, contentLength);
+		input.erase(0, bodyStart + contentLength);
+
+		connection->closeAfterWrite = !keepAlive;
+		connection->isGzipAccepted  = isGzipAccepted;
+
+		std::string path  = target;
+		std::string query;
+		size_t queryStart = target.find('?');
+		if (queryStart != std::string::npos) {
+			path  = target.substr(0, queryStart);
+			query = target.substr(queryStart + 1);
+		}
+
+		if (method == "POST" && path == "/" + m_sApplication + "/jsonrpc") {
+			HandleCommand(connection, body, contentEncoding, sessionKey);
+		} else if (method == "GET" && path == "/msgstream") {
+			HandleMsgStream(connection, query);
+		} else if (method == "HEAD") {
+			// Sent by RPC to open its connections ahead of the first requests
+			bool isKnown = (path == "/" + m_sApplication + "/jsonrpc" || path == "/msgstream");
+			SendResponse(connection, isKnown ? 200 : 404, "", std::chrono::microseconds::zero());
+		} else {
+			SendResponse(connection, 404, "Not Found", std::chrono::microseconds::zero());
+		}
+	}
+
+	void MockServer::HandleHttp2(Connection *connection) {
+		std::vector<Http2Request> requests;
+		std::vector<uint32_t> resetStreams;
+
+		if (!connection->http2->Receive(&connection->input, &connection->output, &requests, &resetStreams)) {
+			connection->state = Connection::CLOSED;
+			return;
+		}
+
+		for (size_t i = 0; i < resetStreams.size(); ++i) {
+			std::map<uint32_t, Connection*>::iterator itr = connection->streams.find(resetStreams[i]);
+			if (itr != connection->streams.end()) {
+				itr->second->state  = Connection::CLOSED;
+				itr->second->parent = nullptr;
+				connection->streams.erase(itr);
+			}
+		}
+
+		for (size_t i = 0; i < requests.size(); ++i) {
+			const Http2Request& request = requests[i];
+
+			Connection *stream = new Connection(-1);
+			stream->parent   = connection;
+			stream->streamId = request.streamId;
+			connection->streams[request.streamId] = stream;
+			m_oConnections.push_back(stream);
+
+			std::string sessionKey;
+			std::string contentEncoding;
+			for (size_t j = 0; j < request.headers.size(); ++j) {
+				if (request.headers[j].first == "x-mage-session") {
+					sessionKey = request.headers[j].second;
+				} else if (request.headers[j].first == "accept-encoding") {
+					stream->isGzipAccepted = (request.headers[j].second.find("gzip") != std::string::npos);
+				} else if (request.headers[j].first == "content-encoding") {
+					contentEncoding = request.headers[j].second;
+				}
+			}
+
+			std::string path = request.path;
+			std::string query;
+			size_t queryStart = path.find('?');
+			if (queryStart != std::string::npos) {
+				query = path.substr(queryStart + 1);
+				path.resize(queryStart);
+			}
+
+			if (request.method == "POST" && path == "/" + m_sApplication + "/jsonrpc") {
+				HandleCommand(stream, request.body, contentEncoding, sessionKey);
+			} else if (request.method == "GET" && path == "/msgstream") {
+				HandleMsgStream(stream, query);
+			} else if (request.method == "HEAD") {
+				bool isKnown = (path == "/" + m_sApplication + "/jsonrpc" || path == "/msgstream");
+				SendResponse(stream, isKnown ? 200 : 404, "", std::chrono::microseconds::zero());
+			} else {
+				SendResponse(stream, 404, "Not Found", std::chrono::microseconds::zero());
+			}
+		}
+
+		// Settings, pings and window updates
+		SendOutput(connection);
+	}
+
+	void MockServer::HandleCommand(Connection *connection, const std::string& body, const std::string& contentEncoding,
+	                               const std::string& sessionKey) {
+		std::string decoded;
+		int status = DecodeBody(body, contentEncoding, &decoded);
+		if (status != 200) {
+			SendResponse(connection, status, GetReasonPhrase(status), std::chrono::microseconds::zero());
+			return;
+		}
+
+		std::string response;
+		std::chrono::microseconds latency;
+
+		status = ExecuteCommand(decoded, sessionKey, &response, &latency);
+		SendResponse(connection, status, response, latency);
+	}
+
+	int MockServer::ExecuteCommand(const std::string& body, const std::string& sessionKey,
+	                               std::string *serializedResponse, std::chrono::microseconds *totalLatency) {
+		m_iCommands.fetch_add(1, std::memory_order_relaxed);
+
+		Json::Reader reader;
+		Json::Value request;
+		Json::Value response;
+		response["jsonrpc"] = "2.0";
+
+		if (!reader.parse(body, request, false) || !request.isObject() || !request["method"].isString()) {
+			response["id"] = Json::Value::null;
+			response["error"]["code"]    = -32700;
+			response["error"]["message"] = "Parse error";
+			*serializedResponse = Serialize(response);
+			*totalLatency = std::chrono::microseconds::zero();
+			return 200;
+		}
+
+		MockCommand command;
+		command.name = request["method"].asString();
+		command.params.swap(request["params"]);
+		command.sessionKey = sessionKey;
+
+		CommandHandler handler;
+		std::chrono::microseconds latency;
+		{
+			std::lock_guard<std::mutex> lock(m_oMutex);
+
+			std::map<std::string, CommandHandler>::const_iterator citr = m_oHandlers.find(command.name);
+			handler = (citr != m_oHandlers.end()) ? citr->second : m_oDefaultHandler;
+			latency = GetLatency(m_oCommandLatency);
+
+			// Broadcasted messages will be sent to this session too
+			if (!sessionKey.empty()) {
+				GetSession(sessionKey);
+			}
+		}
+
+		MockReply reply;
+		handler(command, &reply);
+
+		response["id"] = request["id"];
+
+		if (reply.rpcErrorCode != 0) {
+			response["error"]["code"]    = reply.rpcErrorCode;
+			response["error"]["message"] = reply.rpcErrorMessage;
+		} else {
+			Json::Value& result = response["result"];
+			result.swap(reply.result);
+
+			if (!reply.errorCode.empty()) {
+				result["errorCode"] = reply.errorCode;
+			}
+
+			// Each event is sent serialized, as MAGE does
+			if (reply.myEvents.isArray() && reply.myEvents.size() > 0) {
+				Json::Value& myEvents = result["myEvents"];
+				for (unsigned int i = 0; i < reply.myEvents.size(); ++i) {
+					myEvents.append(Serialize(reply.myEvents[i]));
+				}
+			}
+		}
+
+		*serializedResponse = Serialize(response);
+		*totalLatency = latency + reply.latency;
+		return reply.httpStatus;
+	}
+
+	void MockServer::HandleMsgStream(Connection *connection, const std::string& query) {
+		bool isLongPolling;
+		if (!OpenMsgStream(query, &connection->sessionKey, &isLongPolling)) {
+			SendResponse(connection, 400, "Bad Request", std::chrono::microseconds::zero());
+			return;
+		}
+
+		if (!isLongPolling) {
+			ServeMessages(connection, true);
+			return;
+		}
+
+		if (!ServeMessages(connection, false)) {
+			std::lock_guard<std::mutex> lock(m_oMutex);
+			connection->state    = Connection::POLLING;
+			connection->deadline = std::chrono::steady_clock::now() + m_oLongPollingTimeout;
+		}
+	}
+
+	bool MockServer::OpenMsgStream(const std::string& query, std::string *sessionKey, bool *isLongPolling) {
+		m_iMsgStreamRequests.fetch_add(1, std::memory_order_relaxed);
+
+		std::map<std::string, std::string> params = ParseQuery(query);
+		const std::string& transport = params["transport"];
+
+		*sessionKey    = params["sessionKey"];
+		*isLongPolling = (transport == "longpolling");
+
+		if (sessionKey->empty() || (transport != "longpolling" && transport != "shortpolling")) {
+			return false;
+		}
+
+		std::lock_guard<std::mutex> lock(m_oMutex);
+		Session& session = GetSession(*sessionKey);
+
+		// Forget the messages received by the client
+		std::set<uint64_t> confirmIds;
+		std::istringstream ids(params["confirmIds"]);
+		std::string id;
+		while (std::getline(ids, id, ',')) {
+			confirmIds.insert(strtoull(id.c_str(), nullptr, 10));
+		}
+
+		std::list<Message>::iterator itr = session.messages.begin();
+		while (itr != session.messages.end() && !confirmIds.empty()) {
+			if (confirmIds.erase(itr->id) > 0) {
+				itr = session.messages.erase(itr);
+				m_iMessagesConfirmed.fetch_add(1, std::memory_order_relaxed);
+			} else {
+				++itr;
+			}
+		}
+
+		return true;
+	}
+
+	bool MockServer::ServeMessages(Connection *connection, bool sendHeartbeat) {
+		std::string body;
+		std::chrono::microseconds latency;
+
+		{
+			std::lock_guard<std::mutex> lock(m_oMutex);
+			if (!TakeMessages(connection->sessionKey, sendHeartbeat, &body, &latency)) {
+				return false;
+			}
+		}
+
+		SendResponse(connection, 200, body, latency);
+		return true;
+	}
+
+	void MockServer::QueueMessage(const std::string& sessionKey, Session *session, const std::string& content) {
+		Message message = {session->nextMessageId++, content};
+		session->messages.push_back(message);
+		m_oQueuedSessions.insert(sessionKey);
+	}
+
+	bool MockServer::TakeMessages(const std::string& sessionKey, bool sendHeartbeat,
+	                              std::string *body, std::chrono::microseconds *latency) {
+		Session& session = GetSession(sessionKey);
+
+		if (session.messages.empty() && !sendHeartbeat) {
+			return false;
+		}
+
+		*latency = GetLatency(m_oMsgStreamLatency);
+
+		if (session.messages.empty()) {
+			*body = "HB";
+			m_iHeartbeats.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+
+		// Messages stay queued until they are confirmed
+		*body = "{";
+		std::list<Message>::const_iterator citr;
+		for (citr = session.messages.cbegin(); citr != session.messages.cend(); ++citr) {
+			if (body->size() > 1) {
+				*body += ",";
+			}
+			*body += "\"" + std::to_string(citr->id) + "\":" + citr->content;
+		}
+		*body += "}";
+		m_iMessagesSent.fetch_add(session.messages.size(), std::memory_order_relaxed);
+
+		return true;
+	}
+
+	void MockServer::Handle(const HttpRequest& request, LoopbackResponse *response) {
+		// Skip the protocol and the domain of the URL
+		size_t hostStart = request.url.find("://");
+		hostStart = (hostStart == std::string::npos) ? 0 : hostStart + 3;
+		size_t pathStart = request.url.find('/', hostStart);
+		std::string target = (pathStart == std::string::npos) ? "/" : request.url.substr(pathStart);
+
+		std::string path  = target;
+		std::string query;
+		size_t queryStart = target.find('?');
+		if (queryStart != std::string::npos) {
+			path  = target.substr(0, queryStart);
+			query = target.substr(queryStart + 1);
+		}
+
+		std::chrono::microseconds latency;
+
+		if (request.isHead) {
+			response->status = (path == "/" + m_sApplication + "/jsonrpc" || path == "/msgstream") ? 200 : 404;
+			return;
+		}
+
+		response->acceptEncoding = "gzip";
+
+		if (request.body != nullptr && path == "/" + m_sApplication + "/jsonrpc") {
+			std::string sessionKey;
+			std::string contentEncoding;
+			std::vector<std::string>::const_iterator citr;
+			for (citr = request.headers.cbegin(); citr != request.headers.cend(); ++citr) {
+				size_t separator = citr->find(':');
+				if (separator == std::string::npos) {
+					continue;
+				}
+
+				size_t valueStart = citr->find_first_not_of(' ', separator + 1);
+				std::string value = (valueStart == std::string::npos) ? "" : citr->substr(valueStart);
+				if (EqualsIgnoreCase(citr->substr(0, separator), "X-MAGE-SESSION")) {
+					sessionKey = value;
+				} else if (EqualsIgnoreCase(citr->substr(0, separator), "Content-Encoding")) {
+					contentEncoding = value;
+				}
+			}
+
+			std::string body;
+			response->status = DecodeBody(*request.body, contentEncoding, &body);
+			if (response->status != 200) {
+				response->body = GetReasonPhrase(response->status);
+				return;
+			}
+
+			response->status = ExecuteCommand(body, sessionKey, &response->body, &latency);
+			return;
+		}
+
+		std::string sessionKey;
+		bool isLongPolling;
+		if (request.body != nullptr || path != "/msgstream" || !OpenMsgStream(query, &sessionKey, &isLongPolling)) {
+			response->status = (path == "/msgstream") ? 400 : 404;
+			response->body   = (path == "/msgstream") ? "Bad Request" : "Not Found";
+			return;
+		}
+
+		std::unique_lock<std::mutex> lock(m_oMutex);
+
+		if (isLongPolling) {
+			std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + m_oLongPollingTimeout;
+			if (m_oMessageCondition.wait_until(lock, deadline, [&]() {
+				return TakeMessages(sessionKey, false, &response->body, &latency);
+			})) {
+				return;
+			}
+		}
+
+		TakeMessages(sessionKey, true, &response->body, &latency);
+	}
+
+	void MockServer::SendResponse(Connection *connection, int status, const std::string& body,
+	                              std::chrono::microseconds latency) {
+		size_t threshold = m_iCompressionThreshold.load(std::memory_order_relaxed);
+		std::string compressed;
+		connection->isGzipped = connection->isGzipAccepted && threshold > 0 && body.size() >= threshold &&
+		                        Gzip(body, &compressed);
+
+		const std::string& content = connection->isGzipped ? compressed : body;
+
+		if (connection->parent != nullptr) {
+			// Framed by the HTTP/2 session once sent
+			connection->status       = status;
+			connection->output       = content;
+			connection->outputOffset = 0;
+		} else {
+			FormatResponse(connection, status, content);
+		}
+
+		if (latency > std::chrono::microseconds::zero()) {
+			connection->state    = Connection::DELAYED;
+			connection->deadline = std::chrono::steady_clock::now() + latency;
+			return;
+		}
+
+		connection->state = Connection::WRITING;
+		if (!Write(connection)) {
+			connection->state = Connection::CLOSED;
+		}
+	}
+
+	void MockServer::FormatResponse(Connection *connection, int status, const std::string& body) {
+		std::ostringstream response;
+		response << "HTTP/1.1 " << status << " " << GetReasonPhrase(status) << "\r\n"
+		         << "Content-Type: application/json\r\n"
+		         << "Content-Length: " << body.size() << "\r\n"
+		         << "Accept-Encoding: gzip\r\n";
+
+		if (connection->isGzipped) {
+			response << "Content-Encoding: gzip\r\n";
+		}
+
+		if (connection->closeAfterWrite) {
+			response << "Connection: close\r\n";
+		}
+
+		response << "\r\n" << body;
+
+		connection->output       = response.str();
+		connection->outputOffset = 0;
+	}
+
+	void MockServer::GenerateMessages() {
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		std::lock_guard<std::mutex> lock(m_oMutex);
+
+		if (!m_oMessageGenerator || now < m_oNextGeneration) {
+			return;
+		}
+
+		std::map<std::string, Session>::iterator itr;
+		for (itr = m_oSessions.begin(); itr != m_oSessions.end(); ++itr) {
+			QueueMessage(itr->first, &itr->second, Serialize(m_oMessageGenerator(itr->first)));
+		}
+
+		m_oNextGeneration += m_oGeneratorInterval;
+		if (m_oNextGeneration < now) {
+			m_oNextGeneration = now + m_oGeneratorInterval;
+		}
+
+		m_oMessageCondition.notify_all();
+	}
+
+}  // namespace mage
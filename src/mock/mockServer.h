@@ -0,0 +1,212 @@
+#ifndef MAGEMOCK_SERVER_H
+#define MAGEMOCK_SERVER_H
+
+#include <string>
+#include <map>
+#include <set>
+#include <list>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include <jsonrpc/rpc.h>
+
+#include "loopbackTransport.h"
+
+namespace mage {
+
+	struct MockCommand {
+		std::string name;
+		Json::Value params;
+		// From the X-MAGE-SESSION header
+		std::string sessionKey;
+	};
+
+	struct MockReply {
+		MockReply() : rpcErrorCode(0), httpStatus(200), latency(0) {}
+
+		Json::Value result;
+		// Events ([name, data]) sent back in result.myEvents
+		Json::Value myEvents;
+		// Sent as result.errorCode, thrown as MageErrorMessage by the client
+		std::string errorCode;
+		// Sent as a JSON-RPC error when not 0
+		int rpcErrorCode;
+		std::string rpcErrorMessage;
+		int httpStatus;
+		// Added to the latency of the server
+		std::chrono::microseconds latency;
+	};
+
+	struct MockServerStats {
+		uint64_t commands;
+		uint64_t msgStreamRequests;
+		uint64_t heartbeats;
+		uint64_t messagesSent;
+		uint64_t messagesConfirmed;
+		uint64_t connections;
+	};
+
+	//
+	// Minimal MAGE server, running in its own thread, for the benchmarks
+	// and for trying the SDK without a real MAGE.
+	//
+	// It serves /<app>/jsonrpc and /msgstream (short and long polling,
+	// confirmIds and HB heartbeats) over HTTP/1.1 with keep-alive, or
+	// HTTP/2 with prior knowledge (h2c) on the same port, from a single
+	// poll() loop so that thousands of clients can be connected. Gzipped
+	// command bodies are accepted, as every response tells the clients
+	// (Accept-Encoding).
+	// Commands are answered by handlers, which echo the parameters by
+	// default, and messages are queued per session until confirmed.
+	//
+	// The same requests can be served in memory, without Start(), by
+	// giving Handle to a LoopbackTransport.
+	//
+	class MockServer {
+		public:
+			typedef std::function<void(const MockCommand& command, MockReply *reply)> CommandHandler;
+			typedef std::function<std::chrono::microseconds()> LatencyGenerator;
+			typedef std::function<Json::Value(const std::string& sessionKey)> MessageGenerator;
+
+			// With port 0, a free port is picked by the system. An address
+			// starting with a '/' is the path of a Unix domain socket to
+			// listen on instead, the port is then ignored.
+			explicit MockServer(const std::string& application = "game",
+			                    unsigned short port = 0,
+			                    const std::string& address = "127.0.0.1");
+			~MockServer();
+
+			void Start();
+			void Stop();
+
+			unsigned short GetPort() const;
+			// To be given to RPC::SetDomain
+			std::string GetDomain() const;
+			// To be given to RPC::SetProtocol: http, or http+unix
+			std::string GetProtocol() const;
+
+			void SetCommandHandler(const std::string& name, const CommandHandler& handler);
+			void SetDefaultHandler(const CommandHandler& handler);
+
+			void SetCommandLatency(const LatencyGenerator& generator);
+			void SetMsgStreamLatency(const LatencyGenerator& generator);
+			// Time after which a long polling request receives a heartbeat
+			void SetLongPollingTimeout(std::chrono::milliseconds timeout);
+			// Responses of at least this size are gzipped for the clients
+			// accepting it (0, the default, never compresses)
+			void SetCompressionThreshold(size_t size);
+
+			// Queues a message (a list of events) for a session, or for every
+			// known session when the session key is empty
+			void PushMessage(const std::string& sessionKey, const Json::Value& events);
+
+			// Pushes a generated message to every known session, at each interval
+			void SetMessageGenerator(std::chrono::milliseconds interval, const MessageGenerator& generator);
+
+			MockServerStats GetStats() const;
+
+			// Serves a request in the calling thread, for a LoopbackTransport:
+			//   mage::LoopbackTransport transport(std::bind(&mage::MockServer::Handle, &server, _1, _2));
+			// The latencies are not applied, and long polling requests block
+			// until a message is pushed or the long polling timeout. The
+			// message generator only runs once the server is started.
+			void Handle(const HttpRequest& request, LoopbackResponse *response);
+
+			// Deterministic latency, uniformly distributed between min and max
+			static LatencyGenerator UniformLatency(std::chrono::microseconds min,
+			                                       std::chrono::microseconds max,
+			                                       unsigned int seed = 0);
+			// count events named name, each carrying payloadSize bytes of data
+			static Json::Value GenerateEvents(const std::string& name, size_t count, size_t payloadSize);
+
+		private:
+			MockServer(const MockServer&);
+			MockServer& operator=(const MockServer&);
+
+			struct Message {
+				uint64_t id;
+				std::string content;
+			};
+
+			struct Session {
+				Session() : nextMessageId(1) {}
+
+				uint64_t nextMessageId;
+				std::list<Message> messages;
+			};
+
+			struct Connection;
+
+			void Run();
+			void Accept();
+			bool Read(Connection *connection);
+			bool Write(Connection *connection);
+			void SendOutput(Connection *connection);
+			void HandleRequest(Connection *connection);
+			void HandleHttp2(Connection *connection);
+			void HandleCommand(Connection *connection, const std::string& body, const std::string& contentEncoding,
+			                   const std::string& sessionKey);
+			void HandleMsgStream(Connection *connection, const std::string& query);
+			bool ServeMessages(Connection *connection, bool sendHeartbeat);
+			int ExecuteCommand(const std::string& body, const std::string& sessionKey,
+			                   std::string *response, std::chrono::microseconds *latency);
+			bool OpenMsgStream(const std::string& query, std::string *sessionKey, bool *isLongPolling);
+			// Must be called with m_oMutex held
+			void QueueMessage(const std::string& sessionKey, Session *session, const std::string& content);
+			bool TakeMessages(const std::string& sessionKey, bool sendHeartbeat,
+			                  std::string *body, std::chrono::microseconds *latency);
+			void SendResponse(Connection *connection, int status, const std::string& body,
+			                  std::chrono::microseconds latency);
+			void FormatResponse(Connection *connection, int status, const std::string& body);
+			void GenerateMessages();
+			void Wakeup();
+
+			bool IsUnixSocket() const;
+			Session& GetSession(const std::string& sessionKey);
+			std::chrono::microseconds GetLatency(const LatencyGenerator& generator);
+
+			std::string m_sApplication;
+			std::string m_sAddress;
+			unsigned short m_iPort;
+
+			int m_iListenFd;
+			int m_aWakeupFds[2];
+			std::thread *m_pThread;
+			std::atomic<bool> m_bIsRunning;
+
+			std::vector<Connection*> m_oConnections;
+
+			// Everything below can be changed while the server is running
+			mutable std::mutex m_oMutex;
+			// Notified when messages are queued, for the loopback long polling
+			std::condition_variable m_oMessageCondition;
+			std::map<std::string, CommandHandler> m_oHandlers;
+			CommandHandler m_oDefaultHandler;
+			LatencyGenerator m_oCommandLatency;
+			LatencyGenerator m_oMsgStreamLatency;
+			std::chrono::milliseconds m_oLongPollingTimeout;
+			std::atomic<size_t> m_iCompressionThreshold;
+			std::map<std::string, Session> m_oSessions;
+			// Sessions given messages since the last pass of the loop: only
+			// their long polling requests are served again before the timeout
+			std::set<std::string> m_oQueuedSessions;
+			MessageGenerator m_oMessageGenerator;
+			std::chrono::milliseconds m_oGeneratorInterval;
+			std::chrono::steady_clock::time_point m_oNextGeneration;
+
+			std::atomic<uint64_t> m_iCommands;
+			std::atomic<uint64_t> m_iMsgStreamRequests;
+			std::atomic<uint64_t> m_iHeartbeats;
+			std::atomic<uint64_t> m_iMessagesSent;
+			std::atomic<uint64_t> m_iMessagesConfirmed;
+			std::atomic<uint64_t> m_iConnections;
+	};
+
+}  // namespace mage
+#endif /* MAGEMOCK_SERVER_H */
@@ -0,0 +1,700 @@
+#include "networkEmulator.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <sstream>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+// Stop reading from a side once that much data is waiting to be delivered
+#define NETWORK_EMULATOR_MAX_QUEUED (1024 * 1024)
+#define NETWORK_EMULATOR_CHUNK_SIZE 16384
+
+#if defined(MSG_NOSIGNAL)
+	#define NETWORK_EMULATOR_SEND_FLAGS MSG_NOSIGNAL
+#else
+	#define NETWORK_EMULATOR_SEND_FLAGS 0
+#endif
+
+namespace mage {
+
+	struct Chunk {
+		std::chrono::steady_clock::time_point deliverAt;
+		std::string data;
+		// End of the stream, forwarded as a shutdown
+		bool isEnd;
+	};
+
+	struct NetworkEmulator::Pipe {
+		Pipe(int from, int to)
+		: from(from)
+		, to(to)
+		, queuedBytes(0)
+		, offset(0)
+		, isReadClosed(false)
+		, isWriteClosed(false) {}
+
+		int from;
+		int to;
+		std::deque<Chunk> chunks;
+		size_t queuedBytes;
+		// Bytes of the first chunk already sent
+		size_t offset;
+		// When the last chunk is done being sent, at the bandwidth
+		std::chrono::steady_clock::time_point busyUntil;
+		// Chunks are delivered in order, whatever their jitter
+		std::chrono::steady_clock::time_point lastDelivery;
+		bool isReadClosed;
+		bool isWriteClosed;
+	};
+
+	struct NetworkEmulator::Link {
+		Link(int clientFd, int serverFd)
+		: clientFd(clientFd)
+		, serverFd(serverFd)
+		, up(clientFd, serverFd)
+		, down(serverFd, clientFd)
+		, addressIndex(0)
+		, isConnecting(false)
+		, isClosed(false) {}
+
+		int clientFd;
+		int serverFd;
+		Pipe up;
+		Pipe down;
+		// Of the target address tried next
+		size_t addressIndex;
+		// Nothing is read from the client until the server is connected
+		bool isConnecting;
+		bool isClosed;
+	};
+
+	static bool SetNonBlocking(int fd) {
+		int flags = fcntl(fd, F_GETFL, 0);
+		return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+	}
+
+	static void SetNoDelay(int fd) {
+		int noDelay = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+#if defined(SO_NOSIGPIPE)
+		int noSigPipe = 1;
+		setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof(noSigPipe));
+#endif
+	}
+
+	// Closes with a RST instead of a FIN
+	static void CloseWithReset(int fd) {
+		struct linger linger;
+		linger.l_onoff  = 1;
+		linger.l_linger = 0;
+		setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+		close(fd);
+	}
+
+	static bool ParseDuration(const std::string& value, std::chrono::microseconds *duration) {
+		char *unit;
+		double amount = strtod(value.c_str(), &unit);
+
+		if (unit == value.c_str() || amount < 0) {
+			return false;
+		}
+
+		std::string suffix(unit);
+		if (suffix == "us") {
+			*duration = std::chrono::microseconds(static_cast<int64_t>(amount));
+		} else if (suffix == "ms" || suffix.empty()) {
+			*duration = std::chrono::microseconds(static_cast<int64_t>(amount * 1000));
+		} else if (suffix == "s") {
+			*duration = std::chrono::microseconds(static_cast<int64_t>(amount * 1000000));
+		} else {
+			return false;
+		}
+
+		return true;
+	}
+
+	static bool ParseRate(const std::string& value, double *rate) {
+		char *unit;
+		double amount = strtod(value.c_str(), &unit);
+
+		if (unit == value.c_str()) {
+			return false;
+		}
+
+		if (*unit == '%') {
+			amount /= 100;
+		} else if (*unit != '\0') {
+			return false;
+		}
+
+		*rate = amount;
+		return amount >= 0 && amount <= 1;
+	}
+
+	static bool ParseBandwidth(const std::string& value, uint64_t *bandwidth) {
+		char *unit;
+		double amount = strtod(value.c_str(), &unit);
+
+		if (unit == value.c_str() || amount < 0) {
+			return false;
+		}
+
+		switch (*unit) {
+			case '\0':
+				break;
+			case 'k':
+			case 'K':
+				amount *= 1024;
+				break;
+			case 'm':
+			case 'M':
+				amount *= 1024 * 1024;
+				break;
+			default:
+				return false;
+		}
+
+		*bandwidth = static_cast<uint64_t>(amount);
+		return true;
+	}
+
+	NetworkConditions::NetworkConditions()
+	: latency(0)
+	, jitter(0)
+	, bandwidth(0)
+	, lossRate(0)
+	, retransmissionDelay(std::chrono::milliseconds(200))
+	, failureRate(0)
+	, resetRate(0) {}
+
+	bool NetworkConditions::Parse(const std::string& description, NetworkConditions *conditions) {
+		std::istringstream stream(description);
+		std::string setting;
+
+		while (std::getline(stream, setting, ',')) {
+			if (setting.empty()) {
+				continue;
+			}
+
+			// One way values, roughly halving the usual round trips
+			if (setting == "edge") {
+				conditions->latency   = std::chrono::milliseconds(200);
+				conditions->jitter    = std::chrono::milliseconds(50);
+				conditions->bandwidth = 30 * 1024;
+				conditions->lossRate  = 0.01;
+				continue;
+			} else if (setting == "3g") {
+				conditions->latency   = std::chrono::milliseconds(100);
+				conditions->jitter    = std::chrono::milliseconds(30);
+				conditions->bandwidth = 200 * 1024;
+				conditions->lossRate  = 0.005;
+				continue;
+			} else if (setting == "4g") {
+				conditions->latency   = std::chrono::milliseconds(40);
+				conditions->jitter    = std::chrono::milliseconds(10);
+				conditions->bandwidth = 2 * 1024 * 1024;
+				continue;
+			} else if (setting == "wifi") {
+				conditions->latency   = std::chrono::milliseconds(10);
+				conditions->jitter    = std::chrono::milliseconds(5);
+				conditions->bandwidth = 5 * 1024 * 1024;
+				continue;
+			}
+
+			size_t separator = setting.find('=');
+			if (separator == std::string::npos) {
+				return false;
+			}
+
+			std::string name  = setting.substr(0, separator);
+			std::string value = setting.substr(separator + 1);
+			bool isValid;
+
+			if (name == "latency") {
+				isValid = ParseDuration(value, &conditions->latency);
+			} else if (name == "jitter") {
+				isValid = ParseDuration(value, &conditions->jitter);
+			} else if (name == "bandwidth") {
+				isValid = ParseBandwidth(value, &conditions->bandwidth);
+			} else if (name == "loss") {
+				isValid = ParseRate(value, &conditions->lossRate);
+			} else if (name == "retransmission") {
+				isValid = ParseDuration(value, &conditions->retransmissionDelay);
+			} else if (name == "failure") {
+				isValid = ParseRate(value, &conditions->failureRate);
+			} else if (name == "reset") {
+				isValid = ParseRate(value, &conditions->resetRate);
+			} else {
+				isValid = false;
+			}
+
+			if (!isValid) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	NetworkEmulator::NetworkEmulator(const std::string& target,
+	                                 unsigned short port,
+	                                 const std::string& address)
+	: m_sTarget(target)
+	, m_sAddress(address)
+	, m_iPort(port)
+	, m_iListenFd(-1)
+	, m_pThread(nullptr)
+	, m_bIsRunning(false)
+	, m_iConnections(0)
+	, m_iFailures(0)
+	, m_iResets(0)
+	, m_iLosses(0)
+	, m_iBytesForwarded(0) {
+		m_aWakeupFds[0] = -1;
+		m_aWakeupFds[1] = -1;
+	}
+
+	NetworkEmulator::~NetworkEmulator() {
+		Stop();
+	}
+
+	void NetworkEmulator::Start() {
+		if (m_pThread != nullptr) {
+			return;
+		}
+
+		size_t separator = m_sTarget.rfind(':');
+		std::string host = m_sTarget.substr(0, separator);
+		std::string port = (separator == std::string::npos) ? "80" : m_sTarget.substr(separator + 1);
+
+		struct addrinfo hints;
+		struct addrinfo *addresses = nullptr;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family   = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+
+		int error = getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses);
+		if (error != 0) {
+			throw std::runtime_error("Unable to resolve " + m_sTarget + ": " + gai_strerror(error));
+		}
+
+		m_oTargetAddresses.clear();
+		for (struct addrinfo *address = addresses; address != nullptr; address = address->ai_next) {
+			m_oTargetAddresses.push_back(std::string(reinterpret_cast<char*>(address->ai_addr), address->ai_addrlen));
+		}
+		freeaddrinfo(addresses);
+
+		m_iListenFd = socket(AF_INET, SOCK_STREAM, 0);
+		if (m_iListenFd == -1) {
+			throw std::system_error(errno, std::generic_category(), "Unable to create the emulator socket");
+		}
+
+		int reuse = 1;
+		setsockopt(m_iListenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port   = htons(m_iPort);
+
+		if (inet_pton(AF_INET, m_sAddress.c_str(), &addr.sin_addr) != 1 ||
+		    bind(m_iListenFd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == -1 ||
+		    listen(m_iListenFd, SOMAXCONN) == -1 ||
+		    !SetNonBlocking(m_iListenFd) ||
+		    pipe(m_aWakeupFds) == -1) {
+			int error = errno;
+			close(m_iListenFd);
+			m_iListenFd = -1;
+			throw std::system_error(error, std::generic_category(), "Unable to start the network emulator");
+		}
+
+		SetNonBlocking(m_aWakeupFds[0]);
+		SetNonBlocking(m_aWakeupFds[1]);
+
+		socklen_t length = sizeof(addr);
+		getsockname(m_iListenFd, reinterpret_cast<struct sockaddr*>(&addr), &length);
+		m_iPort = ntohs(addr.sin_port);
+
+		m_bIsRunning = true;
+		m_pThread = new std::thread(&NetworkEmulator::Run, this);
+	}
+
+	void NetworkEmulator::Stop() {
+		if (m_pThread == nullptr) {
+			return;
+		}
+
+		m_bIsRunning = false;
+		char c = 0;
+		ssize_t written = write(m_aWakeupFds[1], &c, 1);
+		(void) written;
+
+		m_pThread->join();
+		delete m_pThread;
+		m_pThread = nullptr;
+
+		std::vector<Link*>::iterator itr;
+		for (itr = m_oLinks.begin(); itr != m_oLinks.end(); ++itr) {
+			if (!(*itr)->isClosed) {
+				close((*itr)->clientFd);
+				close((*itr)->serverFd);
+			}
+			delete *itr;
+		}
+		m_oLinks.clear();
+
+		close(m_iListenFd);
+		close(m_aWakeupFds[0]);
+		close(m_aWakeupFds[1]);
+		m_iListenFd = -1;
+		m_aWakeupFds[0] = -1;
+		m_aWakeupFds[1] = -1;
+	}
+
+	unsigned short NetworkEmulator::GetPort() const {
+		return m_iPort;
+	}
+
+	std::string NetworkEmulator::GetDomain() const {
+		return m_sAddress + ":" + std::to_string(m_iPort);
+	}
+
+	void NetworkEmulator::SetConditions(const NetworkConditions& conditions) {
+		std::lock_guard<std::mutex> lock(m_oMutex);
+		m_oConditions = conditions;
+	}
+
+	NetworkEmulatorStats NetworkEmulator::GetStats() const {
+		NetworkEmulatorStats stats;
+		stats.connections    = m_iConnections.load(std::memory_order_relaxed);
+		stats.failures       = m_iFailures.load(std::memory_order_relaxed);
+		stats.resets         = m_iResets.load(std::memory_order_relaxed);
+		stats.losses         = m_iLosses.load(std::memory_order_relaxed);
+		stats.bytesForwarded = m_iBytesForwarded.load(std::memory_order_relaxed);
+		return stats;
+	}
+
+	double NetworkEmulator::Draw() {
+		return std::uniform_real_distribution<double>(0, 1)(m_oEngine);
+	}
+
+	void NetworkEmulator::Run() {
+		std::vector<struct pollfd> fds;
+
+		while (m_bIsRunning) {
+			NetworkConditions conditions;
+			{
+				std::lock_guard<std::mutex> lock(m_oMutex);
+				conditions = m_oConditions;
+			}
+
+			std::chrono::steady_clock::time_point now  = std::chrono::steady_clock::now();
+			std::chrono::steady_clock::time_point next = std::chrono::steady_clock::time_point::max();
+
+			fds.clear();
+
+			struct pollfd wakeupFd = {m_aWakeupFds[0], POLLIN, 0};
+			struct pollfd listenFd = {m_iListenFd, POLLIN, 0};
+			fds.push_back(wakeupFd);
+			fds.push_back(listenFd);
+
+			// fds[2 + 2i] is the client of m_oLinks[i], fds[3 + 2i] its server
+			for (size_t i = 0; i < m_oLinks.size(); ++i) {
+				Link *link = m_oLinks[i];
+				struct pollfd clientFd = {link->clientFd, 0, 0};
+				struct pollfd serverFd = {link->serverFd, 0, 0};
+
+				Pipe *pipes[2] = {&link->up, &link->down};
+				struct pollfd *fromFds[2] = {&clientFd, &serverFd};
+				struct pollfd *toFds[2] = {&serverFd, &clientFd};
+
+				if (link->isConnecting) {
+					serverFd.events = POLLOUT;
+				}
+
+				for (int j = 0; j < 2 && !link->isConnecting; ++j) {
+					Pipe *pipe = pipes[j];
+
+					if (!pipe->isReadClosed && pipe->queuedBytes < NETWORK_EMULATOR_MAX_QUEUED) {
+						fromFds[j]->events |= POLLIN;
+					}
+
+					if (!pipe->chunks.empty()) {
+						if (pipe->chunks.front().deliverAt <= now) {
+							// Only when the previous send would have blocked
+							toFds[j]->events |= POLLOUT;
+						} else {
+							next = std::min(next, pipe->chunks.front().deliverAt);
+						}
+					}
+				}
+
+				fds.push_back(clientFd);
+				fds.push_back(serverFd);
+			}
+
+			int timeout = -1;
+			if (next != std::chrono::steady_clock::time_point::max()) {
+				int64_t delay = std::chrono::duration_cast<std::chrono::microseconds>(next - now).count();
+				timeout = delay <= 0 ? 0 : static_cast<int>((delay + 999) / 1000);
+			}
+
+			if (poll(&fds[0], fds.size(), timeout) == -1 && errno != EINTR) {
+				break;
+			}
+
+			if (fds[0].revents & POLLIN) {
+				char drain[64];
+				while (read(m_aWakeupFds[0], drain, sizeof(drain)) > 0) {}
+			}
+
+			for (size_t i = 0; i < m_oLinks.size(); ++i) {
+				Link *link = m_oLinks[i];
+				short clientEvents = fds[2 + 2 * i].revents;
+				short serverEvents = fds[3 + 2 * i].revents;
+
+				if (link->isConnecting) {
+					if (serverEvents & (POLLOUT | POLLHUP | POLLERR)) {
+						FinishConnect(link);
+					}
+					continue;
+				}
+
+				if ((clientEvents & (POLLIN | POLLHUP | POLLERR)) && !link->up.isReadClosed &&
+				    !Receive(link, &link->up, conditions)) {
+					continue;
+				}
+
+				if ((serverEvents & (POLLIN | POLLHUP | POLLERR)) && !link->down.isReadClosed &&
+				    !Receive(link, &link->down, conditions)) {
+					continue;
+				}
+
+				now = std::chrono::steady_clock::now();
+				if (!Deliver(&link->up, now) || !Deliver(&link->down, now)) {
+					Reset(link);
+					continue;
+				}
+
+				// Both sides are done
+				if (link->up.isWriteClosed && link->down.isWriteClosed) {
+					close(link->clientFd);
+					close(link->serverFd);
+					link->isClosed = true;
+				}
+			}
+
+			if (fds[1].revents & POLLIN) {
+				Accept();
+			}
+
+			size_t kept = 0;
+			for (size_t i = 0; i < m_oLinks.size(); ++i) {
+				if (m_oLinks[i]->isClosed) {
+					delete m_oLinks[i];
+				} else {
+					m_oLinks[kept++] = m_oLinks[i];
+				}
+			}
+			m_oLinks.resize(kept);
+		}
+	}
+
+	void NetworkEmulator::Accept() {
+		double failureRate;
+		{
+			std::lock_guard<std::mutex> lock(m_oMutex);
+			failureRate = m_oConditions.failureRate;
+		}
+
+		int clientFd;
+		while ((clientFd = accept(m_iListenFd, nullptr, nullptr)) != -1) {
+			m_iConnections.fetch_add(1, std::memory_order_relaxed);
+
+			if (failureRate > 0 && Draw() < failureRate) {
+				m_iFailures.fetch_add(1, std::memory_order_relaxed);
+				CloseWithReset(clientFd);
+				continue;
+			}
+
+			SetNonBlocking(clientFd);
+			SetNoDelay(clientFd);
+
+			Link *link = new Link(clientFd, -1);
+			if (!Connect(link)) {
+				m_iFailures.fetch_add(1, std::memory_order_relaxed);
+				CloseWithReset(clientFd);
+				delete link;
+				continue;
+			}
+
+			m_oLinks.push_back(link);
+		}
+	}
+
+	bool NetworkEmulator::Connect(Link *link) {
+		for (; link->addressIndex < m_oTargetAddresses.size(); ++link->addressIndex) {
+			const std::string& address = m_oTargetAddresses[link->addressIndex];
+			const struct sockaddr *addr = reinterpret_cast<const struct sockaddr*>(address.data());
+
+			int serverFd = socket(addr->sa_family, SOCK_STREAM, 0);
+			if (serverFd == -1) {
+				continue;
+			}
+
+			SetNonBlocking(serverFd);
+			SetNoDelay(serverFd);
+
+			// Usually in progress: the loop polls for its outcome
+			bool isConnected = (connect(serverFd, addr, address.size()) == 0);
+			if (!isConnected && errno != EINPROGRESS) {
+				close(serverFd);
+				continue;
+			}
+
+			link->serverFd     = serverFd;
+			link->up.to        = serverFd;
+			link->down.from    = serverFd;
+			link->isConnecting = !isConnected;
+			return true;
+		}
+
+		return false;
+	}
+
+	void NetworkEmulator::FinishConnect(Link *link) {
+		int error = 0;
+		socklen_t length = sizeof(error);
+		if (getsockopt(link->serverFd, SOL_SOCKET, SO_ERROR, &error, &length) == -1) {
+			error = errno;
+		}
+
+		if (error == 0) {
+			link->isConnecting = false;
+			return;
+		}
+
+		close(link->serverFd);
+		++link->addressIndex;
+
+		if (!Connect(link)) {
+			m_iFailures.fetch_add(1, std::memory_order_relaxed);
+			CloseWithReset(link->clientFd);
+			link->isClosed = true;
+		}
+	}
+
+	bool NetworkEmulator::Receive(Link *link, Pipe *pipe, const NetworkConditions& conditions) {
+		char buffer[NETWORK_EMULATOR_CHUNK_SIZE];
+		ssize_t received = recv(pipe->from, buffer, sizeof(buffer), 0);
+
+		if (received == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				return true;
+			}
+
+			Reset(link);
+			return false;
+		}
+
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		Chunk chunk;
+		chunk.isEnd = (received == 0);
+
+		if (!chunk.isEnd && conditions.resetRate > 0 && Draw() < conditions.resetRate) {
+			Reset(link);
+			return false;
+		}
+
+		// Time to send the chunk at the bandwidth, after the previous ones
+		std::chrono::steady_clock::time_point departure = std::max(now, pipe->busyUntil);
+		if (conditions.bandwidth > 0 && received > 0) {
+			departure += std::chrono::microseconds(received * 1000000 / conditions.bandwidth);
+		}
+		pipe->busyUntil = departure;
+
+		std::chrono::microseconds delay = conditions.latency;
+		if (conditions.jitter.count() > 0) {
+			delay += std::chrono::microseconds(static_cast<int64_t>((Draw() * 2 - 1) * conditions.jitter.count()));
+			delay = std::max(delay, std::chrono::microseconds::zero());
+		}
+
+		if (!chunk.isEnd && conditions.lossRate > 0 && Draw() < conditions.lossRate) {
+			m_iLosses.fetch_add(1, std::memory_order_relaxed);
+			delay += conditions.retransmissionDelay;
+		}
+
+		chunk.deliverAt = std::max(departure + delay, pipe->lastDelivery);
+		chunk.data.assign(buffer, received);
+		pipe->lastDelivery = chunk.deliverAt;
+		pipe->queuedBytes += received;
+		pipe->chunks.push_back(chunk);
+
+		if (chunk.isEnd) {
+			pipe->isReadClosed = true;
+		}
+
+		return true;
+	}
+
+	bool NetworkEmulator::Deliver(Pipe *pipe, const std::chrono::steady_clock::time_point& now) {
+		while (!pipe->chunks.empty() && pipe->chunks.front().deliverAt <= now) {
+			Chunk& chunk = pipe->chunks.front();
+
+			if (chunk.isEnd) {
+				shutdown(pipe->to, SHUT_WR);
+				pipe->isWriteClosed = true;
+				pipe->chunks.pop_front();
+				continue;
+			}
+
+			ssize_t sent = send(pipe->to, chunk.data.data() + pipe->offset, chunk.data.size() - pipe->offset,
+			                    NETWORK_EMULATOR_SEND_FLAGS);
+
+			if (sent == -1) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+					return true;
+				}
+				return false;
+			}
+
+			pipe->offset += sent;
+			m_iBytesForwarded.fetch_add(sent, std::memory_order_relaxed);
+
+			if (pipe->offset == chunk.data.size()) {
+				pipe->queuedBytes -= chunk.data.size();
+				pipe->offset = 0;
+				pipe->chunks.pop_front();
+			}
+		}
+
+		return true;
+	}
+
+	void NetworkEmulator::Reset(Link *link) {
+		if (link->isClosed) {
+			return;
+		}
+
+		m_iResets.fetch_add(1, std::memory_order_relaxed);
+		CloseWithReset(link->clientFd);
+		CloseWithReset(link->serverFd);
+		link->isClosed = true;
+	}
+
+}  // namespace mage
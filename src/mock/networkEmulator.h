@@ -0,0 +1,120 @@
+#ifndef MAGENETWORK_EMULATOR_H
+#define MAGENETWORK_EMULATOR_H
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <cstdint>
+
+namespace mage {
+
+	//
+	// Conditions applied to each direction of each connection
+	//
+	struct NetworkConditions {
+		NetworkConditions();
+
+		// One way, added to every chunk of data
+		std::chrono::microseconds latency;
+		// Uniformly distributed between -jitter and +jitter
+		std::chrono::microseconds jitter;
+		// In bytes per second, 0 for unlimited
+		uint64_t bandwidth;
+		// Probability for a chunk to be lost, and delivered again after
+		// the retransmission delay (as TCP would do)
+		double lossRate;
+		std::chrono::microseconds retransmissionDelay;
+		// Probability for a new connection to be closed right away
+		double failureRate;
+		// Probability for each chunk to reset the connection instead
+		double resetRate;
+
+		// Comma separated preset (edge, 3g, 4g, wifi) and/or settings:
+		//   latency=100ms,jitter=20ms,bandwidth=256k,loss=1%,failure=0.5%,reset=0.1%
+		static bool Parse(const std::string& description, NetworkConditions *conditions);
+	};
+
+	struct NetworkEmulatorStats {
+		uint64_t connections;
+		uint64_t failures;
+		uint64_t resets;
+		uint64_t losses;
+		uint64_t bytesForwarded;
+	};
+
+	//
+	// TCP proxy degrading the network between the SDK and a server, to
+	// measure the polling, batching and timeout strategies locally.
+	//
+	// Give GetDomain() to RPC::SetDomain (or magebench) instead of the
+	// domain of the server. Like MockServer, it runs a single poll()
+	// loop in its own thread.
+	//
+	class NetworkEmulator {
+		public:
+			// The target is host:port
+			explicit NetworkEmulator(const std::string& target,
+			                         unsigned short port = 0,
+			                         const std::string& address = "127.0.0.1");
+			~NetworkEmulator();
+
+			void Start();
+			void Stop();
+
+			unsigned short GetPort() const;
+			std::string GetDomain() const;
+
+			// Applies to the data received from now on
+			void SetConditions(const NetworkConditions& conditions);
+			NetworkEmulatorStats GetStats() const;
+
+		private:
+			NetworkEmulator(const NetworkEmulator&);
+			NetworkEmulator& operator=(const NetworkEmulator&);
+
+			struct Pipe;
+			struct Link;
+
+			void Run();
+			void Accept();
+			// Starts connecting the link to the addresses of the target,
+			// from its next one: false once none is left
+			bool Connect(Link *link);
+			void FinishConnect(Link *link);
+			bool Receive(Link *link, Pipe *pipe, const NetworkConditions& conditions);
+			bool Deliver(Pipe *pipe, const std::chrono::steady_clock::time_point& now);
+			void Reset(Link *link);
+
+			double Draw();
+
+			std::string m_sTarget;
+			// The struct sockaddr of each address of the target, resolved
+			// by Start so that the poll() loop never blocks on a lookup
+			std::vector<std::string> m_oTargetAddresses;
+			std::string m_sAddress;
+			unsigned short m_iPort;
+
+			int m_iListenFd;
+			int m_aWakeupFds[2];
+			std::thread *m_pThread;
+			std::atomic<bool> m_bIsRunning;
+
+			std::vector<Link*> m_oLinks;
+			std::mt19937 m_oEngine;
+
+			mutable std::mutex m_oMutex;
+			NetworkConditions m_oConditions;
+
+			std::atomic<uint64_t> m_iConnections;
+			std::atomic<uint64_t> m_iFailures;
+			std::atomic<uint64_t> m_iResets;
+			std::atomic<uint64_t> m_iLosses;
+			std::atomic<uint64_t> m_iBytesForwarded;
+	};
+
+}  // namespace mage
+#endif /* MAGENETWORK_EMULATOR_H */
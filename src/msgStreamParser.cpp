@@ -0,0 +1,213 @@
+#include "msgStreamParser.h"
+#include "metrics.h"
+#include "bufferPool.h"
+
+#ifndef MSGSTREAM_MAX_MESSAGE_SIZE
+	#define MSGSTREAM_MAX_MESSAGE_SIZE (8 * 1024 * 1024)
+#endif
+
+// Anything else than a JSON object should be a heartbeat ("HB")
+#define MSGSTREAM_MAX_RAW_CONTENT_SIZE 16
+
+namespace mage {
+
+	static inline bool IsWhitespace(char c) {
+		return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+	}
+
+	MsgStreamParser::MsgStreamParser(const MessageHandler& handler,
+	                                 std::string *buffer)
+	: m_oHandler(handler)
+	, m_pPending(buffer != nullptr ? buffer : &m_sBuffer) {
+		Reset();
+	}
+
+	void MsgStreamParser::Reserve(size_t size) {
+		// Only a hint: the size of the whole response, while a single
+		// message is pending at a time. Kept under half the high-water
+		// mark, as reserve may double the capacity, so that the pooled
+		// buffer is not freed once released.
+		if (size + 1 > BUFFER_POOL_HIGH_WATER_MARK / 2) {
+			size = BUFFER_POOL_HIGH_WATER_MARK / 2 - 1;
+		}
+
+		// One more byte for the closing bracket
+		if (size + 1 > m_pPending->capacity()) {
+			m_pPending->reserve(size + 1);
+		}
+	}
+
+	void MsgStreamParser::Reset() {
+		m_iState       = WAITING_DOCUMENT;
+		m_iDepth       = 0;
+		m_bInString    = false;
+		m_bEscaped     = false;
+		m_bIsHeartbeat = false;
+		m_iParseTime   = 0;
+		m_pPending->clear();
+	}
+
+	bool MsgStreamParser::IsHeartbeat() const {
+		return m_bIsHeartbeat;
+	}
+
+	uint64_t MsgStreamParser::GetParseTime() const {
+		return m_iParseTime;
+	}
+
+	const std::chrono::steady_clock::time_point& MsgStreamParser::GetChunkTime() const {
+		return m_oChunkTime;
+	}
+
+	void MsgStreamParser::Feed(const char *data, size_t length) {
+		m_oChunkTime = std::chrono::steady_clock::now();
+
+		// Start of the bytes which still need to be appended
+		// to the pending message
+		size_t start = 0;
+
+		for (size_t i = 0; i < length; ++i) {
+			const char c = data[i];
+
+			switch (m_iState) {
+				case WAITING_DOCUMENT:
+					if (IsWhitespace(c)) {
+						break;
+					}
+
+					if (c == '{') {
+						m_iState = IN_DOCUMENT;
+						m_iDepth = 1;
+						m_pPending->assign(1, '{');
+						start = i + 1;
+					} else {
+						m_iState = IN_RAW_CONTENT;
+						start = i;
+					}
+					break;
+				case IN_RAW_CONTENT:
+					break;
+				case DOCUMENT_DONE:
+					if (!IsWhitespace(c)) {
+						throw MageClientError("Unable to parse the received content from "
+						                      "the message stream.");
+					}
+					break;
+				case IN_DOCUMENT:
+					if (m_bInString) {
+						if (m_bEscaped) {
+							m_bEscaped = false;
+						} else if (c == '\\') {
+							m_bEscaped = true;
+						} else if (c == '"') {
+							m_bInString = false;
+						}
+						break;
+					}
+
+					switch (c) {
+						case '"':
+							m_bInString = true;
+							break;
+						case '{':
+						case '[':
+							++m_iDepth;
+							break;
+						case '}':
+						case ']':
+							if (--m_iDepth > 0) {
+								break;
+							}
+
+							if (c != '}') {
+								throw MageClientError("Unable to parse the received content from "
+								                      "the message stream.");
+							}
+
+							// End of the document, flush the last message
+							Append(data + start, i - start);
+							EmitMessage();
+							m_iState = DOCUMENT_DONE;
+							break;
+						case ',':
+							// End of a message
+							if (m_iDepth == 1) {
+								Append(data + start, i - start);
+								EmitMessage();
+								start = i + 1;
+							}
+							break;
+						default:
+							break;
+					}
+					break;
+			}
+		}
+
+		if (m_iState == IN_DOCUMENT || m_iState == IN_RAW_CONTENT) {
+			Append(data + start, length - start);
+		}
+	}
+
+	void MsgStreamParser::Finish() {
+		switch (m_iState) {
+			case WAITING_DOCUMENT:
+				// No messages to read
+				break;
+			case DOCUMENT_DONE:
+				break;
+			case IN_RAW_CONTENT:
+				// Heartbeat sent by MAGE
+				if (*m_pPending == "HB") {
+					m_bIsHeartbeat = true;
+					break;
+				}
+
+				throw MageClientError("Unable to parse the received content from "
+				                      "the message stream.");
+			case IN_DOCUMENT:
+				throw MageClientError("The content received from the message "
+				                      "stream is incomplete.");
+		}
+	}
+
+	void MsgStreamParser::Append(const char *data, size_t length) {
+		size_t maxSize = (m_iState == IN_RAW_CONTENT) ? MSGSTREAM_MAX_RAW_CONTENT_SIZE
+		                                              : MSGSTREAM_MAX_MESSAGE_SIZE;
+
+		if (m_pPending->size() + length > maxSize) {
+			throw MageClientError("A message received from the message stream "
+			                      "exceeds the maximum allowed size.");
+		}
+
+		m_pPending->append(data, length);
+	}
+
+	void MsgStreamParser::EmitMessage() {
+		Json::Value messages;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+		m_pPending->push_back('}');
+		if (!m_oReader.parse(*m_pPending, messages, false)) {
+			throw MageClientError("Unable to parse the received content from "
+			                      "the message stream.");
+		}
+
+		m_iParseTime += MicrosecondsSince(start);
+
+		// Keep the capacity for the next message
+		m_pPending->assign(1, '{');
+
+		// Walk the members in place instead of copying their names
+		// and looking them up again
+		std::string msgId;
+		Json::Value::const_iterator citr;
+		for (citr = messages.begin();
+		    citr != messages.end();
+		    ++citr) {
+			msgId.assign(citr.memberName());
+			m_oHandler(msgId, *citr);
+		}
+	}
+
+}  // namespace mage
@@ -0,0 +1,79 @@
+#ifndef MAGEMSGSTREAM_PARSER_H
+#define MAGEMSGSTREAM_PARSER_H
+
+#include <string>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+
+#include <jsonrpc/rpc.h>
+
+#include "exceptions.h"
+
+namespace mage {
+
+	//
+	// Push parser for the message stream responses.
+	//
+	// The body sent by MAGE is an object where each member is a message id
+	// associated to a list of events:
+	//
+	//   {"1":[["name",{...}]],"2":[["other"]]}
+	//
+	// Chunks are fed as they come from the network, and each message is
+	// handed to the handler as soon as its closing bracket is received.
+	// Only the message currently being received is buffered. The buffer
+	// can be provided by the caller so that it can be reused between
+	// responses.
+	//
+	class MsgStreamParser {
+		public:
+			typedef std::function<void(const std::string& msgId,
+			                           const Json::Value& events)> MessageHandler;
+
+			explicit MsgStreamParser(const MessageHandler& handler,
+			                         std::string *buffer = nullptr);
+
+			// Hint of the size of the response, the pending buffer still
+			// grows with a larger message
+			void Reserve(size_t size);
+			void Feed(const char *data, size_t length);
+			void Finish();
+			void Reset();
+
+			bool IsHeartbeat() const;
+
+			// Time spent parsing messages since the last reset, in microseconds
+			uint64_t GetParseTime() const;
+			// When the last chunk was fed
+			const std::chrono::steady_clock::time_point& GetChunkTime() const;
+
+		private:
+			enum State {
+				WAITING_DOCUMENT = 0,
+				IN_DOCUMENT,
+				IN_RAW_CONTENT,
+				DOCUMENT_DONE
+			};
+
+			void Append(const char *data, size_t length);
+			void EmitMessage();
+
+			MessageHandler m_oHandler;
+			Json::Reader   m_oReader;
+
+			State  m_iState;
+			int    m_iDepth;
+			bool   m_bInString;
+			bool   m_bEscaped;
+			bool   m_bIsHeartbeat;
+
+			uint64_t m_iParseTime;
+			std::chrono::steady_clock::time_point m_oChunkTime;
+
+			std::string  m_sBuffer;
+			std::string *m_pPending;
+	};
+
+}  // namespace mage
+#endif /* MAGEMSGSTREAM_PARSER_H */
@@ -0,0 +1,70 @@
+#include "requestTiming.h"
+
+#include <curl/curl.h>
+
+namespace mage {
+
+	RequestTiming::RequestTiming()
+	: kind(COMMAND_REQUEST)
+	, httpStatus(0)
+	, newConnections(0)
+	, nameLookupTime(0)
+	, connectTime(0)
+	, tlsTime(0)
+	, waitTime(0)
+	, transferTime(0)
+	, totalTime(0)
+	, bytesUploaded(0)
+	, bytesDownloaded(0)
+	, bytesDecoded(0) {
+	}
+
+	static uint64_t ToMicroseconds(double seconds) {
+		return seconds > 0 ? static_cast<uint64_t>(seconds * 1000000.0) : 0;
+	}
+
+	static uint64_t GetPhase(double from, double to) {
+		return to > from ? ToMicroseconds(to - from) : 0;
+	}
+
+	void ReadRequestTiming(void *curlHandle, RequestTiming *timing) {
+		CURL *c = static_cast<CURL*>(curlHandle);
+
+		// Those times are all counted from the start of the request
+		double nameLookup = 0, connect = 0, appConnect = 0;
+		double preTransfer = 0, startTransfer = 0, total = 0;
+#if LIBCURL_VERSION_NUM >= 0x073700
+		curl_off_t uploaded = 0, downloaded = 0;
+#else
+		double uploaded = 0, downloaded = 0;
+#endif
+
+		curl_easy_getinfo(c, CURLINFO_NAMELOOKUP_TIME, &nameLookup);
+		curl_easy_getinfo(c, CURLINFO_CONNECT_TIME, &connect);
+		curl_easy_getinfo(c, CURLINFO_APPCONNECT_TIME, &appConnect);
+		curl_easy_getinfo(c, CURLINFO_PRETRANSFER_TIME, &preTransfer);
+		curl_easy_getinfo(c, CURLINFO_STARTTRANSFER_TIME, &startTransfer);
+		curl_easy_getinfo(c, CURLINFO_TOTAL_TIME, &total);
+#if LIBCURL_VERSION_NUM >= 0x073700
+		curl_easy_getinfo(c, CURLINFO_SIZE_UPLOAD_T, &uploaded);
+		curl_easy_getinfo(c, CURLINFO_SIZE_DOWNLOAD_T, &downloaded);
+#else
+		curl_easy_getinfo(c, CURLINFO_SIZE_UPLOAD, &uploaded);
+		curl_easy_getinfo(c, CURLINFO_SIZE_DOWNLOAD, &downloaded);
+#endif
+		curl_easy_getinfo(c, CURLINFO_RESPONSE_CODE, &timing->httpStatus);
+		curl_easy_getinfo(c, CURLINFO_NUM_CONNECTS, &timing->newConnections);
+
+		timing->nameLookupTime = ToMicroseconds(nameLookup);
+		timing->connectTime    = GetPhase(nameLookup, connect);
+		// APPCONNECT is zero when there was no TLS handshake
+		timing->tlsTime        = appConnect > 0 ? GetPhase(connect, appConnect) : 0;
+		timing->waitTime       = startTransfer > 0 ? GetPhase(preTransfer, startTransfer) : 0;
+		timing->transferTime   = startTransfer > 0 ? GetPhase(startTransfer, total) : 0;
+		timing->totalTime      = ToMicroseconds(total);
+
+		timing->bytesUploaded   = static_cast<uint64_t>(uploaded);
+		timing->bytesDownloaded = static_cast<uint64_t>(downloaded);
+	}
+
+}  // namespace mage
@@ -0,0 +1,58 @@
+#ifndef MAGEREQUEST_TIMING_H
+#define MAGEREQUEST_TIMING_H
+
+#include <string>
+#include <cstdint>
+
+namespace mage {
+
+	enum RequestKind {
+		COMMAND_REQUEST = 0,
+		MSGSTREAM_REQUEST
+	};
+
+	//
+	// Breakdown of one HTTP request, as measured by curl.
+	//
+	// All the durations are in microseconds, and each one only covers
+	// its own phase: when a connection is reused, the name lookup,
+	// connect and TLS times are zero.
+	//
+	struct RequestTiming {
+		RequestTiming();
+
+		RequestKind kind;
+		// Command name, or transport used for the message stream
+		std::string name;
+		std::string url;
+
+		// Empty if the request succeeded
+		std::string error;
+		long httpStatus;
+		// Number of connections opened for this request
+		long newConnections;
+
+		uint64_t nameLookupTime;
+		uint64_t connectTime;
+		uint64_t tlsTime;
+		// From the request being sent to the first byte received
+		uint64_t waitTime;
+		uint64_t transferTime;
+		uint64_t totalTime;
+
+		// Of the bodies, as sent on the wire
+		uint64_t bytesUploaded;
+		uint64_t bytesDownloaded;
+		// Of the response body once decompressed, as given to the sink
+		uint64_t bytesDecoded;
+
+		// Content codings the server accepts in the request bodies, from
+		// the Accept-Encoding header of its response (RFC 7694)
+		std::string acceptEncoding;
+	};
+
+	// Fill the timing from a curl easy handle once its transfer is over
+	void ReadRequestTiming(void *curlHandle, RequestTiming *timing);
+
+}  // namespace mage
+#endif /* MAGEREQUEST_TIMING_H */
@@ -1,4 +1,13 @@
 #include "rpc.h"
+#include "tracepoints.h"
+#include "traceRecorder.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <set>
+#include <cstring>
+#include <memory>
 
 using namespace jsonrpc;
 
@@ -6,19 +15,142 @@ namespace mage {
 
 	static std::vector<std::thread::id> s_runningThreadIds;
 
+	// JSON-RPC 2.0 error code for invalid JSON received
+	static const int JSONRPC_PARSE_ERROR = -32700;
+	// Used by libjson-rpc-cpp when the request could not be sent
+	static const int JSONRPC_CONNECTOR_ERROR = -32003;
+
+	static const char* const CONTENT_ENCODING_GZIP = "Content-Encoding: gzip";
+
+	// State of one command, from its request to its response
+	struct RPC::PendingCommand {
+		explicit PendingCommand(BufferPool *pool)
+		: response(pool)
+		, sink(response.Get())
+		, recorder(nullptr) {}
+
+		std::string name;
+		std::string body;
+		// Endpoint the request is sent to, empty when the command is
+		// rejected by the circuit breakers
+		std::string domain;
+		// Those it could not reach before, never tried again
+		std::set<std::string> failedDomains;
+		// Sent instead of the body when smaller, to the endpoints taking it
+		std::string compressedBody;
+		HttpRequest request;
+		RequestTiming timing;
+		PooledBuffer response;
+		StringSink sink;
+		TrafficRecorder *recorder;
+		TrafficRecord record;
+		// Start of the call, and of its request
+		std::chrono::steady_clock::time_point start;
+		std::chrono::steady_clock::time_point sendTime;
+	};
+
+	static bool GzipCompress(const std::string& data, std::string *output) {
+		z_stream stream;
+		memset(&stream, 0, sizeof(stream));
+
+		if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			return false;
+		}
+
+		output->resize(deflateBound(&stream, static_cast<uLong>(data.size())));
+
+		stream.next_in   = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+		stream.avail_in  = static_cast<uInt>(data.size());
+		stream.next_out  = reinterpret_cast<Bytef*>(&(*output)[0]);
+		stream.avail_out = static_cast<uInt>(output->size());
+
+		int result = deflate(&stream, Z_FINISH);
+		output->resize(stream.total_out);
+		deflateEnd(&stream);
+
+		return result == Z_STREAM_END;
+	}
+
 	RPC::RPC(const std::string& mageApplication,
 	         const std::string& mageDomain,
 	         const std::string& mageProtocol)
 	: m_sProtocol(mageProtocol)
-	, m_sDomain(mageDomain)
+	, m_oEndpoints(mageDomain)
+	, m_sApplication(mageApplication)
+	, m_bShouldRunPollingThread(false)
+	, m_pPollingThread(nullptr)
+	, m_pContext(nullptr)
+	, m_pBufferPool(new BufferPool())
+	, m_pMetrics(new Metrics())
+	, m_pTrafficRecorder(nullptr)
+	, m_pTransport(&m_oCurlTransport)
+	, m_bIsWarmUpEnabled(RPC_WARM_UP)
+	, m_iHttpVersion(RPC_HTTP_VERSION)
+	, m_bIsResponseCompressionEnabled(RPC_RESPONSE_COMPRESSION)
+	, m_iRequestCompressionThreshold(RPC_REQUEST_COMPRESSION_THRESHOLD)
+	, m_bIsContextPolling(false)
+	, m_iPollingRequestId(0)
+	, m_iPendingRequests(0) {
+#if RPC_CIRCUIT_BREAKER
+		m_oEndpoints.SetCircuitBreaker(true, CircuitBreakerSettings());
+#endif
+
+		if (m_bIsWarmUpEnabled) {
+			WarmUp();
+		}
+	}
+
+	RPC::RPC(ClientContext *context,
+	         const std::string& mageApplication,
+	         const std::string& mageDomain,
+	         const std::string& mageProtocol)
+	: m_sProtocol(mageProtocol)
+	, m_oEndpoints(mageDomain)
 	, m_sApplication(mageApplication)
 	, m_bShouldRunPollingThread(false)
-	, m_pPollingThread(nullptr) {
-		m_pHttpClient    = new HttpClient(GetUrl());
-		m_pJsonRpcClient = new Client(m_pHttpClient);
+	, m_pPollingThread(nullptr)
+	, m_pContext(context)
+	, m_pBufferPool((context != nullptr) ? context->GetBufferPool() : new BufferPool())
+	, m_pMetrics((context != nullptr) ? context->GetMetrics() : new Metrics())
+	, m_pTrafficRecorder(nullptr)
+	, m_pTransport((context != nullptr) ? static_cast<HttpTransport*>(context) : &m_oCurlTransport)
+	, m_bIsWarmUpEnabled(RPC_WARM_UP)
+	, m_iHttpVersion(RPC_HTTP_VERSION)
+	, m_bIsResponseCompressionEnabled(RPC_RESPONSE_COMPRESSION)
+	, m_iRequestCompressionThreshold(RPC_REQUEST_COMPRESSION_THRESHOLD)
+	, m_bIsContextPolling(false)
+	, m_iPollingRequestId(0)
+	, m_iPendingRequests(0) {
+#if RPC_CIRCUIT_BREAKER
+		m_oEndpoints.SetCircuitBreaker(true, CircuitBreakerSettings());
+#endif
+
+		if (m_bIsWarmUpEnabled) {
+			WarmUp();
+		}
 	}
 
 	RPC::~RPC() {
+		if (m_pContext != nullptr) {
+			// The requests running on the context call back into this instance
+			{
+				std::lock_guard<std::mutex> lock(pollingThread_mutex);
+				m_bShouldRunPollingThread = false;
+				if (m_bIsContextPolling) {
+					m_pContext->Cancel(m_iPollingRequestId);
+				}
+			}
+
+			std::unique_lock<std::mutex> lock(pendingRequests_mutex);
+			pendingRequests_cv.wait(lock, [this]() { return m_iPendingRequests == 0; });
+		}
+
+		{
+			// Waits for the warm-up threads
+			std::lock_guard<std::mutex> lock(warmUp_mutex);
+			m_oWarmUps.clear();
+		}
+
 		this->CancelAll();
 
 		if (m_pPollingThread != nullptr) {
@@ -28,77 +160,530 @@ namespace mage {
 			delete m_pPollingThread;
 		}
 
-		delete m_pJsonRpcClient;
-		delete m_pHttpClient;
+		if (m_pContext == nullptr) {
+			delete m_pMetrics;
+			delete m_pBufferPool;
+		}
+	}
+
+	// A warm-up request, only kept until it is over
+	struct WarmUpRequest {
+		WarmUpRequest() : sink(&body) {}
+
+		HttpRequest request;
+		RequestTiming timing;
+		std::string body;
+		StringSink sink;
+	};
+
+	void RPC::SetWarmUp(bool isEnabled) {
+		m_bIsWarmUpEnabled = isEnabled;
+
+		if (isEnabled) {
+			WarmUp();
+		}
+	}
+
+	void RPC::SetHttpVersion(HttpVersion version) {
+		m_iHttpVersion = version;
+	}
+
+	void RPC::SetResponseCompression(bool isEnabled) {
+		m_bIsResponseCompressionEnabled = isEnabled;
+	}
+
+	void RPC::SetRequestCompression(size_t threshold) {
+		m_iRequestCompressionThreshold = threshold;
+	}
+
+	void RPC::WarmUp() {
+		HttpTransport *transport = m_pTransport.load(std::memory_order_acquire);
+
+		// The other transports have no connection to open
+		if (transport != &m_oCurlTransport && !IsRunningOnContext()) {
+			return;
+		}
+
+		// A connection for each endpoint, as the message stream keeps one
+		// busy while long polling. The requests only get the headers.
+		std::vector<std::string> domains = m_oEndpoints.GetDomains();
+		std::vector<std::string> urls;
+		{
+			std::lock_guard<std::mutex> lock(jsonrpcUrl_mutex);
+			for (size_t i = 0; i < domains.size(); ++i) {
+				urls.push_back(GetOrigin(domains[i]) + "/" + m_sApplication + "/jsonrpc");
+				urls.push_back(GetOrigin(domains[i]) + "/msgstream");
+			}
+		}
+
+		for (size_t i = 0; i < urls.size(); ++i) {
+			std::shared_ptr<WarmUpRequest> warmUp = std::make_shared<WarmUpRequest>();
+			warmUp->request.url     = urls[i];
+			warmUp->request.isHead  = true;
+			warmUp->request.version = m_iHttpVersion;
+			warmUp->request.timeout = RPC_WARM_UP_TIMEOUT_MS;
+
+			if (IsRunningOnContext()) {
+				BeginRequest();
+				m_pContext->SendAsync(warmUp->request, &warmUp->sink, &warmUp->timing, [this, warmUp]() {
+					EndRequest();
+				});
+				continue;
+			}
+
+			std::lock_guard<std::mutex> lock(warmUp_mutex);
+
+			std::list<std::future<void> >::iterator itr = m_oWarmUps.begin();
+			while (itr != m_oWarmUps.end()) {
+				if (itr->wait_for(std::chrono::seconds::zero()) == std::future_status::ready) {
+					itr = m_oWarmUps.erase(itr);
+				} else {
+					++itr;
+				}
+			}
+
+			m_oWarmUps.push_back(std::async(std::launch::async, [this, warmUp]() {
+				TraceSpan span("http", "warmup", "HEAD");
+				m_oCurlTransport.Send(warmUp->request, &warmUp->sink, &warmUp->timing);
+			}));
+		}
+	}
+
+	bool RPC::IsRunningOnContext() const {
+		return m_pContext != nullptr && m_pTransport.load(std::memory_order_acquire) == m_pContext;
+	}
+
+	void RPC::BeginRequest() const {
+		std::lock_guard<std::mutex> lock(pendingRequests_mutex);
+		++m_iPendingRequests;
+	}
+
+	void RPC::EndRequest() const {
+		std::lock_guard<std::mutex> lock(pendingRequests_mutex);
+		if (--m_iPendingRequests == 0) {
+			pendingRequests_cv.notify_all();
+		}
+	}
+
+	bool RPC::DispatchEvent(const Json::Value& event, std::string *nameBuffer,
+	                        const std::chrono::steady_clock::time_point& arrival) const {
+		if (event.size() != 1 && event.size() != 2) {
+			return false;
+		}
+
+		// Events are passed to the observers by reference: neither the
+		// event nor its data are copied out of the parsed response
+		const Json::Value& name = event[0u];
+		if (name.isString()) {
+			nameBuffer->assign(name.asCString());
+		} else {
+			*nameBuffer = name.asString();
+		}
+
+		if (event.size() == 1) {
+			ReceiveEvent(*nameBuffer);
+		} else {
+			ReceiveEvent(*nameBuffer, event[1u]);
+		}
+
+		uint64_t lag = MicrosecondsSince(arrival);
+		m_pMetrics->RecordEventDelivery(lag);
+		MAGE_TRACE_EVENT_DISPATCHED(nameBuffer->c_str(), lag);
+
+		return true;
 	}
 
 	void RPC::ExtractEventsFromCommandResponse(const Json::Value& myEvents) const {
 		bool hasParseError = false;
 		bool hasInvalidFormatError = false;
 
+		Json::Reader reader;
+		Json::Value event;
+		std::string name;
+
+		std::chrono::steady_clock::time_point arrival = std::chrono::steady_clock::now();
+		uint64_t parseTime = 0;
+
 		for (unsigned int i = 0; i < myEvents.size(); ++i) {
 			// We can only handle string
 			if (!myEvents[i].isString()) {
 				continue;
 			}
 
-			Json::Reader reader;
-			Json::Value event;
-			if (!reader.parse(myEvents[i].asString(), event)) {
+			// Parse the serialized event in place
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			const char *serializedEvent = myEvents[i].asCString();
+			bool isParsed = reader.parse(serializedEvent, serializedEvent + strlen(serializedEvent), event, false);
+			parseTime += MicrosecondsSince(start);
+
+			if (!isParsed) {
 				hasParseError = true;
 				continue;
 			}
 
-			switch (event.size()) {
-				case 1:
-					ReceiveEvent(event[0u].asString());
-					break;
-				case 2:
-					ReceiveEvent(event[0u].asString(), event[1u]);
-					break;
-				default:
-					hasInvalidFormatError = true;
+			if (!DispatchEvent(event, &name, arrival)) {
+				hasInvalidFormatError = true;
 			}
 		}
 
+		m_pMetrics->RecordEventBatch(myEvents.size(), parseTime);
+
 		if (hasParseError) {
-			throw new MageClientError("One of the received events can't be read.");
+			throw MageClientError("One of the received events can't be read.");
 		}
 
 		if (hasInvalidFormatError) {
-			throw new MageClientError("One of the received events has an invalid format.");
+			throw MageClientError("One of the received events has an invalid format.");
 		}
 	}
 
+	void RPC::PrepareCommand(const std::string& name, Json::Value& params, PendingCommand *command) const {
+		command->start = std::chrono::steady_clock::now();
+		command->name  = name;
+
+		MAGE_TRACE_CALL_START(name.c_str());
+
+		Json::Value request;
+		request["jsonrpc"] = "2.0";
+		request["method"]  = name;
+		request["id"]      = 1;
+
+		// The parameters are moved into the request, not copied
+		request["params"].swap(params);
+
+		Json::FastWriter writer;
+		command->body = writer.write(request);
+
+		command->timing.kind = COMMAND_REQUEST;
+		command->timing.name = name;
+		command->domain      = m_oEndpoints.Acquire();
+		command->timing.url  = GetUrl(command->domain);
+
+		command->request.url                   = command->timing.url;
+		command->request.body                  = &command->body;
+		command->request.version               = m_iHttpVersion;
+		command->request.isCompressionAccepted = m_bIsResponseCompressionEnabled;
+		command->request.headers.push_back("Content-Type: application/json");
+		CompressCommand(command);
+
+		command->recorder = m_pTrafficRecorder.load(std::memory_order_acquire);
+
+		sessionKey_mutex.lock();
+		if (!m_sSessionHeader.empty()) {
+			command->request.headers.push_back(m_sSessionHeader);
+		}
+		if (command->recorder != nullptr) {
+			command->record.sessionKey = m_sSessionKey;
+		}
+		sessionKey_mutex.unlock();
+
+		if (!command->domain.empty()) {
+			MAGE_TRACE_HTTP_START(static_cast<int>(COMMAND_REQUEST), command->timing.url.c_str(), command->body.size());
+		}
+
+		command->sendTime = std::chrono::steady_clock::now();
+	}
+
+	void RPC::CompressCommand(PendingCommand *command) const {
+		size_t threshold = m_iRequestCompressionThreshold;
+		if (threshold == 0 || command->body.size() < threshold || !m_oEndpoints.IsGzipAccepted(command->domain)) {
+			return;
+		}
+
+		// Only once: the command may be moved to another endpoint accepting it
+		if (command->compressedBody.empty() && !GzipCompress(command->body, &command->compressedBody)) {
+			command->compressedBody.clear();
+			return;
+		}
+
+		if (command->compressedBody.size() < command->body.size()) {
+			command->request.body = &command->compressedBody;
+			command->request.headers.push_back(CONTENT_ENCODING_GZIP);
+		}
+	}
+
+	Json::Value RPC::ReadCommandResponse(PendingCommand *command) const {
+		if (command->domain.empty()) {
+			throw MageCircuitOpenError("The circuit breaker of every endpoint is open.");
+		}
+
+		RequestTiming& timing = command->timing;
+
+		MAGE_TRACE_HTTP_END(static_cast<int>(timing.kind), timing.url.c_str(), timing.httpStatus,
+		                    timing.totalTime, timing.bytesDownloaded);
+
+		// An endpoint which answered with a client error is not at fault
+		m_oEndpoints.Release(command->domain, timing.httpStatus != 0 && timing.httpStatus < 500, timing.totalTime);
+
+		if (timing.error.empty() && timing.httpStatus != 200) {
+			timing.error = "HTTP error: " + std::to_string(timing.httpStatus);
+		}
+
+		if (command->recorder != nullptr) {
+			command->record.request  = command->body;
+			command->record.response = *command->response.Get();
+			RecordTraffic(command->recorder, &command->record, timing, command->sendTime);
+		}
+
+		ReportRequest(timing);
+
+		// Every response tells which codings its server accepts, if any.
+		// One refusing a compressed body does not take them after all.
+		if (timing.httpStatus == 415 && command->request.body == &command->compressedBody) {
+			m_oEndpoints.SetGzipAccepted(command->domain, false);
+		} else if (timing.httpStatus != 0) {
+			m_oEndpoints.SetGzipAccepted(command->domain, timing.acceptEncoding.find("gzip") != std::string::npos);
+		}
+
+		if (!timing.error.empty()) {
+			throw MageRPCError(JSONRPC_CONNECTOR_ERROR, timing.error);
+		}
+
+		Json::Reader reader;
+		Json::Value message;
+		if (!reader.parse(*command->response.Get(), message, false) || !message.isObject()) {
+			throw MageRPCError(JSONRPC_PARSE_ERROR, "Unable to parse the response.");
+		}
+
+		if (message.isMember("error")) {
+			const Json::Value& error = message["error"];
+			throw MageRPCError(error["code"].asInt(), error["message"].asString());
+		}
+
+		Json::Value res;
+		res.swap(message["result"]);
+
+		return res;
+	}
+
+	void RPC::ReportRequest(const RequestTiming& timing) const {
+		m_pMetrics->RecordTransfer(timing);
+
+		// Called out of the lock: a slow hook does not hold the requests
+		// ending on other threads, and may replace itself
+		std::function<void(const RequestTiming&)> hook;
+		{
+			std::lock_guard<std::mutex> lock(requestHook_mutex);
+			hook = m_oRequestHook;
+		}
+
+		if (hook) {
+			hook(timing);
+		}
+	}
+
+	void RPC::RecordTraffic(TrafficRecorder *recorder, TrafficRecord *record, const RequestTiming& timing,
+	                        const std::chrono::steady_clock::time_point& start) const {
+		record->kind       = timing.kind;
+		record->name       = timing.name;
+		record->timestamp  = recorder->GetTimestamp(start);
+		record->duration   = MicrosecondsSince(start);
+		record->httpStatus = timing.httpStatus;
+		record->url        = timing.url;
+		record->error      = timing.error;
+
+		recorder->Record(*record);
+	}
+
+	void RPC::SetTrafficRecorder(TrafficRecorder *recorder) {
+		m_pTrafficRecorder.store(recorder, std::memory_order_release);
+	}
+
+	void RPC::SetTransport(HttpTransport *transport) {
+		if (transport == nullptr) {
+			transport = (m_pContext != nullptr) ? static_cast<HttpTransport*>(m_pContext) : &m_oCurlTransport;
+		}
+
+		m_pTransport.store(transport, std::memory_order_release);
+	}
+
+	void RPC::SetRequestHook(const std::function<void(const RequestTiming&)>& hook) {
+		std::lock_guard<std::mutex> lock(requestHook_mutex);
+
+		m_oRequestHook = hook;
+	}
+
+	// State of an asynchronous call, shared with the task executing it
+	// so that the parameters and the callback are never copied on the way.
+	// The result is swapped out of the call, but the callback takes it by
+	// value: it is only moved there when jsoncpp has a move constructor
+	// (1.7 and later), and copied with older versions.
+	struct AsyncCall {
+		std::string name;
+		Json::Value params;
+		std::function<void(mage::MageError, Json::Value)> callback;
+	};
+
 	Json::Value RPC::Call(const std::string& name,
 	                      const Json::Value& params) const {
+		return Call(name, Json::Value(params));
+	}
+
+	Json::Value RPC::Call(const std::string& name,
+	                      Json::Value&& params) const {
+		TraceSpan span("call", name);
+
+		PendingCommand command(m_pBufferPool);
+		PrepareCommand(name, params, &command);
+
+		while (!command.domain.empty()) {
+			TraceSpan span("http", name, "POST");
+			m_pTransport.load(std::memory_order_acquire)->Send(command.request, &command.sink, &command.timing);
+
+			if (!FailOver(&command)) {
+				break;
+			}
+		}
+
+		return CompleteCall(&command);
+	}
+
+	bool RPC::FailOver(PendingCommand *command) const {
+		RequestTiming& timing = command->timing;
+
+		// Only when nothing reached the server, which did not run it
+		if (timing.error.empty() || timing.httpStatus != 0 || timing.bytesUploaded != 0) {
+			return false;
+		}
+
+		// Each endpoint at most once: the last error is thrown once none
+		// is left
+		command->failedDomains.insert(command->domain);
+
+		std::string domain = m_oEndpoints.Acquire(command->failedDomains);
+		if (domain.empty()) {
+			return false;
+		}
+
+		m_oEndpoints.Release(command->domain, false, 0);
+		ReportRequest(timing);
+
+		RequestKind kind = timing.kind;
+		timing = RequestTiming();
+		timing.kind = kind;
+		timing.name = command->name;
+		timing.url  = GetUrl(domain);
+
+		command->domain      = domain;
+		command->request.url = timing.url;
+		command->response.Get()->clear();
+
+		// Compressed again only when the new endpoint takes it
+		std::vector<std::string>& headers = command->request.headers;
+		headers.erase(std::remove(headers.begin(), headers.end(), CONTENT_ENCODING_GZIP), headers.end());
+		command->request.body = &command->body;
+		CompressCommand(command);
+		command->sendTime = std::chrono::steady_clock::now();
+
+		return true;
+	}
+
+	Json::Value RPC::CompleteCall(PendingCommand *command) const {
+		const std::string& name = command->name;
 		Json::Value res;
 
 		try {
-			m_pJsonRpcClient->CallMethod(name, params, res);
-		} catch (JsonRpcException ex) {
-			throw MageRPCError(ex.GetCode(), ex.GetMessage());
-		}
+			ReadCommandResponse(command).swap(res);
 
-		if (res.isMember("errorCode")) {
-			throw MageErrorMessage(res["errorCode"].asString());
+			// Commands may answer anything else than an object
+			if (res.isObject() && res.isMember("errorCode")) {
+				throw MageErrorMessage(res["errorCode"].asString());
+			}
+		} catch (const MageError& e) {
+			uint64_t latency = MicrosecondsSince(command->start);
+			m_pMetrics->RecordCommand(name, latency, static_cast<mage_error_t>(e.type()));
+			MAGE_TRACE_CALL_END(name.c_str(), latency, e.type());
+			throw;
 		}
 
+		uint64_t latency = MicrosecondsSince(command->start);
+		m_pMetrics->RecordCommand(name, latency);
+		MAGE_TRACE_CALL_END(name.c_str(), latency, static_cast<int>(MAGE_SUCCESS));
+
 		// If the myEvents array is present
-		if (res.isMember("myEvents") && res["myEvents"].isArray()) {
+		if (res.isObject() && res.isMember("myEvents") && res["myEvents"].isArray()) {
 			ExtractEventsFromCommandResponse(res["myEvents"]);
 		}
 
 		return res;
 	}
 
+	void RPC::CallAsync(const std::string& name, Json::Value&& params,
+	                    const std::function<void(std::exception_ptr, Json::Value&)>& done) const {
+		std::shared_ptr<PendingCommand> command = std::make_shared<PendingCommand>(m_pBufferPool);
+		PrepareCommand(name, params, command.get());
+
+		BeginRequest();
+		SendAsync(command, done);
+	}
+
+	void RPC::SendAsync(const std::shared_ptr<PendingCommand>& command,
+	                    const std::function<void(std::exception_ptr, Json::Value&)>& done) const {
+		// Completed by a worker of the context, without any thread of its own
+		ClientContext::Task complete = [this, command, done]() {
+			if (FailOver(command.get())) {
+				SendAsync(command, done);
+				return;
+			}
+
+			Json::Value res;
+			std::exception_ptr error;
+
+			try {
+				CompleteCall(command.get()).swap(res);
+			} catch (...) {
+				error = std::current_exception();
+			}
+
+			if (TraceRecorder::IsRecording()) {
+				TraceRecorder::Record("call", command->name.c_str(), "context", command->start,
+				                      std::chrono::steady_clock::now());
+			}
+
+			done(error, res);
+			EndRequest();
+		};
+
+		if (command->domain.empty()) {
+			m_pContext->Post(complete);
+		} else {
+			m_pContext->SendAsync(command->request, &command->sink, &command->timing, complete);
+		}
+	}
+
 	std::future<Json::Value> RPC::Call(const std::string& name,
 	                                   const Json::Value& params,
 	                                   bool doAsync) const {
+		return Call(name, Json::Value(params), doAsync);
+	}
+
+	std::future<Json::Value> RPC::Call(const std::string& name,
+	                                   Json::Value&& params,
+	                                   bool doAsync) const {
+		if (doAsync && IsRunningOnContext()) {
+			std::shared_ptr<std::promise<Json::Value> > promise = std::make_shared<std::promise<Json::Value> >();
+			std::future<Json::Value> future = promise->get_future();
+
+			CallAsync(name, std::move(params), [promise](std::exception_ptr error, Json::Value& res) {
+				if (error) {
+					promise->set_exception(error);
+				} else {
+					promise->set_value(std::move(res));
+				}
+			});
+
+			return future;
+		}
+
 		std::launch policy = doAsync ? std::launch::async : std::launch::deferred;
 
-		return std::async(policy, [this, name, params]{
-			return Call(name, params);
+		std::shared_ptr<AsyncCall> call = std::make_shared<AsyncCall>();
+		call->name = name;
+		call->params.swap(params);
+
+		return std::async(policy, [this, call]{
+			TraceSpan span("worker", call->name, "future");
+			return Call(call->name, std::move(call->params));
 		});
 	}
 
@@ -106,17 +691,55 @@ namespace mage {
 	                            const Json::Value& params,
 	                            const std::function<void(mage::MageError, Json::Value)>& callback,
 	                            bool doAsync) const {
+		return Call(name, Json::Value(params), std::function<void(mage::MageError, Json::Value)>(callback), doAsync);
+	}
+
+	std::future<void> RPC::Call(const std::string& name,
+	                            Json::Value&& params,
+	                            std::function<void(mage::MageError, Json::Value)> callback,
+	                            bool doAsync) const {
+		if (doAsync && IsRunningOnContext()) {
+			std::shared_ptr<std::promise<void> > promise = std::make_shared<std::promise<void> >();
+			std::future<void> future = promise->get_future();
+
+			CallAsync(name, std::move(params), [promise, callback](std::exception_ptr error, Json::Value& res) {
+				try {
+					if (error) {
+						std::rethrow_exception(error);
+					}
+
+					mage::MageSuccess ok;
+					callback(ok, std::move(res));
+				} catch (mage::MageError e) {
+					callback(e, res);
+				} catch (...) {
+					promise->set_exception(std::current_exception());
+					return;
+				}
+
+				promise->set_value();
+			});
+
+			return future;
+		}
+
 		std::launch policy = doAsync ? std::launch::async : std::launch::deferred;
 
-		return std::async(policy, [this, name, params, callback]{
+		std::shared_ptr<AsyncCall> call = std::make_shared<AsyncCall>();
+		call->name = name;
+		call->params.swap(params);
+		call->callback = std::move(callback);
+
+		return std::async(policy, [this, call]{
+			TraceSpan span("worker", call->name, "callback");
 			Json::Value res;
 			mage::MageSuccess ok;
 
 			try {
-				res = Call(name, params);
-				callback(ok, res);
+				Call(call->name, std::move(call->params)).swap(res);
+				call->callback(ok, std::move(res));
 			} catch (mage::MageError e) {
-				callback(e, res);
+				call->callback(e, res);
 			}
 		});
 	}
@@ -124,7 +747,19 @@ namespace mage {
 	std::thread::id RPC::Call(const std::string& name,
 	                           const Json::Value& params,
 	                           const std::function<void(mage::MageError, Json::Value)>& callback) {
-		std::thread task = std::thread([this, name, params, callback]{
+		return Call(name, Json::Value(params), std::function<void(mage::MageError, Json::Value)>(callback));
+	}
+
+	std::thread::id RPC::Call(const std::string& name,
+	                           Json::Value&& params,
+	                           std::function<void(mage::MageError, Json::Value)> callback) {
+		std::shared_ptr<AsyncCall> call = std::make_shared<AsyncCall>();
+		call->name = name;
+		call->params.swap(params);
+		call->callback = std::move(callback);
+
+		std::thread task = std::thread([this, call]{
+			TraceSpan span("worker", call->name, "thread");
 			Json::Value res;
 			mage::MageSuccess ok;
 
@@ -132,10 +767,10 @@ namespace mage {
 
 			try {
 				if (IsCancelThread(threadId)) return;
-				res = Call(name, params);
-				if (!IsCancelThread(threadId)) callback(ok, res);
+				Call(call->name, std::move(call->params)).swap(res);
+				if (!IsCancelThread(threadId)) call->callback(ok, std::move(res));
 			} catch (mage::MageError e) {
-				if (!IsCancelThread(threadId)) callback(e, res);
+				if (!IsCancelThread(threadId)) call->callback(e, res);
 			}
 
 			s_runningThreadIds.erase(std::remove(s_runningThreadIds.begin(), s_runningThreadIds.end(), threadId)
@@ -150,21 +785,37 @@ namespace mage {
 	}
 
 	void RPC::SetProtocol(const std::string& mageProtocol) {
-		std::lock_guard<std::mutex> lock(jsonrpcUrl_mutex);
+		{
+			std::lock_guard<std::mutex> lock(jsonrpcUrl_mutex);
 
-		msgStreamUrl_mutex.lock();
-		m_sProtocol = mageProtocol;
-		msgStreamUrl_mutex.unlock();
-		m_pHttpClient->SetUrl(GetUrl());
+			msgStreamUrl_mutex.lock();
+			m_sProtocol = mageProtocol;
+			msgStreamUrl_mutex.unlock();
+		}
+
+		// Until the new servers tell they accept compressed bodies
+		m_oEndpoints.ResetGzipAccepted();
+
+		if (m_bIsWarmUpEnabled) {
+			WarmUp();
+		}
 	}
 
 	void RPC::SetDomain(const std::string& mageDomain) {
-		std::lock_guard<std::mutex> lock(jsonrpcUrl_mutex);
+		SetDomains(std::vector<std::string>(1, mageDomain));
+	}
 
-		msgStreamUrl_mutex.lock();
-		m_sDomain = mageDomain;
-		msgStreamUrl_mutex.unlock();
-		m_pHttpClient->SetUrl(GetUrl());
+	void RPC::SetDomains(const std::vector<std::string>& mageDomains) {
+		if (mageDomains.empty()) {
+			throw MageClientError("No domain given.");
+		}
+
+		// The endpoints already known keep what their server told
+		m_oEndpoints.SetDomains(mageDomains);
+
+		if (m_bIsWarmUpEnabled) {
+			WarmUp();
+		}
 	}
 
 	void RPC::SetApplication(const std::string& mageApplication) {
@@ -173,13 +824,12 @@ namespace mage {
 		msgStreamUrl_mutex.lock();
 		m_sApplication = mageApplication;
 		msgStreamUrl_mutex.unlock();
-		m_pHttpClient->SetUrl(GetUrl());
 	}
 
 	void RPC::SetSession(const std::string& sessionKey) {
 		std::lock_guard<std::mutex> lock(sessionKey_mutex);
 
-		m_pHttpClient->AddHeader("X-MAGE-SESSION", sessionKey);
+		m_sSessionHeader = "X-MAGE-SESSION: " + sessionKey;
 		msgStreamUrl_mutex.lock();
 		m_sSessionKey = sessionKey;
 		msgStreamUrl_mutex.unlock();
@@ -188,13 +838,37 @@ namespace mage {
 	void RPC::ClearSession() const {
 		std::lock_guard<std::mutex> lock(sessionKey_mutex);
 
-		m_pHttpClient->RemoveHeader("X-MAGE-SESSION");
+		m_sSessionHeader.clear();
+	}
+
+	MetricsSnapshot RPC::GetMetrics() const {
+		return m_pMetrics->GetSnapshot();
+	}
+
+	void RPC::SetCircuitBreaker(bool isEnabled, const CircuitBreakerSettings& settings) {
+		m_oEndpoints.SetCircuitBreaker(isEnabled, settings);
+	}
+
+	void RPC::SetCircuitBreakerHook(const EndpointSelector::CircuitHook& hook) {
+		m_oEndpoints.SetCircuitHook(hook);
+	}
+
+	std::vector<EndpointStatus> RPC::GetEndpoints() const {
+		return m_oEndpoints.GetStatus();
 	}
 
 	std::string RPC::GetUrl() const {
+		return GetUrl(m_oEndpoints.GetStickyDomain());
+	}
+
+	std::string RPC::GetUrl(const std::string& domain) const {
 		std::lock_guard<std::mutex> lock(jsonrpcUrl_mutex);
 
-		return m_sProtocol + "://" + m_sDomain + "/" + m_sApplication + "/jsonrpc";
+		return GetOrigin(domain) + "/" + m_sApplication + "/jsonrpc";
+	}
+
+	std::string RPC::GetOrigin(const std::string& domain) const {
+		return FormatOrigin(m_sProtocol, domain);
 	}
 
 	void RPC::Join(std::thread::id threadId) {
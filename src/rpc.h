@@ -2,7 +2,9 @@
 #define MAGERPC_H
 
 #include <string>
+#include <vector>
 #include <list>
+#include <memory>
 #include <functional>
 #include <future>
 #include <mutex>
@@ -13,6 +15,47 @@
 
 #include "exceptions.h"
 #include "eventObserver.h"
+#include "msgStreamParser.h"
+#include "bufferPool.h"
+#include "metrics.h"
+#include "trafficCapture.h"
+#include "curlTransport.h"
+#include "clientContext.h"
+#include "endpointSelector.h"
+
+// Whether the connections are opened as soon as an RPC is created (see
+// RPC::SetWarmUp)
+#ifndef RPC_WARM_UP
+	#define RPC_WARM_UP 0
+#endif
+
+// Time after which a warm-up request is given up, in milliseconds: the
+// RPC waits for them when destroyed
+#ifndef RPC_WARM_UP_TIMEOUT_MS
+	#define RPC_WARM_UP_TIMEOUT_MS 5000
+#endif
+
+// Version of HTTP asked for each request (see RPC::SetHttpVersion)
+#ifndef RPC_HTTP_VERSION
+	#define RPC_HTTP_VERSION mage::HTTP_VERSION_DEFAULT
+#endif
+
+// Whether compressed responses are accepted (see RPC::SetResponseCompression)
+#ifndef RPC_RESPONSE_COMPRESSION
+	#define RPC_RESPONSE_COMPRESSION 1
+#endif
+
+// Size from which the command bodies are compressed, 0 to never compress
+// them (see RPC::SetRequestCompression)
+#ifndef RPC_REQUEST_COMPRESSION_THRESHOLD
+	#define RPC_REQUEST_COMPRESSION_THRESHOLD 0
+#endif
+
+// Whether the commands fail fast once an endpoint is failing (see
+// RPC::SetCircuitBreaker)
+#ifndef RPC_CIRCUIT_BREAKER
+	#define RPC_CIRCUIT_BREAKER 0
+#endif
 
 namespace mage {
 
@@ -26,7 +69,13 @@ namespace mage {
 			RPC(const std::string& mageApplication,
 			    const std::string& mageDomain = "localhost:8080",
 			    const std::string& mageProtocol = "http");
-			~RPC();
+			// Runs the session on the shared context, which must outlive it
+			// (without a context, the same as the above)
+			RPC(ClientContext *context,
+			    const std::string& mageApplication,
+			    const std::string& mageDomain = "localhost:8080",
+			    const std::string& mageProtocol = "http");
+			virtual ~RPC();
 
 			virtual Json::Value Call(const std::string& name,
 			                         const Json::Value& params) const;
@@ -42,6 +91,23 @@ namespace mage {
 			                              const Json::Value& params,
 			                              const std::function<void(mage::MageError, Json::Value)>& callback);
 
+			// The following overloads take the ownership of the parameters:
+			// they are moved up to the serialization of the request, and
+			// never copied (useful for large payloads)
+			virtual Json::Value Call(const std::string& name,
+			                         Json::Value&& params) const;
+			virtual std::future<Json::Value> Call(const std::string& name,
+			                                      Json::Value&& params,
+			                                      bool doAsync) const;
+			virtual std::future<void> Call(const std::string& name,
+			                               Json::Value&& params,
+			                               std::function<void(mage::MageError, Json::Value)> callback,
+			                               bool doAsync) const;
+
+			virtual std::thread::id Call(const std::string& name,
+			                              Json::Value&& params,
+			                              std::function<void(mage::MageError, Json::Value)> callback);
+
 			virtual void ReceiveEvent(const std::string& name,
 			                          const Json::Value& data = Json::Value::null) const;
 			void AddObserver(EventObserver* observer);
@@ -52,10 +118,75 @@ namespace mage {
 
 			void SetProtocol(const std::string& mageProtocol);
 			void SetDomain(const std::string& mageDomain);
+			// Several domains serving the same application: each command
+			// goes to the endpoint with the lowest latency and fewest
+			// requests of two picked at random, and is sent to another one
+			// when it could not reach its endpoint. The message stream
+			// sticks to one endpoint until it fails (see EndpointSelector).
+			void SetDomains(const std::vector<std::string>& mageDomains);
+			std::vector<EndpointStatus> GetEndpoints() const;
+
+			// A circuit breaker per endpoint, which stops sending it commands
+			// once too many of the last ones failed or were slow, and probes
+			// it again after a while (see CircuitBreaker). The commands which
+			// no endpoint can take fail right away with a
+			// MageCircuitOpenError, without waiting for the network: the
+			// callbacks get it as a MageError whose code() is
+			// MageCircuitOpenError::CODE. The message stream is not affected.
+			void SetCircuitBreaker(bool isEnabled,
+			                       const CircuitBreakerSettings& settings = CircuitBreakerSettings());
+			// Called from the requesting thread on each change of state of
+			// a circuit, with the domain of its endpoint
+			void SetCircuitBreakerHook(const EndpointSelector::CircuitHook& hook);
 			void SetApplication(const std::string& mageApplication);
 			void SetSession(const std::string& sessionKey);
 			void ClearSession() const;
 
+			// With a context, the metrics of every session running on it
+			MetricsSnapshot GetMetrics() const;
+
+			// Called from the requesting thread once each HTTP request is
+			// over, successful or not. The requests ending while it is
+			// replaced may still be reported to the previous one.
+			void SetRequestHook(const std::function<void(const RequestTiming&)>& hook);
+
+			// Every request and its response are written in the capture,
+			// which must stay alive until it is removed (nullptr)
+			void SetTrafficRecorder(TrafficRecorder *recorder);
+
+			// Sends the requests through another transport, which must stay
+			// alive until it is removed (nullptr restores the default one: the
+			// context, or a CurlTransport)
+			void SetTransport(HttpTransport *transport);
+
+			// Opens connections to the command and message stream endpoints
+			// in the background, now and after each change of domain or
+			// protocol, so that the first requests skip the name lookup and
+			// the handshakes. Only with the libcurl transport or a context.
+			void SetWarmUp(bool isEnabled);
+
+			// HTTP/2 lets the concurrent requests of the sessions of a context
+			// share one connection to each server. HTTP_VERSION_DEFAULT only
+			// gets it over TLS; HTTP_VERSION_2_PRIOR_KNOWLEDGE also over
+			// cleartext, for servers known to accept it.
+			void SetHttpVersion(HttpVersion version);
+
+			// Lets the server compress the command and message stream
+			// responses (gzip, deflate, and br or zstd when libcurl has
+			// them). They are decompressed as they arrive, and the metrics
+			// count both the bytes received and the decoded ones.
+			void SetResponseCompression(bool isEnabled);
+
+			// Gzips the command bodies of at least threshold bytes (0 never
+			// does), to each endpoint whose server told it accepts them: with
+			// an Accept-Encoding response header (RFC 7694). A command refused
+			// with a 415 fails, and the next ones to that endpoint are sent
+			// uncompressed.
+			void SetRequestCompression(size_t threshold);
+
+			// A Unix domain socket is used with the "http+unix" protocol
+			// (or "https+unix"), and the path of the socket as domain. With
+			// several domains, those of the message stream endpoint.
 			std::string GetUrl() const;
 			std::string GetMsgStreamUrl(Transport transport = SHORTPOLLING) const;
 
@@ -63,32 +194,106 @@ namespace mage {
 			void Cancel(std::thread::id threadId);
 
 		private:
-			void DoHttpGet(std::string *buffer, const std::string& url) const;
-			void ExtractEventsFromMsgStreamResponse(const std::string& response);
+			// Measures the private parts of the event pipeline (bench/)
+			friend class RPCBenchmark;
+
+			struct PendingCommand;
+			typedef std::function<void(MsgStreamParser*, RequestTiming*)> MsgStreamFetch;
+
+			void PrepareCommand(const std::string& name, Json::Value& params, PendingCommand *command) const;
+			// Sends the body gzipped when the endpoint of the command takes it
+			void CompressCommand(PendingCommand *command) const;
+			Json::Value ReadCommandResponse(PendingCommand *command) const;
+			Json::Value CompleteCall(PendingCommand *command) const;
+			// Moves the command to another endpoint when it could not reach
+			// its own, returns true when it must be sent again (at most once
+			// to each endpoint)
+			bool FailOver(PendingCommand *command) const;
+			// Sends the command through the context, done runs in one of its workers
+			void CallAsync(const std::string& name, Json::Value&& params,
+			               const std::function<void(std::exception_ptr, Json::Value&)>& done) const;
+			void SendAsync(const std::shared_ptr<PendingCommand>& command,
+			               const std::function<void(std::exception_ptr, Json::Value&)>& done) const;
+			void DoHttpGet(MsgStreamParser *parser, RequestTiming *timing) const;
+			void FinishHttpGet(MsgStreamParser *parser, const std::exception_ptr& sinkError, RequestTiming *timing,
+			                   TrafficRecorder *recorder, TrafficRecord *record,
+			                   const std::chrono::steady_clock::time_point& start) const;
+			size_t PrepareMsgStream(Transport transport, RequestTiming *timing) const;
+			void ReceiveMsgStream(Transport transport, size_t confirmCount,
+			                      const std::chrono::steady_clock::time_point& start, RequestTiming *timing,
+			                      const MsgStreamFetch& fetch);
+			// Issues the next msgstream request on the context, with
+			// pollingThread_mutex held
+			void PollAsync(Transport transport, std::chrono::milliseconds delay);
+			void WarmUp();
+			bool IsRunningOnContext() const;
+			void BeginRequest() const;
+			void EndRequest() const;
+			void ReportRequest(const RequestTiming& timing) const;
+			void RecordTraffic(TrafficRecorder *recorder, TrafficRecord *record, const RequestTiming& timing,
+			                   const std::chrono::steady_clock::time_point& start) const;
+			bool ExtractEventsFromMsgStreamMessage(const Json::Value& events,
+			                                       const std::chrono::steady_clock::time_point& arrival) const;
 			void ExtractEventsFromCommandResponse(const Json::Value& myEvents) const;
+			bool DispatchEvent(const Json::Value& event, std::string *nameBuffer,
+			                   const std::chrono::steady_clock::time_point& arrival) const;
 			std::string GetConfirmIds() const;
+			std::string GetUrl(const std::string& domain) const;
+			// With jsonrpcUrl_mutex or msgStreamUrl_mutex held
+			std::string GetOrigin(const std::string& domain) const;
 
 			std::string m_sProtocol;
-			std::string m_sDomain;
+			mutable EndpointSelector m_oEndpoints;
 			std::string m_sApplication;
 			std::string m_sSessionKey;
+			mutable std::string m_sSessionHeader;
 
 			std::atomic<bool> m_bShouldRunPollingThread;
 
-			std::list<EventObserver*> m_oObserverList;
+			struct ObserverEntry {
+				EventObserver  *observer;
+				RequestMetrics *metrics;
+			};
+
+			std::list<ObserverEntry>  m_oObserverList;
 			std::list<std::string>    m_oMsgToConfirm;
 
 			std::thread *m_pPollingThread;
 
-			jsonrpc::HttpClient *m_pHttpClient;
-			jsonrpc::Client     *m_pJsonRpcClient;
+			// Those of the context when there is one, owned otherwise
+			ClientContext *m_pContext;
+			BufferPool *m_pBufferPool;
+			Metrics *m_pMetrics;
+
+			std::function<void(const RequestTiming&)> m_oRequestHook;
+			std::atomic<TrafficRecorder*> m_pTrafficRecorder;
+
+			mutable CurlTransport m_oCurlTransport;
+			std::atomic<HttpTransport*> m_pTransport;
+
+			std::atomic<bool> m_bIsWarmUpEnabled;
+			std::atomic<HttpVersion> m_iHttpVersion;
+			std::atomic<bool> m_bIsResponseCompressionEnabled;
+			std::atomic<size_t> m_iRequestCompressionThreshold;
+			// Warm-up requests sent from their own thread, without a context
+			std::list<std::future<void> > m_oWarmUps;
+			std::mutex warmUp_mutex;
 
 			std::condition_variable pollingThread_cv;
 			std::mutex pollingThread_mutex;
+			// Polling on the context, guarded by pollingThread_mutex
+			bool m_bIsContextPolling;
+			uint64_t m_iPollingRequestId;
+
+			// Requests running on the context, which call back this instance
+			mutable std::condition_variable pendingRequests_cv;
+			mutable std::mutex pendingRequests_mutex;
+			mutable size_t m_iPendingRequests;
 			mutable std::recursive_mutex msgStreamUrl_mutex;
 			mutable std::mutex jsonrpcUrl_mutex;
 			mutable std::mutex sessionKey_mutex;
 			mutable std::mutex observerList_mutex;
+			mutable std::mutex requestHook_mutex;
 
 			std::map<std::thread::id, std::thread> m_taskList;
 
@@ -1,15 +1,29 @@
 #include "rpc.h"
-
-#include <curl/curl.h>
+#include "tracepoints.h"
+#include "traceRecorder.h"
 
 #include <iostream>
+#include <algorithm>
+#include <memory>
 #include <chrono>
 #include <thread>
+#include <exception>
+#include <typeinfo>
+#include <cstdlib>
+
+#if defined(__GNUC__)
+	#include <cxxabi.h>
+#endif
 
 #ifndef SHORTPOLLING_INTERVAL_SECS
 	#define SHORTPOLLING_INTERVAL_SECS 5
 #endif
 
+// Delay before polling again after a failed request, on a context
+#ifndef POLLING_RETRY_SECS
+	#define POLLING_RETRY_SECS 1
+#endif
+
 using namespace jsonrpc;
 
 namespace mage {
@@ -17,109 +31,329 @@ namespace mage {
 	void RPC::ReceiveEvent(const std::string& name, const Json::Value& data) const {
 		std::lock_guard<std::mutex> lock(observerList_mutex);
 
-		std::list<EventObserver*>::const_iterator citr;
+		std::list<ObserverEntry>::const_iterator citr;
 		for(citr = m_oObserverList.cbegin();
 		    citr != m_oObserverList.cend(); ++citr) {
-			(*citr)->ReceiveEvent(name, data);
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			TraceSpan span("observer", name, citr->metrics->GetName().c_str());
+
+			try {
+				citr->observer->ReceiveEvent(name, data);
+			} catch (const MageError& e) {
+				citr->metrics->Record(MicrosecondsSince(start), static_cast<mage_error_t>(e.type()));
+				throw;
+			} catch (...) {
+				citr->metrics->Record(MicrosecondsSince(start), MAGE_ERROR);
+				throw;
+			}
+
+			citr->metrics->Record(MicrosecondsSince(start));
+		}
+	}
+
+	// Observers are measured per class
+	static std::string GetObserverName(const EventObserver *observer) {
+		const char *name = typeid(*observer).name();
+
+#if defined(__GNUC__)
+		int status = 0;
+		char *demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+		if (status == 0 && demangled != nullptr) {
+			std::string res(demangled);
+			free(demangled);
+			return res;
 		}
+#endif
+
+		return name;
 	}
 
 	void RPC::AddObserver(EventObserver* observer) {
+		ObserverEntry entry;
+		entry.observer = observer;
+		entry.metrics  = m_pMetrics->GetObserverMetrics(GetObserverName(observer));
+
 		std::lock_guard<std::mutex> lock(observerList_mutex);
 
-		m_oObserverList.push_back(observer);
+		m_oObserverList.push_back(entry);
 	}
 
-	static int writer(char *data, size_t size, size_t nmemb,
-	                  std::string *writerData) {
-		if (writerData == NULL) return 0;
-		writerData->append(data, size*nmemb);
-		return size * nmemb;
+	//
+	// Feeds the parser with the response as it is received
+	//
+	class ParserSink : public ResponseSink {
+		public:
+			ParserSink(MsgStreamParser *parser, std::string *capture)
+			: m_pParser(parser)
+			, m_pCapture(capture) {}
+
+			virtual void Reserve(size_t size) {
+				m_pParser->Reserve(size);
+			}
+
+			virtual bool Write(const char *data, size_t size) {
+				try {
+					if (m_pCapture != nullptr) {
+						m_pCapture->append(data, size);
+					}
+
+					m_pParser->Feed(data, size);
+				} catch (...) {
+					// Exceptions can't go through the transport: abort the
+					// request and rethrow once it returns
+					m_oError = std::current_exception();
+					return false;
+				}
+
+				return true;
+			}
+
+			const std::exception_ptr& GetError() const { return m_oError; }
+
+		private:
+			MsgStreamParser    *m_pParser;
+			// Copy of the response, when the traffic is recorded
+			std::string        *m_pCapture;
+			std::exception_ptr m_oError;
+	};
+
+	void RPC::DoHttpGet(MsgStreamParser *parser, RequestTiming *timing) const {
+		HttpRequest request;
+		request.url                   = timing->url;
+		request.version               = m_iHttpVersion;
+		request.isCompressionAccepted = m_bIsResponseCompressionEnabled;
+
+		TrafficRecorder *recorder = m_pTrafficRecorder.load(std::memory_order_acquire);
+		TrafficRecord record;
+
+		ParserSink sink(parser, (recorder != nullptr) ? &record.response : nullptr);
+
+		MAGE_TRACE_HTTP_START(static_cast<int>(timing->kind), timing->url.c_str(), 0);
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+		{
+			TraceSpan span("http", timing->name, "GET");
+			m_pTransport.load(std::memory_order_acquire)->Send(request, &sink, timing);
+		}
+
+		FinishHttpGet(parser, sink.GetError(), timing, recorder, &record, start);
 	}
 
-	void RPC::DoHttpGet(std::string *buffer, const std::string& url) const {
-		CURL* c = curl_easy_init();
-		if (!c) {
-			throw MageClientError("Unable to pull events. "
-			                      "Unable to initialize curl.");
+	void RPC::FinishHttpGet(MsgStreamParser *parser, const std::exception_ptr& sinkError, RequestTiming *timing,
+	                        TrafficRecorder *recorder, TrafficRecord *record,
+	                        const std::chrono::steady_clock::time_point& start) const {
+		MAGE_TRACE_HTTP_END(static_cast<int>(timing->kind), timing->url.c_str(), timing->httpStatus,
+		                    timing->totalTime, timing->bytesDownloaded);
+
+		if (recorder != nullptr) {
+			RecordTraffic(recorder, record, *timing, start);
+		}
+
+		ReportRequest(*timing);
+		m_oEndpoints.ReportSticky(timing->httpStatus != 0 && timing->httpStatus < 500);
+
+		if (sinkError) {
+			std::rethrow_exception(sinkError);
+		}
+
+		if (!timing->error.empty()) {
+			throw MageClientError("Unable to pull events. " + timing->error);
 		}
 
-		curl_easy_setopt(c, CURLOPT_URL, url.c_str());
-		curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, writer);
-		curl_easy_setopt(c, CURLOPT_WRITEDATA, buffer);
+		parser->Finish();
+	}
 
-		CURLcode res = curl_easy_perform(c);
+	bool RPC::ExtractEventsFromMsgStreamMessage(const Json::Value& events,
+	                                            const std::chrono::steady_clock::time_point& arrival) const {
+		bool isValid = true;
 
-		curl_easy_cleanup(c);
+		// Shared by all the events of the message to avoid reallocating it
+		std::string name;
 
-		if(res != CURLE_OK) {
-			throw MageClientError(std::string("Unable to pull events. "
-			                                  "Curl error: ") +
-                                  curl_easy_strerror(res));
+		for (unsigned int i = 0; i < events.size(); ++i) {
+			if (!DispatchEvent(events[i], &name, arrival)) {
+				isValid = false;
+			}
 		}
+
+		return isValid;
 	}
 
-	void RPC::ExtractEventsFromMsgStreamResponse(const std::string& response) {
-		Json::Reader reader;
-		Json::Value messages;
-		if (!reader.parse(response.c_str(), messages)) {
-			throw MageClientError("Unable to parse the received content from "
-			                      "the message stream.");
+	static mage_error_t GetErrorType(std::exception_ptr error) {
+		try {
+			std::rethrow_exception(error);
+		} catch (const MageError& e) {
+			return static_cast<mage_error_t>(e.type());
+		} catch (...) {
+			return MAGE_ERROR;
 		}
+	}
+
+	size_t RPC::PrepareMsgStream(Transport transport, RequestTiming *timing) const {
+		timing->kind = MSGSTREAM_REQUEST;
+		timing->name = (transport == LONGPOLLING) ? "longpolling" : "shortpolling";
 
+		// Number of messages confirmed by this request
+		std::lock_guard<std::recursive_mutex> lock(msgStreamUrl_mutex);
+		timing->url = GetMsgStreamUrl(transport);
+
+		return m_oMsgToConfirm.size();
+	}
+
+	void RPC::PullEvents(Transport transport) {
+		RequestTiming timing;
+		size_t confirmCount = PrepareMsgStream(transport, &timing);
+
+		TraceSpan span("polling", timing.name);
+
+		ReceiveMsgStream(transport, confirmCount, std::chrono::steady_clock::now(), &timing,
+		                 [this](MsgStreamParser *parser, RequestTiming *timing) {
+			DoHttpGet(parser, timing);
+		});
+	}
+
+	void RPC::ReceiveMsgStream(Transport transport, size_t confirmCount,
+	                           const std::chrono::steady_clock::time_point& start, RequestTiming *timing,
+	                           const MsgStreamFetch& fetch) {
+		std::list<std::string> receivedMsgIds;
 		bool hasInvalidFormatError = false;
+		uint64_t eventCount = 0;
 
-		std::vector<std::string> members = messages.getMemberNames();
-		std::vector<std::string>::const_iterator citr;
-		for (citr = members.begin();
-		    citr != members.end();
-		    ++citr) {
-			for (int i = 0; i < messages[(*citr)].size(); ++i) {
-				Json::Value event = messages[(*citr)][i];
-				switch (event.size()) {
-					case 1:
-						ReceiveEvent(event[0u].asString());
-						break;
-					case 2:
-						ReceiveEvent(event[0u].asString(), event[1u]);
-						break;
-					default:
-						hasInvalidFormatError = true;
-						break;
-				}
+		// Reuse a receive buffer from a previous request
+		PooledBuffer buffer(m_pBufferPool);
+
+		// Events are dispatched as soon as their message is received,
+		// while the rest of the response is still being downloaded
+		MsgStreamParser parser([&](const std::string& msgId, const Json::Value& events) {
+			// The message arrived with the last chunk fed to the parser
+			if (!ExtractEventsFromMsgStreamMessage(events, parser.GetChunkTime())) {
+				hasInvalidFormatError = true;
 			}
+			eventCount += events.size();
+			receivedMsgIds.push_back(msgId);
+		}, buffer.Get());
+
+		try {
+			fetch(&parser, timing);
+		} catch (...) {
+			// Messages already dispatched will be confirmed by the next request
 			msgStreamUrl_mutex.lock();
-			m_oMsgToConfirm.push_back(*citr);
+			m_oMsgToConfirm.splice(m_oMsgToConfirm.end(), receivedMsgIds);
 			msgStreamUrl_mutex.unlock();
-		}
 
-		if (hasInvalidFormatError) {
-			throw new MageClientError("One of the received events has an invalid format.");
+			m_pMetrics->RecordMsgStream(transport, MicrosecondsSince(start), GetErrorType(std::current_exception()));
+			throw;
 		}
-	}
 
-	void RPC::PullEvents(Transport transport) {
-		const std::string url = GetMsgStreamUrl(transport);
-		std::string buffer;
+		m_pMetrics->RecordMsgStream(transport, MicrosecondsSince(start),
+		                           hasInvalidFormatError ? MAGE_CLIENT_ERROR : MAGE_SUCCESS);
+
+		if (confirmCount > 0) {
+			MAGE_TRACE_CONFIRM_SENT(confirmCount);
+		}
 
-		DoHttpGet(&buffer, url);
+		if (!receivedMsgIds.empty()) {
+			m_pMetrics->RecordEventBatch(eventCount, parser.GetParseTime());
+			MAGE_TRACE_MSGSTREAM_BATCH(receivedMsgIds.size(), eventCount, parser.GetParseTime());
+		}
 
 		// The previous messages were confirmed
 		msgStreamUrl_mutex.lock();
-		m_oMsgToConfirm.clear();
+		m_oMsgToConfirm.swap(receivedMsgIds);
 		msgStreamUrl_mutex.unlock();
 
-		// No messages to read
-		if (buffer.empty()) {
-			return;
+		if (hasInvalidFormatError) {
+			throw MageClientError("One of the received events has an invalid format.");
 		}
+	}
 
-		// Heartbeat sent by MAGE
-		if (buffer == "HB") {
+	// A msgstream request running on the context
+	struct PendingPoll {
+		explicit PendingPoll(BufferPool *pool)
+		: response(pool)
+		, sink(response.Get())
+		, confirmCount(0) {}
+
+		HttpRequest request;
+		RequestTiming timing;
+		PooledBuffer response;
+		StringSink sink;
+		size_t confirmCount;
+		std::chrono::steady_clock::time_point start;
+	};
+
+	void RPC::PollAsync(Transport transport, std::chrono::milliseconds delay) {
+		std::shared_ptr<PendingPoll> poll = std::make_shared<PendingPoll>(m_pBufferPool);
+
+		try {
+			poll->confirmCount = PrepareMsgStream(transport, &poll->timing);
+		} catch (const MageError& e) {
+			// The session was cleared: nothing left to poll
+			std::cerr << e.what() << std::endl;
+			m_bIsContextPolling = false;
+			pollingThread_cv.notify_all();
 			return;
 		}
 
-		ExtractEventsFromMsgStreamResponse(buffer);
+		poll->request.url                   = poll->timing.url;
+		poll->request.version               = m_iHttpVersion;
+		poll->request.isCompressionAccepted = m_bIsResponseCompressionEnabled;
+		poll->start = std::chrono::steady_clock::now() + delay;
+
+		MAGE_TRACE_HTTP_START(static_cast<int>(poll->timing.kind), poll->timing.url.c_str(), 0);
+
+		BeginRequest();
+
+		// The response is received by the I/O thread, then parsed and
+		// dispatched by a worker
+		ClientContext::Task done = [this, poll, transport]() {
+			std::chrono::milliseconds next = std::chrono::milliseconds::zero();
+			if (transport == SHORTPOLLING) {
+				next = std::chrono::seconds(SHORTPOLLING_INTERVAL_SECS);
+			}
+
+			// Cancelled by StopPolling
+			bool isCancelled = !m_bShouldRunPollingThread && !poll->timing.error.empty();
+
+			if (!isCancelled) {
+				TraceSpan span("polling", poll->timing.name);
+
+				try {
+					ReceiveMsgStream(transport, poll->confirmCount, poll->start, &poll->timing,
+					                 [this, poll](MsgStreamParser *parser, RequestTiming *timing) {
+						TrafficRecorder *recorder = m_pTrafficRecorder.load(std::memory_order_acquire);
+						TrafficRecord record;
+
+						ParserSink sink(parser, (recorder != nullptr) ? &record.response : nullptr);
+						if (timing->error.empty()) {
+							const std::string& body = *poll->response.Get();
+							sink.Reserve(body.size());
+							sink.Write(body.data(), body.size());
+						}
+
+						FinishHttpGet(parser, sink.GetError(), timing, recorder, &record, poll->start);
+					});
+				} catch (const std::exception& e) {
+					std::cerr << e.what() << std::endl;
+					next = std::max<std::chrono::milliseconds>(next, std::chrono::seconds(POLLING_RETRY_SECS));
+				}
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(pollingThread_mutex);
+				if (m_bShouldRunPollingThread) {
+					PollAsync(transport, next);
+				} else {
+					m_bIsContextPolling = false;
+					pollingThread_cv.notify_all();
+				}
+			}
+
+			EndRequest();
+		};
+
+		m_iPollingRequestId = m_pContext->SendAsync(poll->request, &poll->sink, &poll->timing, done, delay);
 	}
 
 	void RPC::StartPolling(Transport transport) {
@@ -130,11 +364,25 @@ namespace mage {
 		}
 		sessionKey_mutex.unlock();
 
+		if (IsRunningOnContext()) {
+			std::lock_guard<std::mutex> lock(pollingThread_mutex);
+			if (m_bIsContextPolling) {
+				throw MageClientError("A polling thread is already running.");
+			}
+
+			// No thread: each response issues the next request, the first
+			// short polling one waits for the interval as the thread does
+			m_bShouldRunPollingThread = true;
+			m_bIsContextPolling = true;
+			PollAsync(transport, (transport == SHORTPOLLING) ?
+			          std::chrono::seconds(SHORTPOLLING_INTERVAL_SECS) : std::chrono::seconds::zero());
+			return;
+		}
+
 		if (m_pPollingThread != nullptr &&
 		    m_pPollingThread->joinable() == true) {
 			throw MageClientError("A polling thread is already running.");
 		}
-
 		if (m_pPollingThread != nullptr) {
 			delete m_pPollingThread;
 		}
@@ -173,6 +421,17 @@ namespace mage {
 	}
 
 	void RPC::StopPolling() {
+		if (m_pContext != nullptr) {
+			std::unique_lock<std::mutex> lock(pollingThread_mutex);
+			if (m_bIsContextPolling) {
+				m_bShouldRunPollingThread = false;
+				m_pContext->Cancel(m_iPollingRequestId);
+
+				pollingThread_cv.wait(lock, [this]() { return !m_bIsContextPolling; });
+				return;
+			}
+		}
+
 		m_bShouldRunPollingThread = false;
 		pollingThread_cv.notify_all();
 		m_pPollingThread->join();
@@ -204,9 +463,7 @@ namespace mage {
 		std::lock_guard<std::recursive_mutex> lock(msgStreamUrl_mutex);
 
 		std::stringstream ss;
-		ss << m_sProtocol
-		   << "://"
-		   << m_sDomain
+		ss << GetOrigin(m_oEndpoints.GetStickyDomain())
 		   << "/msgstream?transport=";
 
 		switch (transport) {
@@ -0,0 +1,227 @@
+#include "traceRecorder.h"
+
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cstdint>
+
+#include <jsonrpc/rpc.h>
+
+#define TRACE_NAME_SIZE 64
+
+namespace mage {
+
+	struct TraceEvent {
+		const char *category;
+		uint64_t start;
+		uint64_t duration;
+		uint32_t threadId;
+		char name[TRACE_NAME_SIZE];
+		char detail[TRACE_NAME_SIZE];
+	};
+
+	//
+	// Ring buffer written by a single thread. Buffers are never freed:
+	// when a thread exits, its buffer is handed to the next new thread,
+	// so that the threads started for each asynchronous call do not make
+	// the memory grow.
+	//
+	// Only the owner thread changes writeIndex: the events recorded before
+	// the last Start() are discarded by the owner itself, on its next
+	// write, once it sees its generation is behind.
+	//
+	struct ThreadBuffer {
+		ThreadBuffer()
+		: events(TRACE_EVENTS_PER_THREAD)
+		, writeIndex(0)
+		, generation(0)
+		, threadId(0)
+		, inUse(false) {}
+
+		std::vector<TraceEvent> events;
+		std::atomic<uint64_t> writeIndex;
+		// Of the Start() the events in the buffer were recorded after
+		std::atomic<uint64_t> generation;
+		uint32_t threadId;
+		bool inUse;
+	};
+
+	struct ThreadBufferOwner {
+		ThreadBufferOwner() : buffer(nullptr) {}
+		~ThreadBufferOwner();
+
+		ThreadBuffer *buffer;
+	};
+
+	std::atomic<bool> TraceRecorder::s_bIsRecording(false);
+
+	static std::mutex s_oBuffersMutex;
+	static std::vector<ThreadBuffer*> s_oBuffers;
+	static uint32_t s_iNextThreadId = 1;
+	// Bumped by each Start()
+	static std::atomic<uint64_t> s_iGeneration(0);
+	static const std::chrono::steady_clock::time_point s_oEpoch = std::chrono::steady_clock::now();
+
+	static thread_local ThreadBufferOwner t_oBufferOwner;
+
+	ThreadBufferOwner::~ThreadBufferOwner() {
+		if (buffer != nullptr) {
+			std::lock_guard<std::mutex> lock(s_oBuffersMutex);
+			buffer->inUse = false;
+		}
+	}
+
+	static ThreadBuffer* GetThreadBuffer() {
+		if (t_oBufferOwner.buffer != nullptr) {
+			return t_oBufferOwner.buffer;
+		}
+
+		std::lock_guard<std::mutex> lock(s_oBuffersMutex);
+		ThreadBuffer *buffer = nullptr;
+
+		std::vector<ThreadBuffer*>::iterator itr;
+		for (itr = s_oBuffers.begin(); itr != s_oBuffers.end(); ++itr) {
+			if (!(*itr)->inUse) {
+				buffer = *itr;
+				break;
+			}
+		}
+
+		if (buffer == nullptr) {
+			buffer = new ThreadBuffer();
+			s_oBuffers.push_back(buffer);
+		}
+
+		buffer->inUse    = true;
+		buffer->threadId = s_iNextThreadId++;
+		t_oBufferOwner.buffer = buffer;
+		return buffer;
+	}
+
+	static void CopyName(char *dest, const char *source) {
+		if (source == nullptr) {
+			dest[0] = '\0';
+			return;
+		}
+
+		strncpy(dest, source, TRACE_NAME_SIZE - 1);
+		dest[TRACE_NAME_SIZE - 1] = '\0';
+	}
+
+	void TraceRecorder::Start() {
+		s_iGeneration.fetch_add(1, std::memory_order_acq_rel);
+		s_bIsRecording.store(true, std::memory_order_release);
+	}
+
+	void TraceRecorder::Stop() {
+		s_bIsRecording.store(false, std::memory_order_release);
+	}
+
+	void TraceRecorder::Record(const char *category, const char *name, const char *detail,
+	                           const std::chrono::steady_clock::time_point& start,
+	                           const std::chrono::steady_clock::time_point& end) {
+		ThreadBuffer *buffer = GetThreadBuffer();
+
+		uint64_t generation = s_iGeneration.load(std::memory_order_acquire);
+		if (buffer->generation.load(std::memory_order_relaxed) != generation) {
+			buffer->writeIndex.store(0, std::memory_order_relaxed);
+			buffer->generation.store(generation, std::memory_order_release);
+		}
+
+		uint64_t index = buffer->writeIndex.load(std::memory_order_relaxed);
+		TraceEvent& event = buffer->events[index % TRACE_EVENTS_PER_THREAD];
+
+		event.category = category;
+		event.start    = std::chrono::duration_cast<std::chrono::microseconds>(start - s_oEpoch).count();
+		event.duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+		event.threadId = buffer->threadId;
+		CopyName(event.name, name);
+		CopyName(event.detail, detail);
+
+		// Publish the event to GetChromeTrace
+		buffer->writeIndex.store(index + 1, std::memory_order_release);
+	}
+
+	static void WriteEvent(std::ostream& stream, const TraceEvent& event) {
+		stream << "{\"name\":" << Json::valueToQuotedString(event.name)
+		       << ",\"cat\":\"" << event.category << "\""
+		       << ",\"ph\":\"X\",\"pid\":1"
+		       << ",\"tid\":" << event.threadId
+		       << ",\"ts\":" << event.start
+		       << ",\"dur\":" << event.duration;
+
+		if (event.detail[0] != '\0') {
+			stream << ",\"args\":{\"detail\":" << Json::valueToQuotedString(event.detail) << "}";
+		}
+
+		stream << "}";
+	}
+
+	std::string TraceRecorder::GetChromeTrace() {
+		std::ostringstream stream;
+		bool isFirst = true;
+
+		stream << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+		std::lock_guard<std::mutex> lock(s_oBuffersMutex);
+		std::vector<TraceEvent> events;
+		uint64_t generation = s_iGeneration.load(std::memory_order_acquire);
+
+		std::vector<ThreadBuffer*>::const_iterator citr;
+		for (citr = s_oBuffers.begin(); citr != s_oBuffers.end(); ++citr) {
+			const ThreadBuffer *buffer = *citr;
+
+			// Nothing written since the last Start()
+			if (buffer->generation.load(std::memory_order_acquire) != generation) {
+				continue;
+			}
+
+			// The slot of event `end` is the one the owner thread may be writing,
+			// it also holds the oldest event, so leave that one out
+			uint64_t end   = buffer->writeIndex.load(std::memory_order_acquire);
+			uint64_t begin = end >= TRACE_EVENTS_PER_THREAD ? end - TRACE_EVENTS_PER_THREAD + 1 : 0;
+
+			events.clear();
+			for (uint64_t i = begin; i < end; ++i) {
+				events.push_back(buffer->events[i % TRACE_EVENTS_PER_THREAD]);
+			}
+
+			// The owner thread keeps recording while the events are copied,
+			// drop the ones which may have been overwritten meanwhile
+			uint64_t written = buffer->writeIndex.load(std::memory_order_acquire);
+			uint64_t valid   = written >= TRACE_EVENTS_PER_THREAD ? written - TRACE_EVENTS_PER_THREAD + 1 : 0;
+
+			// Or all of them, when Start() was called meanwhile
+			if (buffer->generation.load(std::memory_order_acquire) != generation || written < end) {
+				continue;
+			}
+
+			for (uint64_t i = std::max(begin, valid); i < end; ++i) {
+				if (!isFirst) {
+					stream << ",";
+				}
+
+				WriteEvent(stream, events[i - begin]);
+				isFirst = false;
+			}
+		}
+
+		stream << "]}";
+		return stream.str();
+	}
+
+	bool TraceRecorder::WriteChromeTrace(const std::string& path) {
+		std::ofstream file(path.c_str(), std::ios::out | std::ios::trunc);
+		if (!file) {
+			return false;
+		}
+
+		file << GetChromeTrace();
+		file.close();
+		return !file.fail();
+	}
+
+}  // namespace mage
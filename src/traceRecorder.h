@@ -0,0 +1,91 @@
+#ifndef MAGETRACE_RECORDER_H
+#define MAGETRACE_RECORDER_H
+
+#include <string>
+#include <chrono>
+#include <atomic>
+
+#ifndef TRACE_EVENTS_PER_THREAD
+	#define TRACE_EVENTS_PER_THREAD 16384
+#endif
+
+namespace mage {
+
+	//
+	// Records the activity of the SDK (calls, worker threads, polling,
+	// HTTP requests and observers) as a timeline which can be written in
+	// the Chrome trace event format, and opened in about://tracing or
+	// Perfetto.
+	//
+	// Each thread writes in its own ring buffer of TRACE_EVENTS_PER_THREAD
+	// spans, without any lock: only the latest spans of each thread are
+	// kept. Nothing is recorded until Start() is called.
+	//
+	class TraceRecorder {
+		public:
+			// Discards the spans recorded so far
+			static void Start();
+			static void Stop();
+
+			static bool IsRecording() {
+				return s_bIsRecording.load(std::memory_order_relaxed);
+			}
+
+			static void Record(const char *category, const char *name, const char *detail,
+			                   const std::chrono::steady_clock::time_point& start,
+			                   const std::chrono::steady_clock::time_point& end);
+
+			static std::string GetChromeTrace();
+			static bool WriteChromeTrace(const std::string& path);
+
+		private:
+			static std::atomic<bool> s_bIsRecording;
+	};
+
+	//
+	// Records a span from its construction to its destruction.
+	// The name and the detail must outlive the span.
+	//
+	class TraceSpan {
+		public:
+			TraceSpan(const char *category, const char *name, const char *detail = nullptr)
+			: m_bIsRecording(TraceRecorder::IsRecording()) {
+				if (m_bIsRecording) {
+					Begin(category, name, detail);
+				}
+			}
+
+			TraceSpan(const char *category, const std::string& name, const char *detail = nullptr)
+			: m_bIsRecording(TraceRecorder::IsRecording()) {
+				if (m_bIsRecording) {
+					Begin(category, name.c_str(), detail);
+				}
+			}
+
+			~TraceSpan() {
+				if (m_bIsRecording) {
+					TraceRecorder::Record(m_pCategory, m_pName, m_pDetail,
+					                      m_oStart, std::chrono::steady_clock::now());
+				}
+			}
+
+		private:
+			TraceSpan(const TraceSpan&);
+			TraceSpan& operator=(const TraceSpan&);
+
+			void Begin(const char *category, const char *name, const char *detail) {
+				m_pCategory = category;
+				m_pName     = name;
+				m_pDetail   = detail;
+				m_oStart    = std::chrono::steady_clock::now();
+			}
+
+			bool m_bIsRecording;
+			const char *m_pCategory;
+			const char *m_pName;
+			const char *m_pDetail;
+			std::chrono::steady_clock::time_point m_oStart;
+	};
+
+}  // namespace mage
+#endif /* MAGETRACE_RECORDER_H */
@@ -0,0 +1,56 @@
+#ifndef MAGETRACEPOINTS_H
+#define MAGETRACEPOINTS_H
+
+//
+// Static tracepoints (USDT) on the hot paths of the SDK.
+//
+// They are compiled in when USDT_TRACEPOINTS is defined (cmake
+// -DUSDT_TRACEPOINTS=YES, requires sys/sdt.h from systemtap), and can
+// then be attached to with bpftrace, perf or systemtap:
+//
+//   bpftrace -e 'usdt:./lib/libmage.so:mage:call__end { @[str(arg0)] = hist(arg1); }'
+//
+// A probe which is not attached is a single nop instruction. When
+// USDT_TRACEPOINTS is not defined, they are not compiled at all.
+//
+// Probes (durations are in microseconds):
+//
+//   call__start(name)
+//   call__end(name, latency, mage_error_t)
+//   http__start(kind, url, bytes sent)
+//   http__end(kind, url, HTTP status, total time, bytes received)
+//   msgstream__batch(messages, events, parse time)
+//   event__dispatched(name, delivery lag)
+//   confirm__sent(number of message ids confirmed)
+//
+// kind is a RequestKind (0 for commands, 1 for the message stream).
+//
+
+#if defined(USDT_TRACEPOINTS)
+	#include <sys/sdt.h>
+
+	#define MAGE_TRACE_CALL_START(name) \
+		DTRACE_PROBE1(mage, call__start, name)
+	#define MAGE_TRACE_CALL_END(name, latency, result) \
+		DTRACE_PROBE3(mage, call__end, name, latency, result)
+	#define MAGE_TRACE_HTTP_START(kind, url, bytesSent) \
+		DTRACE_PROBE3(mage, http__start, kind, url, bytesSent)
+	#define MAGE_TRACE_HTTP_END(kind, url, status, totalTime, bytesReceived) \
+		DTRACE_PROBE5(mage, http__end, kind, url, status, totalTime, bytesReceived)
+	#define MAGE_TRACE_MSGSTREAM_BATCH(messages, events, parseTime) \
+		DTRACE_PROBE3(mage, msgstream__batch, messages, events, parseTime)
+	#define MAGE_TRACE_EVENT_DISPATCHED(name, lag) \
+		DTRACE_PROBE2(mage, event__dispatched, name, lag)
+	#define MAGE_TRACE_CONFIRM_SENT(count) \
+		DTRACE_PROBE1(mage, confirm__sent, count)
+#else
+	#define MAGE_TRACE_CALL_START(name)
+	#define MAGE_TRACE_CALL_END(name, latency, result)
+	#define MAGE_TRACE_HTTP_START(kind, url, bytesSent)
+	#define MAGE_TRACE_HTTP_END(kind, url, status, totalTime, bytesReceived)
+	#define MAGE_TRACE_MSGSTREAM_BATCH(messages, events, parseTime)
+	#define MAGE_TRACE_EVENT_DISPATCHED(name, lag)
+	#define MAGE_TRACE_CONFIRM_SENT(count)
+#endif
+
+#endif /* MAGETRACEPOINTS_H */
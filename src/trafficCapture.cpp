@@ -0,0 +1,233 @@
+#include "trafficCapture.h"
+#include "exceptions.h"
+
+#include <cstring>
+
+#define TRAFFIC_CAPTURE_MAGIC "MAGECAP"
+#define TRAFFIC_CAPTURE_MAGIC_SIZE 7
+#define TRAFFIC_CAPTURE_VERSION 1
+// Guards against the sizes read from a corrupted file
+#define TRAFFIC_CAPTURE_MAX_FIELD_SIZE (256 * 1024 * 1024)
+
+namespace mage {
+
+	static void AppendVarint(std::string *buffer, uint64_t value) {
+		while (value >= 0x80) {
+			buffer->push_back(static_cast<char>((value & 0x7f) | 0x80));
+			value >>= 7;
+		}
+		buffer->push_back(static_cast<char>(value));
+	}
+
+	static void AppendString(std::string *buffer, const std::string& value) {
+		AppendVarint(buffer, value.size());
+		buffer->append(value);
+	}
+
+	static void AppendFixed64(std::string *buffer, uint64_t value) {
+		for (int i = 0; i < 8; ++i) {
+			buffer->push_back(static_cast<char>((value >> (i * 8)) & 0xff));
+		}
+	}
+
+	static void ThrowInvalidCapture() {
+		throw MageClientError("The capture file is truncated or invalid.");
+	}
+
+	// Returns false if the end of the file is reached before the first byte
+	static bool ReadVarint(FILE *file, uint64_t *value) {
+		*value = 0;
+
+		for (int shift = 0; shift < 64; shift += 7) {
+			int c = fgetc(file);
+			if (c == EOF) {
+				if (shift == 0) {
+					return false;
+				}
+				ThrowInvalidCapture();
+			}
+
+			*value |= static_cast<uint64_t>(c & 0x7f) << shift;
+			if ((c & 0x80) == 0) {
+				return true;
+			}
+		}
+
+		ThrowInvalidCapture();
+		return false;
+	}
+
+	static void ReadString(FILE *file, std::string *value) {
+		uint64_t size;
+		if (!ReadVarint(file, &size)) {
+			ThrowInvalidCapture();
+		}
+
+		if (size > TRAFFIC_CAPTURE_MAX_FIELD_SIZE) {
+			ThrowInvalidCapture();
+		}
+
+		value->resize(size);
+		if (size > 0 && fread(&(*value)[0], 1, size, file) != size) {
+			ThrowInvalidCapture();
+		}
+	}
+
+	TrafficRecord::TrafficRecord()
+	: kind(COMMAND_REQUEST)
+	, timestamp(0)
+	, duration(0)
+	, httpStatus(0) {}
+
+	TrafficRecorder::TrafficRecorder() : m_pFile(nullptr) {}
+
+	TrafficRecorder::~TrafficRecorder() {
+		Close();
+	}
+
+	bool TrafficRecorder::Open(const std::string& path) {
+		std::lock_guard<std::mutex> lock(m_oMutex);
+
+		if (m_pFile != nullptr) {
+			fclose(m_pFile);
+		}
+
+		m_pFile = fopen(path.c_str(), "wb");
+		if (m_pFile == nullptr) {
+			return false;
+		}
+
+		m_oStart = std::chrono::steady_clock::now();
+		uint64_t startTime = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+
+		m_sBuffer.assign(TRAFFIC_CAPTURE_MAGIC, TRAFFIC_CAPTURE_MAGIC_SIZE);
+		m_sBuffer.push_back(TRAFFIC_CAPTURE_VERSION);
+		AppendFixed64(&m_sBuffer, startTime);
+
+		return fwrite(m_sBuffer.data(), 1, m_sBuffer.size(), m_pFile) == m_sBuffer.size();
+	}
+
+	void TrafficRecorder::Close() {
+		std::lock_guard<std::mutex> lock(m_oMutex);
+
+		if (m_pFile != nullptr) {
+			fclose(m_pFile);
+			m_pFile = nullptr;
+		}
+	}
+
+	bool TrafficRecorder::IsOpen() const {
+		std::lock_guard<std::mutex> lock(m_oMutex);
+		return m_pFile != nullptr;
+	}
+
+	uint64_t TrafficRecorder::GetTimestamp(const std::chrono::steady_clock::time_point& time) const {
+		std::lock_guard<std::mutex> lock(m_oMutex);
+
+		if (time < m_oStart) {
+			return 0;
+		}
+
+		return std::chrono::duration_cast<std::chrono::microseconds>(time - m_oStart).count();
+	}
+
+	void TrafficRecorder::Record(const TrafficRecord& record) {
+		std::lock_guard<std::mutex> lock(m_oMutex);
+
+		if (m_pFile == nullptr) {
+			return;
+		}
+
+		m_sBuffer.clear();
+		m_sBuffer.push_back(static_cast<char>(record.kind));
+		AppendVarint(&m_sBuffer, record.timestamp);
+		AppendVarint(&m_sBuffer, record.duration);
+		AppendVarint(&m_sBuffer, static_cast<uint64_t>(record.httpStatus));
+		AppendString(&m_sBuffer, record.name);
+		AppendString(&m_sBuffer, record.url);
+		AppendString(&m_sBuffer, record.sessionKey);
+		AppendString(&m_sBuffer, record.request);
+		AppendString(&m_sBuffer, record.response);
+		AppendString(&m_sBuffer, record.error);
+
+		fwrite(m_sBuffer.data(), 1, m_sBuffer.size(), m_pFile);
+	}
+
+	TrafficReader::TrafficReader()
+	: m_pFile(nullptr)
+	, m_iStartTime(0) {}
+
+	TrafficReader::~TrafficReader() {
+		Close();
+	}
+
+	bool TrafficReader::Open(const std::string& path) {
+		Close();
+
+		m_pFile = fopen(path.c_str(), "rb");
+		if (m_pFile == nullptr) {
+			return false;
+		}
+
+		unsigned char header[TRAFFIC_CAPTURE_MAGIC_SIZE + 1 + 8];
+		if (fread(header, 1, sizeof(header), m_pFile) != sizeof(header) ||
+		    memcmp(header, TRAFFIC_CAPTURE_MAGIC, TRAFFIC_CAPTURE_MAGIC_SIZE) != 0 ||
+		    header[TRAFFIC_CAPTURE_MAGIC_SIZE] != TRAFFIC_CAPTURE_VERSION) {
+			Close();
+			return false;
+		}
+
+		m_iStartTime = 0;
+		for (int i = 0; i < 8; ++i) {
+			m_iStartTime |= static_cast<uint64_t>(header[TRAFFIC_CAPTURE_MAGIC_SIZE + 1 + i]) << (i * 8);
+		}
+
+		return true;
+	}
+
+	void TrafficReader::Close() {
+		if (m_pFile != nullptr) {
+			fclose(m_pFile);
+			m_pFile = nullptr;
+		}
+	}
+
+	uint64_t TrafficReader::GetStartTime() const {
+		return m_iStartTime;
+	}
+
+	bool TrafficReader::Next(TrafficRecord *record) {
+		if (m_pFile == nullptr) {
+			return false;
+		}
+
+		int kind = fgetc(m_pFile);
+		if (kind == EOF) {
+			return false;
+		}
+
+		if (kind != COMMAND_REQUEST && kind != MSGSTREAM_REQUEST) {
+			ThrowInvalidCapture();
+		}
+
+		uint64_t httpStatus;
+		record->kind = static_cast<RequestKind>(kind);
+		if (!ReadVarint(m_pFile, &record->timestamp) ||
+		    !ReadVarint(m_pFile, &record->duration) ||
+		    !ReadVarint(m_pFile, &httpStatus)) {
+			ThrowInvalidCapture();
+		}
+		record->httpStatus = static_cast<long>(httpStatus);
+
+		ReadString(m_pFile, &record->name);
+		ReadString(m_pFile, &record->url);
+		ReadString(m_pFile, &record->sessionKey);
+		ReadString(m_pFile, &record->request);
+		ReadString(m_pFile, &record->response);
+		ReadString(m_pFile, &record->error);
+
+		return true;
+	}
+
+}  // namespace mage
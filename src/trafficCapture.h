@@ -0,0 +1,91 @@
+#ifndef MAGETRAFFIC_CAPTURE_H
+#define MAGETRAFFIC_CAPTURE_H
+
+#include <string>
+#include <mutex>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+
+#include "requestTiming.h"
+
+namespace mage {
+
+	struct TrafficRecord {
+		TrafficRecord();
+
+		RequestKind kind;
+		// Command name, or transport used for the message stream
+		std::string name;
+		// Since the start of the capture, in microseconds
+		uint64_t timestamp;
+		uint64_t duration;
+		long httpStatus;
+		std::string url;
+		// Sent in the X-MAGE-SESSION header of the commands
+		std::string sessionKey;
+		std::string request;
+		std::string response;
+		// Empty if the request succeeded
+		std::string error;
+	};
+
+	//
+	// Writes every request and its response in a capture file, which
+	// magereplay can send again to a server.
+	//
+	// The file starts with "MAGECAP", a version byte and the start time
+	// of the capture (8 bytes, microseconds since the epoch, little
+	// endian). Each record is then the kind (1 byte), followed by the
+	// timestamp, duration and HTTP status as varints (LEB128), and the
+	// name, URL, session key, request, response and error, each as its
+	// varint size followed by its bytes.
+	//
+	class TrafficRecorder {
+		public:
+			TrafficRecorder();
+			~TrafficRecorder();
+
+			bool Open(const std::string& path);
+			void Close();
+			bool IsOpen() const;
+
+			uint64_t GetTimestamp(const std::chrono::steady_clock::time_point& time) const;
+			void Record(const TrafficRecord& record);
+
+		private:
+			TrafficRecorder(const TrafficRecorder&);
+			TrafficRecorder& operator=(const TrafficRecorder&);
+
+			mutable std::mutex m_oMutex;
+			FILE *m_pFile;
+			std::chrono::steady_clock::time_point m_oStart;
+			// Records are encoded here before being written at once
+			std::string m_sBuffer;
+	};
+
+	class TrafficReader {
+		public:
+			TrafficReader();
+			~TrafficReader();
+
+			bool Open(const std::string& path);
+			void Close();
+
+			// Microseconds since the epoch
+			uint64_t GetStartTime() const;
+
+			// Returns false at the end of the file. Throws a MageClientError
+			// if the file is truncated or is not a capture.
+			bool Next(TrafficRecord *record);
+
+		private:
+			TrafficReader(const TrafficReader&);
+			TrafficReader& operator=(const TrafficReader&);
+
+			FILE *m_pFile;
+			uint64_t m_iStartTime;
+	};
+
+}  // namespace mage
+#endif /* MAGETRAFFIC_CAPTURE_H */